@@ -0,0 +1,19 @@
+#pragma once
+
+#include <sasm/BuildCache.hpp>
+#include <sigma-vm/Image.hpp>
+#include <string>
+#include <vector>
+
+// bump whenever the encoding of assembled modules changes, it invalidates BuildCache entries
+#define SASM_VERSION 2
+
+// runs the Lexer -> Parser -> Linker -> CodeGenerator pipeline, skipping it
+// for modules found in the cache
+class Assembler {
+public:
+	static Image assemble(std::string source, bool object = false, BuildCache *cache = nullptr);
+	// assembles every source into an object module, each on its own thread
+	static std::vector<Image> assembleModules(std::vector<std::string> sources, BuildCache *cache = nullptr);
+	static Image assembleAndLink(std::vector<std::string> sources, BuildCache *cache = nullptr);
+};
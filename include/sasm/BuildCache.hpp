@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <sigma-vm/Image.hpp>
+#include <string>
+
+// on-disk cache of assembled modules keyed on a hash of the source and the
+// toolchain version, safe to share between threads and processes
+class BuildCache {
+private:
+	std::string dir;
+	BuildCache();
+	std::string pathFor(std::string key);
+
+public:
+	BuildCache(std::string dir);
+	// lowercase hex SHA-256 of input, the cache key is one over the source
+	static std::string sha256(const std::string &input);
+	std::string key(const std::string &source, bool object);
+	bool lookup(std::string key, Image &image);
+	void store(std::string key, Image &image);
+};
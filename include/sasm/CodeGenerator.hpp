@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <sasm/Linker.hpp>
 #include <sasm/Parser.hpp>
+#include <sigma-vm/Image.hpp>
 
 class CodeGenerator {
 private:
@@ -14,9 +15,11 @@ private:
 		uint16_t arg;
 	};
 	RegBin convReg(Register r);
+	std::array<uint64_t, 2> encode(Instruction instr);
 
 public:
 	CodeGenerator(Linker parser);
 	std::array<uint64_t, 2> genInstruction();
 	std::vector<std::array<uint64_t, 2>> genAll();
+	Image genImage(bool object = false);
 };
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+enum class ExpressionType {
+	Num,
+	Symbol,
+	Unary,
+	Binary,
+};
+
+enum class Operator {
+	Add,
+	Sub,
+	Mul,
+	Div,
+	Mod,
+	Shl,
+	Shr,
+	Band,
+	Bor,
+	Xor,
+	Neg,
+	Bnot,
+};
+
+std::string toString(Operator op);
+
+// result of an expression together with how many times the image load
+// address is included in it: 0 for absolute values, 1 for addresses.
+// external names an imported symbol that the module linker adds later
+struct ExprValue {
+	uint64_t value;
+	int64_t base;
+	std::string external = "";
+};
+
+// assembler-time integer expression, evaluated by the linker
+struct Expression {
+	ExpressionType type;
+	Operator op;
+	uint64_t numVal;
+	std::string symbol;
+	std::shared_ptr<Expression> left;
+	std::shared_ptr<Expression> right;
+
+	static std::shared_ptr<Expression> makeNum(uint64_t v);
+	static std::shared_ptr<Expression> makeSymbol(std::string name);
+	static std::shared_ptr<Expression> makeUnary(Operator op, std::shared_ptr<Expression> e);
+	static std::shared_ptr<Expression> makeBinary(Operator op, std::shared_ptr<Expression> l, std::shared_ptr<Expression> r);
+
+	bool isConstant();
+	ExprValue evaluate(const std::function<ExprValue(const std::string &)> &resolve);
+	std::string toString();
+
+private:
+	uint64_t evaluateConstant(uint64_t l, uint64_t r);
+};
@@ -34,11 +34,35 @@ enum class TokenType {
 	Jmp,
 	Jiz,
 	Jnz,
+	Lea,
+	Bra,
+	Biz,
+	Bnz,
+	Sys,
+	Cas,
+	Fadd,
+	Fence,
 
 	Comma,
 	Colon,
 	Semicolon,
 
+	Plus,
+	Minus,
+	Star,
+	Slash,
+	Percent,
+	Shl,
+	Shr,
+	Amp,
+	Pipe,
+	Caret,
+	Tilde,
+	LParen,
+	RParen,
+
+	Directive,
+
 	A,
 	B,
 	C,
@@ -59,12 +83,13 @@ std::string toString(TokenType type);
 
 struct Token {
 	TokenType type;
-	uint64_t numVal;
+	uint64_t numVal = 0;
 	std::string wordVal;
 	Token(TokenType type);
 	Token();
 	static Token makeNum(uint64_t numVal);
 	static Token makeWord(std::string wordVal);
+	static Token makeDirective(std::string name);
 	static Token makeAddReg(size_t n);
 	static Token T_EOF();
 	std::string toString();
@@ -79,7 +104,9 @@ private:
 	char next();
 	Token tokenizeNum();
 	Token tokenizeWord();
+	Token tokenizeDirective();
 	std::map<std::string, Token> kwrds;
+	std::map<char, TokenType> operators;
 
 public:
 	Lexer(std::string input);
@@ -4,24 +4,59 @@
 #include <deque>
 #include <format>
 #include <map>
+#include <memory>
+#include <sasm/Expression.hpp>
 #include <sasm/Parser.hpp>
+#include <set>
+#include <sigma-vm/Image.hpp>
 #include <string>
+#include <vector>
 
 class Linker {
 private:
 	Linker();
-	std::map<std::string, uint64_t> labels;
+	struct Label {
+		ImageSection section;
+		uint64_t offset;
+	};
+	std::map<std::string, Label> labels;
+	struct Constant {
+		uint64_t position;
+		std::shared_ptr<Expression> expr;
+	};
+	// every definition of a name in source order, a use sees the last one
+	// before it, or the first one when the name is only defined later
+	std::map<std::string, std::vector<Constant>> constants;
+	std::set<std::pair<std::string, uint64_t>> resolving;
+	std::set<std::string> globals;
+	std::set<std::string> externs;
 	std::deque<Instruction> instructions;
-	std::deque<Instruction> linkedForward;
-	uint64_t resolveLabel(std::string label);
+	std::deque<Instruction> dataWords;
+	std::shared_ptr<Expression> entryExpr;
+	uint64_t entryPosition;
+	const Constant &constantAt(const std::string &name, uint64_t position);
+	ExprValue resolveLabel(std::string label, uint64_t position);
+	uint64_t resolveAddress(std::shared_ptr<Expression> expr, uint64_t position, bool &relocatable, std::string &external);
+	uint64_t position;
 	uint64_t currentAddr;
+	uint64_t dataSize;
+	ImageSection section;
 	void addLabel(std::string label);
+	void addConstant(Instruction instr);
+	void collect();
 	Parser parser;
-	bool linkingForward;
+	bool collected;
 
 public:
 	Linker(Parser parser);
 	Instruction next();
 	std::deque<Instruction> linkAll();
 	bool atEof();
+
+	uint64_t codeSize();
+	uint64_t dataAddr();
+	uint64_t entry();
+	bool hasEntry();
+	std::vector<uint64_t> linkData(std::vector<ImageRelocEntry> &relocs, const std::map<std::string, uint32_t> &symbolIndex);
+	std::vector<ImageSymbol> symbols();
 };
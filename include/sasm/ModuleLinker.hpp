@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <sigma-vm/Image.hpp>
+#include <string>
+#include <vector>
+
+// lays out the sections of separately assembled object modules one after
+// another and resolves references between them
+class ModuleLinker {
+private:
+	ModuleLinker();
+	struct Layout {
+		uint64_t codeBase;
+		uint64_t dataBase;
+	};
+	struct Global {
+		uint64_t value;
+		uint32_t section;
+	};
+	std::vector<Image> modules;
+	std::vector<Layout> layouts;
+	std::map<std::string, Global> globals;
+	uint64_t dataAddr;
+	void layout();
+	void collectGlobals();
+	uint64_t translate(size_t module, uint64_t addr);
+	uint64_t &wordAt(Image &image, uint64_t addr);
+
+public:
+	ModuleLinker(std::vector<Image> modules);
+	Image link();
+};
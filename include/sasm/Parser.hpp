@@ -1,9 +1,12 @@
 #pragma once
 
 #include <deque>
+#include <memory>
 #include <print>
+#include <sasm/Expression.hpp>
 #include <sasm/Lexer.hpp>
 #include <stdexcept>
+#include <vector>
 
 enum class InstructionType {
 	Mov,
@@ -39,7 +42,24 @@ enum class InstructionType {
 	Jiz,
 	Jnz,
 
+	Lea,
+	Bra,
+	Biz,
+	Bnz,
+
+	Sys,
+
+	Cas,
+	Fadd,
+	Fence,
+
 	Label,
+	Constant,
+	Section,
+	Data,
+	Entry,
+	Global,
+	Extern,
 };
 
 std::string toString(InstructionType instr);
@@ -56,18 +76,27 @@ enum class RegisterType {
 };
 
 struct Register {
-	RegisterType type;
-	uint64_t addRegNumber;
+	RegisterType type = RegisterType::A;
+	uint64_t addRegNumber = 0;
 	std::string toString();
 };
 
 struct Instruction {
-	bool expandable;
-	InstructionType type;
+	bool expandable = false;
+	InstructionType type = InstructionType::Label;
 	Register left;
 	Register right;
-	uint64_t arg;
+	uint64_t arg = 0;
 	std::string strVal;
+	std::shared_ptr<Expression> expr;
+	std::vector<std::shared_ptr<Expression>> words;
+	std::vector<std::string> names;
+	std::string external;
+	bool redefinable = false;
+	bool relocatable = false;
+	bool pcRelative = false;
+	uint64_t addr = 0;
+	uint64_t position = 0;
 	std::string toString();
 };
 
@@ -79,6 +108,10 @@ private:
 	void advance();
 	Token peek(uint64_t offset);
 	Register parseReg(Token t);
+	std::shared_ptr<Expression> parseExpression();
+	std::shared_ptr<Expression> parseBinary(size_t level);
+	std::shared_ptr<Expression> parseUnary();
+	Instruction parseDirective(Token t);
 	bool match(TokenType type, Token &t);
 	std::deque<std::pair<TokenType, InstructionType>> ttAndItPairs;
 	Parser();
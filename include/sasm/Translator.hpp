@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sigma-vm/Image.hpp>
+
+// turns a linked image into C++ that runs it natively through the
+// interface in sigma-vm/Native.hpp; every instruction gets a label, known
+// jump targets become gotos and computed ones go through a switch on IP
+class Translator {
+private:
+	std::vector<uint64_t> code;
+	uint64_t base;
+	std::vector<uint64_t> blockLength; // instructions since the last block end, per instruction
+	std::vector<uint64_t> fallLength;  // per instruction, length of the block that falls through into it
+	bool isInstruction(uint64_t addr);
+	std::string reg(uint8_t flag, uint16_t v);
+	std::string jumpTo(uint64_t target);
+	std::string endBlock(uint64_t addr, std::string target);
+	std::string translate(uint64_t addr);
+
+public:
+	// base is the address the image will be loaded at
+	Translator(const Image &image, uint64_t base = 0);
+	std::string translate();
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <sigma-vm/Image.hpp>
+#include <sigma-vm/VirtualMachine.hpp>
+
+// runs many instances of one program in lockstep; every lane is a VM of
+// its own, but while running the registers of all lanes are kept as
+// arrays so each ALU instruction is a single vector loop over the lanes;
+// lanes whose IPs diverge are masked out and the group with the lowest IP
+// runs first, so they meet again where the paths join
+class Batch {
+private:
+	std::vector<std::unique_ptr<VirtualMachine>> lanes;
+	std::vector<StopReason> reasons;
+	// the arrays below are indexed by slot; running lanes are packed into
+	// the first slots as others stop, so the loops get shorter
+	std::vector<uint64_t> slotLane;          // lane in each slot
+	std::vector<uint64_t> regs[NATIVE_REGS]; // per register, per slot; regs[REG_IP] is the IP
+	std::vector<uint64_t> alive, mask;       // ~0 or 0 per slot
+	std::vector<uint64_t *> memory;          // fast path for lane memory
+	std::vector<uint64_t> memoryWords;
+	std::vector<uint64_t> fuel; // per slot, UINT64_MAX for lanes without a limit
+	uint64_t width; // slots in use
+	uint64_t running;
+	uint64_t groupIp;
+	size_t leader;     // first lane of the group
+	bool uniform;      // the group is every running lane and their IPs in regs are stale
+	bool regroup;      // the group has to be picked again
+	bool fueled;       // some lane has a fuel limit
+	bool drained;      // some lane used up its fuel
+	void pickGroup();
+	void compact();
+	void save(uint64_t l);
+	void syncIp();
+	void charge();
+	void stopDrained();
+	void slowLane(size_t l);
+	void slowPath();
+	void execute();
+
+public:
+	// every lane gets its own copy-on-write mapping of the image
+	Batch(const Image &image, uint64_t lanes, uint64_t ramSize);
+	uint64_t size();
+	// set inputs before run() and read results after it
+	VirtualMachine &lane(uint64_t i);
+	StopReason reason(uint64_t i);
+	// runs every lane until it halts, traps, faults or runs out of fuel,
+	// or until maxSteps lockstep steps have passed; every lane pays one
+	// unit of its own fuel per instruction it executes, see setFuel();
+	// returns how many lanes are still running
+	uint64_t run(uint64_t maxSteps = UINT64_MAX);
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#define BIOS_PUTCHAR 0x1001
+#define BIOS_TRAP_VECTOR 0x1002 // B: address of the guest trap handler, 0 to remove it
+#define BIOS_START_CPU 0x1003   // B: entry address, C: value for A; A: number of the new vCPU
+// channels: B: channel handle, C: guest address, R0: words; A: words moved
+#define BIOS_CHAN_SEND 0x1004 // blocks while the channel is full
+#define BIOS_CHAN_RECV 0x1005 // blocks while it is empty, A = 0 once closed and drained
+#define BIOS_CHAN_CLOSE 0x1006
+// asks the host to save a checkpoint, not bound by default; A: 0 right
+// after saving, 1 when the guest is resumed from the checkpoint
+#define BIOS_CHECKPOINT 0x1007
+// guest heap kept by the host, sizes and addresses in words
+#define BIOS_HEAP_INIT 0x1008 // B: base, C: words; the range has to be guest memory, only once
+#define BIOS_ALLOC 0x1009     // B: words; A: address of the block, 0 if it does not fit
+#define BIOS_FREE 0x100a      // B: address of a block or 0, faults on anything else
+#define BIOS_REALLOC 0x100b   // B: address or 0, C: words; A: new address, 0 if it does not fit
+// host files offered with VirtualMachine::offerFile()
+#define BIOS_MAP_FILE 0x100c // B: file handle, C: guest address above memory; A: length in words
+#define BIOS_UNMAP 0x100d    // B: guest address of a mapped file
+// file I/O on an IoPool, the guest is blocked until it is done; B: file
+// handle, C: guest address, R0: words, R1: offset in the file in words;
+// A: words moved, fewer than R0 at the end of the file
+#define BIOS_FILE_READ 0x100e
+#define BIOS_FILE_WRITE 0x100f
+// B: channel handle, moved to the next vCPU this one starts, see
+// VirtualMachine::passChannel()
+#define BIOS_CHAN_PASS 0x1010
+
+// call numbers below this are looked up by index, higher ones in a hash map
+#define BIOS_DIRECT_CALLS 0x4000
+
+class VirtualMachine;
+
+// host callback for a BIOS call: reads its arguments from and writes its
+// results to the registers of vm, and reaches guest memory through vm.ram.span()
+using BiosHandler = std::function<void(VirtualMachine &vm)>;
+
+// table of BIOS calls keyed on the call number the guest puts in A,
+// usually shared by every VM of an embedder
+class Bios {
+private:
+	std::vector<BiosHandler> direct;
+	std::unordered_map<uint64_t, BiosHandler> handlers;
+
+public:
+	Bios();
+	void bind(uint64_t number, BiosHandler handler);
+	void unbind(uint64_t number);
+	// returns false when nothing is bound to number
+	bool call(uint64_t number, VirtualMachine &vm);
+	static std::shared_ptr<Bios> defaults();
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#define BLOCK_TABLE_SIZE 4096  // entries of the direct mapped branch target table, a power of two
+#define BLOCK_MAX_OPS 256      // longer straight line code is split into several blocks
+#define BLOCK_CACHE_LIMIT 65536 // blocks kept before the cache starts over
+
+// pseudo opcodes of decoded instructions, outside of the Cmd values
+#define DECODED_WRITE 0xfffe // MOV, LDI or LEA into IP or FLG, ends the block
+#define DECODED_FAULT 0xffff // instruction that always faults, val holds the TrapCode
+
+// one instruction with its registers resolved for the VM that decoded it;
+// LEA and MOV from IP are turned into LDI of the address they read, and
+// ip-relative branches hold their absolute target
+struct DecodedOp {
+	uint16_t op;
+	uint64_t *left, *right; // right is nullptr for DECODED_WRITE of val
+	uint64_t val;
+};
+
+// straight line code ending in a branch, SYS, write to IP or FLG or a fault
+struct Block {
+	uint64_t start, end; // guest addresses [start, end)
+	std::vector<DecodedOp> ops;
+	// exits, linked the first time they are taken: next is the block at
+	// end, taken the one the last branch went to; jumps take their target
+	// from A, so taken is only followed while the target is still the same
+	Block *next = nullptr;
+	uint64_t target = UINT64_MAX;
+	Block *taken = nullptr;
+};
+
+struct BlockStats {
+	uint64_t blocks;  // decoded blocks in the cache
+	uint64_t decoded; // blocks decoded so far, including dropped ones
+	uint64_t lookups; // block entries that were not linked to the previous block
+	uint64_t flushes; // times the cache started over after a code write
+};
+
+// decoded blocks of one VM, keyed on their guest address
+class BlockCache {
+private:
+	struct Slot {
+		uint64_t ip;
+		Block *block;
+	};
+	std::unordered_map<uint64_t, std::unique_ptr<Block>> blocks;
+	std::vector<Slot> table;
+	uint64_t version = 0;
+	Block *findSlow(uint64_t ip);
+
+public:
+	BlockCache();
+	BlockStats stats{};
+	// block starting at ip, nullptr if it is not decoded yet
+	inline Block *find(uint64_t ip) {
+		Slot &slot = this->table[(ip >> 1) & (BLOCK_TABLE_SIZE - 1)];
+		return slot.ip == ip ? slot.block : this->findSlow(ip);
+	}
+	Block *add(std::unique_ptr<Block> block);
+	// no more blocks may be added until sync() drops them
+	inline bool full() {
+		return this->blocks.size() >= BLOCK_CACHE_LIMIT;
+	}
+	// drops every block when the code version of the memory changed since
+	// they were decoded, or when there are too many; true if it did, which
+	// leaves every Block pointer dangling
+	bool sync(uint64_t codeVersion);
+};
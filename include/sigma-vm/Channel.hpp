@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <vector>
+
+// the side of a channel a VM holds, each one belongs to a single VM
+enum class ChannelEnd {
+	Send,
+	Receive,
+};
+
+// single producer, single consumer ring of words between two VMs; the
+// producer only moves tail and the consumer only moves head, so neither
+// side takes a lock
+class Channel {
+private:
+	std::vector<uint64_t> ring;
+	uint64_t mask;
+	alignas(64) std::atomic<uint64_t> head; // next word to receive
+	uint64_t cachedTail;                    // consumer's last view of tail
+	alignas(64) std::atomic<uint64_t> tail; // next free slot
+	uint64_t cachedHead;                    // producer's last view of head
+	alignas(64) std::atomic<bool> shut;
+	std::atomic<bool> claimed[2];
+	// for wait(): sides that just moved words or closed notify the other
+	// one only while it sleeps
+	std::atomic<uint32_t> sleepers;
+	std::mutex waitLock;
+	std::condition_variable changed;
+	std::function<void()> wakers[2]; // set by park(), under waitLock
+	void notify();
+	bool ready(ChannelEnd end);
+
+public:
+	// capacity is rounded up to a power of two
+	Channel(uint64_t capacity);
+	// queues as many words as fit and returns how many did, never blocks
+	uint64_t send(std::span<const uint64_t> words);
+	// takes up to words.size() words and returns how many it got, never blocks
+	uint64_t receive(std::span<uint64_t> words);
+	// receivers drain what is left and then get 0, senders always get 0
+	void close();
+	bool closed();
+	uint64_t capacity();
+	// takes one end for a VM, throws if it already belongs to another one
+	void claim(ChannelEnd end);
+	// sleeps until end can move words or the channel is closed, or until
+	// the timeout is over
+	void wait(ChannelEnd end, std::chrono::milliseconds timeout);
+	// has wake called once, on the thread of the other side, when end can
+	// move words or the channel is closed; false if it already can, then
+	// wake is not called. unpark() drops a wake that was not called yet
+	bool park(ChannelEnd end, std::function<void()> wake);
+	void unpark(ChannelEnd end);
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sigma-vm/Native.hpp>
+#include <sigma-vm/RAM.hpp>
+
+#define CHECKPOINT_MAGIC 0x50434753 // "SGCP"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_ALIGN 4096 // the header takes one page, guest memory starts after it
+#define CHECKPOINT_PAGE_WORDS (CHECKPOINT_ALIGN / sizeof(uint64_t))
+
+// on-disk layout: this header, then guest memory as it is laid out in the
+// guest, word i at CHECKPOINT_ALIGN + 8 * i; pages that are all zero are
+// never written, so the file is sparse and only costs the pages in use.
+// The state of the guest heap, see GuestHeap::save(), follows memory
+struct CheckpointHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t memoryWords;
+	uint64_t pages; // pages written, for information only
+	uint64_t regs[NATIVE_REGS];
+	uint64_t trapVector;
+	uint64_t heapWords; // 0 without a heap
+};
+
+class Checkpoint {
+public:
+	// writes to a temporary file of its own next to path and renames it
+	// over path, so VMs that still have an older checkpoint at path mapped
+	// keep theirs and writers to the same path never mix their data
+	static void write(std::string path, CheckpointHeader &header, RAM &ram, const std::vector<uint64_t> &heap);
+	// maps guest memory from the file copy-on-write, so restoring does not
+	// depend on the memory size and VMs restored from the same file share
+	// its pages until they write to them; ram must have the same size
+	static CheckpointHeader load(std::string path, RAM &ram, std::vector<uint64_t> &heap);
+};
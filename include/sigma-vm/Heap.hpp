@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include <sigma-vm/RAM.hpp>
+
+#define HEAP_PAGE_WORDS 512   // the heap is handed out in pages of this many words
+#define HEAP_SMALL_WORDS 256  // larger blocks get whole pages of their own
+#define HEAP_SIZE_CLASSES 24
+
+struct HeapStats {
+	uint64_t size;        // words in the heap
+	uint64_t inUse;       // words in live blocks, rounded up to their size class
+	uint64_t blocks;      // live blocks
+	uint64_t freeWords;   // words in free pages
+	uint64_t largestFree; // longest run of free pages in words, the largest block that fits
+	uint64_t slack;       // free slots in pages of small blocks, in words
+	uint64_t allocs, frees;
+};
+
+// allocator for a range of guest memory, used by the heap BIOS calls;
+// everything it knows about the blocks is kept here on the host, the
+// guest range only holds the blocks themselves. Small blocks are rounded
+// up to a size class and packed into pages of one class, larger ones get
+// a run of pages; free pages are merged with their neighbours
+class GuestHeap {
+private:
+	enum Kind : uint8_t {
+		PAGE_FREE,
+		PAGE_SMALL, // blocks of one size class
+		PAGE_LARGE, // first page of a block of its own
+		PAGE_TAIL,  // the other pages of that block
+	};
+	struct Page {
+		Kind kind;
+		uint8_t sizeClass;
+		uint64_t pages; // PAGE_LARGE: length of the run
+		uint32_t used;  // PAGE_SMALL: blocks handed out
+		std::vector<uint16_t> free;     // PAGE_SMALL: free slots
+		std::vector<uint64_t> occupied; // PAGE_SMALL: bit per slot, to catch bad frees
+	};
+	std::mutex lock;
+	uint64_t base, words;
+	std::vector<Page> pages;
+	std::map<uint64_t, uint64_t> freeRuns;  // first page and length of each run of free pages
+	std::vector<uint64_t> partial[HEAP_SIZE_CLASSES]; // pages of each class with free slots
+	HeapStats stats;
+	uint64_t takePages(uint64_t n);
+	void releasePages(uint64_t first, uint64_t n);
+	uint64_t allocLocked(uint64_t words);
+	uint64_t blockWords(uint64_t addr); // throws unless addr is a live block
+	void freeLocked(uint64_t addr);
+	GuestHeap() = default;
+
+public:
+	// manages guest words [base, base + words), base must not be 0 since
+	// 0 stands for a failed allocation
+	GuestHeap(uint64_t base, uint64_t words);
+	// guest address of a new block of at least words words, 0 if it does
+	// not fit; the block is not cleared
+	uint64_t alloc(uint64_t words);
+	// throws on anything that is not a live block, 0 is ignored
+	void free(uint64_t addr);
+	// grows or shrinks a block, in place when its size class still fits,
+	// otherwise through copy; 0 for addr allocates, 0 means it did not fit
+	// and the old block is still there
+	uint64_t realloc(RAM &ram, uint64_t addr, uint64_t words);
+	// usable words of a live block
+	uint64_t size(uint64_t addr);
+	HeapStats getStats();
+	// everything the allocator knows, for checkpoints; load() throws on
+	// anything save() cannot have written
+	std::vector<uint64_t> save();
+	static std::shared_ptr<GuestHeap> load(std::span<const uint64_t> saved);
+};
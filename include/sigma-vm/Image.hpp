@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sigma-vm/RAM.hpp>
+
+#define IMAGE_MAGIC 0x414d4753 // "SGMA"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN 4096 // sections start on page boundaries so they can be mmapped
+#define IMAGE_ALIGN_WORDS (IMAGE_ALIGN / sizeof(uint64_t))
+
+enum ImageFlags {
+	IMAGE_FLAG_OBJECT = 0x1, // module that still has to go through the module linker
+	IMAGE_FLAG_ENTRY = 0x2,  // the entry point was set explicitly
+	IMAGE_FLAG_PIC = 0x4,    // no relocations, runs at any load address as is
+};
+
+enum ImageSection {
+	SECTION_ABS = 0,
+	SECTION_CODE = 1,
+	SECTION_DATA = 2,
+	SECTION_UNDEF = 3, // imported with .extern
+};
+
+enum ImageSymbolFlags {
+	SYM_GLOBAL = 0x1, // exported with .global
+};
+
+enum ImageRelocType {
+	RELOC_BASE = 0,   // add the load address to the word
+	RELOC_SYMBOL = 1, // add the address of the symbol to the word
+	// ip-relative words, only found in object modules
+	RELOC_PCREL = 2,        // local target, adjusted when sections move apart
+	RELOC_PCREL_SYMBOL = 3, // add the distance to the symbol to the word
+};
+
+// on-disk layout, all offsets are in bytes from the start of the file
+struct ImageHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint64_t entry;
+	uint64_t codeOffset;
+	uint64_t codeWords;
+	uint64_t dataOffset;
+	uint64_t dataWords;
+	uint64_t dataAddr; // guest address of the data section relative to the load address
+	uint64_t symOffset;
+	uint64_t symCount;
+	uint64_t relocOffset;
+	uint64_t relocCount;
+	uint64_t strOffset;
+	uint64_t strSize;
+};
+
+struct ImageSymbolEntry {
+	uint64_t nameOffset;
+	uint64_t value;
+	uint32_t section;
+	uint32_t flags;
+};
+
+struct ImageRelocEntry {
+	uint64_t addr; // guest word address relative to the load address
+	uint32_t type;
+	uint32_t symbol;
+};
+
+struct ImageSymbol {
+	std::string name;
+	uint64_t value;
+	uint32_t section;
+	uint32_t flags;
+};
+
+class Image {
+public:
+	uint16_t flags = 0;
+	uint64_t entry = 0;
+	std::vector<uint64_t> code;
+	std::vector<uint64_t> data;
+	uint64_t dataAddr = 0;
+	std::vector<ImageSymbol> symbols;
+	std::vector<ImageRelocEntry> relocs;
+
+	void write(std::string path);
+	static Image read(std::string path);
+	// copies the image into guest memory at base and returns the entry address
+	uint64_t place(RAM &ram, uint64_t base = 0);
+	// maps the image file straight into guest memory at base and returns the entry address
+	static uint64_t load(std::string path, RAM &ram, uint64_t base = 0);
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+#include <sigma-vm/Image.hpp>
+#include <sigma-vm/RAM.hpp>
+
+// an image relocated once for its load address and kept in an anonymous
+// file; every VM maps it copy-on-write, so its pages are shared until a VM
+// writes to them and only the pages a guest changes cost memory
+class SharedImage {
+private:
+	int fd;
+	bool sealed; // the file cannot change, so guests can map it
+	uint64_t codeWords, dataWords;
+	uint64_t dataOffset; // bytes, page aligned
+	SharedImage(const SharedImage &) = delete;
+	SharedImage &operator=(const SharedImage &) = delete;
+
+public:
+	uint64_t base, dataAddr, entry;
+	SharedImage(const Image &image, uint64_t base = 0);
+	~SharedImage();
+	// maps the image into guest memory and returns the entry address,
+	// falls back to copying if base is not page aligned or the file could
+	// not be sealed
+	uint64_t map(RAM &ram);
+};
+
+// shares images between VMs by file and load address
+class ImageCache {
+private:
+	// device, inode, size, modification time and load address
+	using Key = std::tuple<uint64_t, uint64_t, uint64_t, int64_t, int64_t, uint64_t>;
+	std::mutex lock;
+	std::map<Key, std::shared_ptr<SharedImage>> entries;
+
+public:
+	// reads and relocates the image on first use, later calls for the
+	// same unchanged file return the same copy
+	std::shared_ptr<SharedImage> get(std::string path, uint64_t base = 0);
+	void clear();
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define IO_THREADS 4 // threads of the default pool
+
+// host file offered to guests, open for as long as a VM holds it
+struct HostFile {
+	std::string path;
+	bool writable;
+	int fd;
+	HostFile(std::string path, bool writable);
+	~HostFile();
+	HostFile(const HostFile &) = delete;
+	HostFile &operator=(const HostFile &) = delete;
+};
+
+// a read or write of whole words at a word offset of a file; the data is
+// copied in and out of guest memory by the BIOS call on the VM's own
+// thread, so the pool never touches guest memory
+class IoRequest {
+private:
+	std::mutex lock;
+	std::condition_variable finished;
+	bool done = false;
+	std::function<void()> onDone;
+
+public:
+	IoRequest(std::shared_ptr<HostFile> file, bool write, uint64_t offset, uint64_t words);
+	std::shared_ptr<HostFile> file;
+	bool write;
+	uint64_t offset;
+	std::vector<uint64_t> data; // words to write, or the words read, zero padded
+	uint64_t words = 0;         // words moved, a partial last word counts
+	std::string error;          // empty unless the call failed
+	void perform();
+	void complete();
+	bool isDone();
+	// has wake called once the request is done, false if it already is
+	bool park(std::function<void()> wake);
+	void wait();
+};
+
+// threads that carry out file I/O for guests; a VM whose call waits on
+// the pool is blocked and its host thread is free to run other VMs
+class IoPool {
+private:
+	std::mutex lock;
+	std::condition_variable ready;
+	std::deque<std::shared_ptr<IoRequest>> queue;
+	std::vector<std::thread> threads;
+	unsigned size;
+	bool stopping = false;
+	void work();
+
+public:
+	// the threads are started with the first request
+	IoPool(unsigned threads = IO_THREADS);
+	~IoPool();
+	void submit(std::shared_ptr<IoRequest> request);
+	static std::shared_ptr<IoPool> defaults();
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define METRICS_SLICE (1 << 22) // instructions between counter updates of a run without a budget
+#define METRICS_SEND_TIMEOUT_MS 1000 // a scraper that reads slower than this is dropped
+
+// counters of one vCPU, written only by the thread running it with
+// relaxed atomics and read by the exporter at any time
+struct VmMetrics {
+	std::string name;
+	uint64_t cpu;
+	std::atomic<uint64_t> instructions{0};
+	std::atomic<uint64_t> biosCalls{0}; // calls that completed, retries of blocked calls are not counted
+	std::atomic<uint64_t> faults{0};    // traps, handled by the guest or not, and host errors
+	std::atomic<uint64_t> blocked{0};   // runs that stopped on a blocked call
+	std::atomic<uint64_t> memoryWords{0};
+	std::atomic<bool> running{false};   // inside run()
+	VmMetrics(std::string name, uint64_t cpu);
+};
+
+// the counters of every VM that has metrics enabled; VMs that are gone
+// are folded into the process totals
+class Metrics {
+private:
+	struct Totals {
+		uint64_t instructions, biosCalls, faults, blocked;
+	};
+	std::mutex lock;
+	std::vector<std::shared_ptr<VmMetrics>> vms;
+	Totals retired{};
+
+public:
+	std::shared_ptr<VmMetrics> add(std::string name, uint64_t cpu = 0);
+	// Prometheus text exposition format
+	std::string render();
+	static Metrics &process();
+};
+
+enum class MetricsTarget {
+	File,   // rewritten every interval, for a textfile collector
+	Socket, // a Unix socket that sends the metrics to every client that connects
+};
+
+// writes or serves Metrics from a thread of its own until it is destroyed
+class MetricsExporter {
+private:
+	Metrics &metrics;
+	MetricsTarget target;
+	std::string path;
+	unsigned interval;
+	int listener = -1;
+	std::mutex lock;
+	std::condition_variable stopped;
+	bool stopping = false;
+	std::thread thread;
+	bool writeFile();
+	void serve();
+
+public:
+	MetricsExporter(Metrics &metrics, MetricsTarget target, std::string path, unsigned intervalMs = 1000);
+	// a file is written one last time
+	~MetricsExporter();
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+// interface between the VM and programs translated to C++ by sasm's
+// Translator; translated code includes only this header, everything else
+// is reached through the callbacks so the shared library does not link
+// against sigmavm
+
+#define NATIVE_ABI 1
+#define NATIVE_REGS 17 // A, B, C, IP, SP, SBP, FLG in Reg order, then R0-R9
+
+// results besides the StopReason values
+#define NATIVE_CONTINUE -1 // from callbacks: go on with the next instruction
+#define NATIVE_FALLBACK -2 // IP left the translated code, the interpreter takes over
+#define NATIVE_FAULT -3    // trap and IP describe the fault
+
+struct NativeFrame {
+	uint64_t regs[NATIVE_REGS];
+	uint64_t *memory; // guest memory below memoryWords, anything above goes through load and store
+	uint64_t memoryWords;
+	int64_t budget; // charged per basic block like the interpreter
+	int trap;       // TrapCode of a NATIVE_FAULT
+	void *vm;
+	bool (*load)(void *vm, uint64_t addr, uint64_t *value);
+	bool (*store)(void *vm, uint64_t addr, uint64_t value);
+	uint64_t *(*pointer)(void *vm, uint64_t addr); // for atomics, nullptr on a bad address
+	// SYS and FLG writes with regs up to date, IP past the instruction
+	int (*sys)(NativeFrame *frame);
+	int (*flag)(NativeFrame *frame);
+};
+
+// exported by translated programs
+typedef int (*NativeEntry)(NativeFrame *frame);
+#define NATIVE_ENTRY "sigma_native_run"
+#define NATIVE_ABI_SYMBOL "sigma_native_abi"
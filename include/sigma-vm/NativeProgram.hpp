@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include <sigma-vm/Native.hpp>
+
+// a program translated with sasm's Translator and built as a shared
+// library, run it by attaching it to a VM that has the same image loaded
+// with VirtualMachine::setNative()
+class NativeProgram {
+private:
+	void *handle;
+	NativeProgram(const NativeProgram &) = delete;
+	NativeProgram &operator=(const NativeProgram &) = delete;
+
+public:
+	NativeEntry entry;
+	NativeProgram(std::string path);
+	~NativeProgram();
+};
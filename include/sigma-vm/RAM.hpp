@@ -1,15 +1,181 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
+#define RAM_CODE_WORDS 512 // code is tracked in pages of this many words
+
+// thrown when a mapping would take a guest past its memory quota
+class QuotaExceeded : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
 class RAM {
+public:
+	// guest memory handed to host code, with what it held at the time
+	struct TouchLog {
+		std::vector<std::pair<uint64_t, uint64_t>> ranges; // address and words
+		std::vector<uint64_t> before;                      // their contents one after another
+	};
+	struct Watchpoint {
+		uint64_t addr;
+		uint64_t words;
+		bool stop; // stop the run after the write
+	};
+
 private:
-	std::vector<uint64_t> content;
+	struct Region {
+		uint64_t addr;
+		uint64_t words;
+		uint64_t *host;
+		bool writable;
+		size_t fileBytes = 0; // length of the mmap of a host file, 0 for buffers
+	};
+	uint64_t *content;
+	uint64_t size;
+	std::vector<Region> regions;
+	uint64_t quota;
+	uint64_t mapped;
+	TouchLog *touched;
+	std::vector<std::pair<uint64_t, uint64_t>> *watchTouched; // address and old value
+	void logWatched(uint64_t addr, uint64_t words);
+	std::vector<Watchpoint> watchpoints;
+	std::vector<uint32_t> pageWatches; // watchpoints on each host page of guest memory
+	uint64_t pageWords;
+	// a flag per RAM_CODE_WORDS of guest memory that some VM decoded into
+	// blocks; a write there clears it and bumps codeVersion
+	std::unique_ptr<std::atomic<uint8_t>[]> codePages;
+	std::atomic<uint64_t> codeVersion;
+	// started vCPUs still running on this memory; locate() reads regions
+	// without a lock, so they cannot change while there are any
+	std::atomic<uint32_t> runners;
+	void checkRunners();
+	void codeWritten(uint64_t i, uint64_t words);
+	inline void checkCode(uint64_t i) {
+		if (this->codePages[i / RAM_CODE_WORDS].load(std::memory_order_relaxed)) [[unlikely]] {
+			this->codeWritten(i, 1);
+		}
+	}
+	void setPage(uint64_t page, bool writable);
+	uint64_t *locate(uint64_t i, bool write);
+	RAM(const RAM &) = delete;
+	RAM &operator=(const RAM &) = delete;
 
 public:
 	RAM(uint64_t size);
+	RAM(RAM &&other);
+	~RAM();
 	uint64_t getAt(uint64_t i);
 	void setAt(uint64_t i, uint64_t v);
+	// non-throwing accessors for the interpreter, false on a bad address;
+	// relaxed atomics, so plain accesses from one vCPU do not race with
+	// CAS and FADD from another, and cost the same as plain ones
+	inline bool load(uint64_t i, uint64_t &v) {
+		if (i < this->size) {
+			v = std::atomic_ref<uint64_t>(this->content[i]).load(std::memory_order_relaxed);
+			return true;
+		}
+		uint64_t *p = this->locate(i, false);
+		if (!p) {
+			return false;
+		}
+		v = std::atomic_ref<uint64_t>(*p).load(std::memory_order_relaxed);
+		return true;
+	}
+	inline bool store(uint64_t i, uint64_t v) {
+		if (i < this->size) {
+			std::atomic_ref<uint64_t>(this->content[i]).store(v, std::memory_order_relaxed);
+			this->checkCode(i);
+			return true;
+		}
+		uint64_t *p = this->locate(i, true);
+		if (!p) {
+			return false;
+		}
+		std::atomic_ref<uint64_t>(*p).store(v, std::memory_order_relaxed);
+		return true;
+	}
+	// word at i for atomic access, nullptr on a bad address
+	inline uint64_t *pointer(uint64_t i, bool write) {
+		if (i < this->size) {
+			if (write) {
+				this->checkCode(i);
+			}
+			return this->content + i;
+		}
+		return this->locate(i, write);
+	}
+	uint64_t getSize();
+	// limit for guest memory plus mapped buffers in words, throws
+	// QuotaExceeded if more than that is already mapped
+	void setQuota(uint64_t words);
+	uint64_t getQuota();
+	// words the guest can currently address
+	uint64_t used();
+	// direct view of guest memory starting at addr, for host code that works
+	// on guest data in place; throws unless the whole range is mapped
+	std::span<uint64_t> span(uint64_t addr, uint64_t words);
+	// replaces guest memory at addr with a private copy-on-write mapping of
+	// the file, addr and offset must be page aligned
+	// while log is set, every range span() hands out and every setAt() is
+	// added to it, so a recording can find out what host code changed
+	void track(TouchLog *log);
+	// while log is set, the address and old value of every watched word in
+	// a range span() hands out or a word setAt() writes is added to it, so
+	// watched words can be checked after a BIOS call without comparing
+	// all of them
+	void trackWatched(std::vector<std::pair<uint64_t, uint64_t>> *log);
+	// marks guest words a VM decoded; the next write to their pages, by a
+	// store, span(), setAt() or mapFile(), bumps the code version, and VMs
+	// that see it change drop what they decoded
+	void markCode(uint64_t addr, uint64_t words);
+	inline uint64_t getCodeVersion() {
+		return this->codeVersion.load(std::memory_order_relaxed);
+	}
+	// write-protects the host pages under the range, guest stores to them
+	// fault and VirtualMachine checks them against the watchpoints, other
+	// pages are not affected; only for guest memory, and only while no VM
+	// runs on it. Host code must not write to watched pages with setAt()
+	// or span() except from BIOS calls, and mapFile() over them removes the
+	// protection, so watch after loading
+	void watch(uint64_t addr, uint64_t words, bool stop);
+	void unwatch(uint64_t addr);
+	inline bool watching() {
+		return !this->watchpoints.empty();
+	}
+	const std::vector<Watchpoint> &getWatchpoints();
+	// guest address of a host address in a write-protected page, UINT64_MAX
+	// for anything else; async signal safe
+	uint64_t watchedAddress(const void *host);
+	// lifts or restores the protection of every watched page, or of the one
+	// holding addr, for writes that have to go through
+	void openWatched(bool open);
+	void openWatched(uint64_t addr, bool open);
+	void mapFile(uint64_t addr, int fd, uint64_t offset, uint64_t words);
+	// counts a started vCPU in or out; mapBuffer(), mapHostFile() and
+	// unmapBuffer() throw while any is counted in
+	void addRunner();
+	void removeRunner();
+	inline bool hasRunners() {
+		return this->runners.load() != 0;
+	}
+	// exposes a host owned buffer to the guest at addr, which has to be above
+	// guest memory, the buffer must outlive the mapping
+	void mapBuffer(uint64_t addr, uint64_t *buffer, uint64_t words, bool writable = true);
+	// maps a whole host file at addr, above guest memory like a buffer, and
+	// shares its pages with the page cache, so nothing is copied and guest
+	// stores reach the file when writable; the last word is padded with
+	// zeros. Returns the length in words, unmapBuffer() removes it. The
+	// file must not shrink while it is mapped: a load from a page past its
+	// new end raises SIGBUS and kills the host, so only map files nothing
+	// else truncates
+	uint64_t mapHostFile(uint64_t addr, std::string path, bool writable);
+	void unmapBuffer(uint64_t addr);
 };
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sigma-vm/Native.hpp>
+
+#define RECORDING_MAGIC 0x52524753 // "SGRR"
+#define RECORDING_VERSION 1
+#define RECORDING_BUFFER (1 << 16) // bytes collected before they are written out
+#define RECORDING_STATE (NATIVE_REGS + 1) // registers in NativeFrame order, then the trap vector
+
+enum class RecordingMode {
+	Record, // logs every BIOS call of a running guest
+	Replay, // feeds the logged results back instead of calling the BIOS
+};
+
+// how a recorded BIOS call ended
+enum class CallResult : uint8_t {
+	Done,
+	Unbound,   // nothing was bound to the number, the host served the Trap stop
+	HostError, // the handler threw, message holds what()
+	Quota,     // the handler went over the memory quota
+};
+
+// one BIOS call as the guest saw it
+struct RecordedCall {
+	uint64_t ip;     // address of the SYS or of the write to FLG
+	uint64_t number; // A at the call
+	CallResult result;
+	uint64_t state[RECORDING_STATE]; // after the call
+	std::string message;
+	// guest memory the handler changed: address and length of each run,
+	// the new words of all runs one after another in data
+	std::vector<std::pair<uint64_t, uint64_t>> writes;
+	std::vector<uint64_t> data;
+};
+
+// log of everything nondeterministic a guest received; BIOS calls are the
+// only way anything from outside reaches a guest, either through their
+// handlers or through the host serving a Trap stop for an unbound call
+// before the next run, so a VM started from the same image and state and
+// given the same call results runs the same instructions. Calls that block are not logged since they change nothing
+// and are retried. The file holds the state at the start and then one
+// entry per call, with only the registers and words that changed
+class Recording {
+private:
+	std::fstream file;
+	std::string path;
+	RecordingMode mode;
+	uint64_t count = 0;
+	// encoded entries not yet written, or the whole log when replaying
+	std::vector<uint8_t> buffer;
+	size_t used = 0; // bytes of buffer in use
+	size_t pos = 0;  // next byte to read
+	void reserve(size_t bytes);
+	void put(uint64_t v);
+	uint64_t get();
+	Recording(const Recording &) = delete;
+	Recording &operator=(const Recording &) = delete;
+
+public:
+	Recording(std::string path, RecordingMode mode);
+	~Recording();
+	RecordingMode getMode();
+	// calls logged or replayed so far
+	uint64_t calls();
+	// state the guest starts from, written first and read back on replay
+	void begin(uint64_t *state);
+	// before is the state at the call, to encode only what changed
+	void write(const RecordedCall &call, const uint64_t *before);
+	// false at the end of the log, state is the current state
+	bool read(RecordedCall &call, const uint64_t *state);
+	void flush();
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <sigma-vm/VirtualMachine.hpp>
+
+#define SCHEDULER_SLICE 100000 // instructions a VM runs before the next one gets its turn
+
+// runs a set of VMs round robin on a few host threads; a VM that blocks on
+// a channel or on file I/O is left out until the other side or the I/O
+// wakes it, so a few threads can keep many waiting guests going
+class Scheduler {
+private:
+	std::mutex lock;
+	std::condition_variable ready; // the queue got a VM or the run is over
+	std::deque<VirtualMachine *> queue;
+	std::vector<VirtualMachine *> vms;
+	uint64_t live = 0;           // VMs that have not stopped for good
+	uint64_t inFlight = 0;       // VMs a worker is running or parking right now
+	uint64_t parkedIo = 0;       // VMs waiting on I/O, not in the queue
+	uint64_t parkedChannels = 0; // VMs waiting on a channel, not in the queue
+	bool deadlocked = false;
+	unsigned threads;
+	void work();
+	void wake(VirtualMachine *vm, bool io);
+
+public:
+	Scheduler(unsigned threads = 1);
+	// the VM has to be loaded and stay alive until run() returns
+	void add(VirtualMachine &vm);
+	// returns when every VM halted, faulted, ran out of fuel or trapped on
+	// an unbound call; throws if the remaining ones all wait on each other
+	void run();
+};
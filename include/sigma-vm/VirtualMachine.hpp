@@ -5,16 +5,39 @@
 #include <iostream>
 #include <stdexcept>
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sigma-vm/Bios.hpp>
+#include <sigma-vm/BlockCache.hpp>
+#include <sigma-vm/Channel.hpp>
+#include <sigma-vm/Checkpoint.hpp>
+#include <sigma-vm/Heap.hpp>
+#include <sigma-vm/Image.hpp>
+#include <sigma-vm/ImageCache.hpp>
+#include <sigma-vm/IoPool.hpp>
+#include <sigma-vm/Metrics.hpp>
+#include <sigma-vm/NativeProgram.hpp>
 #include <sigma-vm/RAM.hpp>
+#include <sigma-vm/Recording.hpp>
 
 #define ADD_REGS_COUNT 10
+#define CPU_SLICE (1 << 20) // instructions a started vCPU runs between stop checks
+#define CPU_MAX 256         // vCPUs a guest may start, on top of the boot vCPU
+#define BLOCKED_WAIT_MS 10  // longest waitBlocked() sleeps on a channel before it returns
 
 enum Cmd {
 	CMD_MOV = 0x0000, // mov between registers
 	CMD_LOD = 0x0001, // load from mem at b to a
 	CMD_SAV = 0x0002, // store to mem value of a at b
+	// atomic, sequentially consistent, for memory shared between vCPUs
+	CMD_CAS = 0x0003,   // if mem at b equals c store a there; c gets the old value
+	CMD_FADD = 0x0004,  // add a to mem at b; c gets the old value
+	CMD_FENCE = 0x0005, // full memory barrier for plain LOD and SAV
 
 	CMD_LDI = 0x0010, // load from arg to any reg
+	CMD_LEA = 0x0011, // load ip of the next instruction plus arg to any reg
 
 	CMD_ADD = 0x1000,
 	CMD_MIN = 0x1001,
@@ -42,6 +65,12 @@ enum Cmd {
 	CMD_JMP = 0x2000,
 	CMD_JIZ = 0x2001,
 	CMD_JNZ = 0x2002,
+
+	CMD_BRA = 0x2010, // ip-relative: add arg to ip of the next instruction
+	CMD_BIZ = 0x2011,
+	CMD_BNZ = 0x2012,
+
+	CMD_SYS = 0x3000, // BIOS call number A, without going through FLG
 };
 
 enum Reg {
@@ -54,23 +83,288 @@ enum Reg {
 	REG_FLG = 0x0006,
 };
 
+enum class TrapCode {
+	None,
+	BadAddress,    // load, store or instruction fetch outside of mapped memory
+	BadRegister,   // MOV, LDI or LEA named a register that does not exist
+	DivideByZero,  // DIV or MOD with B == 0
+	IllegalOpcode, // unknown instruction
+	HostError,     // a BIOS handler threw, see faultMessage
+	QuotaExceeded, // a BIOS handler tried to map more memory than the quota allows
+};
+
+std::string toString(TrapCode code);
+
+enum class StopReason {
+	Halted,      // the guest cleared FLG
+	Budget,      // the instruction budget ran out, run() can be called again
+	Trap,        // SYS with a call number that has no handler, IP is past the SYS
+	Fault,       // the guest did something invalid and has no trap handler, see trap
+	OutOfFuel,   // the fuel set with setFuel() is used up, refuel to resume
+	OutOfMemory, // a mapping went over the RAM quota, see faultMessage
+	Blocked,     // a BIOS call has to wait, run() retries it next time
+	Watchpoint,  // a write hit a watchpoint set to stop, the write is done and IP is past it
+};
+
+// a write to a watched range
+struct WatchHit {
+	uint64_t ip; // the store, or the SYS for writes from a BIOS call
+	uint64_t addr;
+	uint64_t old, value;
+};
+
+// interpreter variant, chosen with setMode() before running
+enum class ExecMode {
+	Fast,    // production loop, no instrumentation
+	Trace,   // writes every executed instruction to traceOut
+	Profile, // counts executed instructions per opcode in opcodeCounts
+	Blocks,  // decodes basic blocks once and runs them from a cache, see BlockCache
+};
+
+struct CpuSet;
+
 class VirtualMachine {
 private:
 	void biosTick();
+	void flagWritten();
+	bool stopAfterWrite(uint64_t *reg);
+	bool enterTrap(TrapCode code, uint64_t ip);
+	template <class Policy>
+	StopReason execute(int64_t budget);
+	StopReason (VirtualMachine::*runner)(int64_t budget);     // metered
+	StopReason (VirtualMachine::*freeRunner)(int64_t budget); // no budget
+	StopReason guard(StopReason (VirtualMachine::*loop)(int64_t), int64_t budget);
+	StopReason metered(StopReason (VirtualMachine::*loop)(int64_t), uint64_t limit);
+	StopReason step(int64_t budget);
+	std::shared_ptr<NativeProgram> native;
+	StopReason executeNative(int64_t budget);
+	void saveRegisters(uint64_t *regs);
+	void restoreRegisters(const uint64_t *regs);
+	static int nativeSys(NativeFrame *frame);
+	static int nativeFlag(NativeFrame *frame);
+	std::shared_ptr<Recording> recording;
+	// reused for every call so recording does not allocate
+	RecordedCall call;
+	RAM::TouchLog touched;
+	// an unbound call the host serves after the Trap stop, logged or
+	// replayed by finishHostCall() once the guest goes on
+	bool hostCall = false;
+	uint64_t hostBefore[RECORDING_STATE];
+	bool callBios();
+	bool recordBios();
+	bool replayBios();
+	void logCall(const uint64_t *before);
+	void applyCall();
+	void finishHostCall();
+	void saveState(uint64_t *state);
+	void restoreState(const uint64_t *state);
+	int64_t budgetLeft; // what a metered loop had left when it stopped, may be negative
+	uint64_t lastBlock; // start of the current block in a watched metered loop, which
+	                    // keeps it and budgetLeft up to date for runs cut short by a write
+	bool watchStop = false;
+	StopReason runWatched(StopReason (VirtualMachine::*loop)(int64_t), int64_t budget);
+	StopReason executeWatched(bool step, int64_t budget);
+	StopReason watchedWrite(uint64_t addr);
+	bool watchBios();
+	std::vector<std::pair<uint64_t, uint64_t>> watchTouched; // reused by watchBios()
+	bool enterBios();
+	std::shared_ptr<VmMetrics> metrics;
+	StopReason countedRun(uint64_t limit);
+	std::unique_ptr<BlockCache> blocks;
+	Block *findBlock(uint64_t ip);
+	Block *decodeBlock(uint64_t ip);
+	template <bool Metered>
+	StopReason executeBlocks(int64_t budget);
+	uint64_t fuel = UINT64_MAX;
+	ExecMode mode;
+	void traceInstruction(uint64_t ip, uint64_t info, uint64_t val);
 	bool getRunning();
 	void setRunning(bool v);
 	bool getBiosMode();
 	void setBiosMode(bool v);
 	uint64_t *locateRegister(uint8_t flag, uint16_t v);
-	void dumpVm();
+	std::shared_ptr<Bios> bios;
+	std::shared_ptr<RAM> memory;
+	// vCPUs started by the guest; the boot vCPU owns the set, every vCPU
+	// started from it points to the same one
+	std::unique_ptr<CpuSet> ownCpus;
+	CpuSet *cpus = nullptr;
+	struct Endpoint {
+		std::shared_ptr<Channel> channel; // nullptr once passed on
+		ChannelEnd end = ChannelEnd::Send;
+	};
+	std::vector<Endpoint> channels;
+	std::vector<Endpoint> passing; // for the next vCPU this one starts
+	Endpoint waitingOn;            // channel of the call the VM is blocked on
+	Endpoint &endpoint(uint64_t handle);
+	std::shared_ptr<GuestHeap> heap;
+	std::vector<std::shared_ptr<HostFile>> files;
+	std::vector<uint64_t> fileMaps; // addresses this guest mapped with BIOS_MAP_FILE
+	std::shared_ptr<IoPool> io;
+	std::shared_ptr<IoRequest> pendingIo; // started by the SYS the VM is blocked on
+	bool blocked = false;
+	void runCpu();
 	VirtualMachine();
 
 public:
 	VirtualMachine(uint64_t ramSize);
+	// another vCPU over the same memory, with its own registers
+	VirtualMachine(std::shared_ptr<RAM> memory);
+	~VirtualMachine();
 	uint64_t regA, regB, regC;
 	std::array<uint64_t, ADD_REGS_COUNT> addRegs;
 	uint64_t regIp, regSp, regSbp, regFlag;
-	RAM ram;
+	RAM &ram;
+	std::shared_ptr<RAM> getMemory();
 	void launch();
-	void tick();
+	StopReason tick();
+
+	// loads an image and prepares the VM to run from its entry point
+	uint64_t loadImage(Image &image, uint64_t base = 0);
+	uint64_t loadImage(std::string path, uint64_t base = 0);
+	uint64_t loadImage(SharedImage &image);
+	// saves registers, guest memory and the heap; vCPUs, mapped host
+	// buffers and channels are not part of it
+	void checkpoint(std::string path);
+	// goes back to a checkpoint, memory has to be as large as it was
+	void restore(std::string path);
+	// runs until the guest halts, traps or faults, or until the budget is
+	// used up; the budget is only checked at branches, so a run can go over
+	// it by the rest of the current basic block
+	StopReason run(uint64_t maxInstructions);
+	// total instructions the guest may execute over all runs, charged the
+	// same way as the budget; UINT64_MAX (the default) disables metering
+	void setFuel(uint64_t fuel);
+	uint64_t getFuel();
+	// instructions the last run() with a budget or fuel limit executed
+	uint64_t executed = 0;
+	// like run(), but stops after exactly n instructions; checks the budget
+	// after every instruction, so it is only meant for getting to a given
+	// point, like the instruction a replayed failure happened at
+	StopReason runExact(uint64_t n);
+
+	// last fault: what happened and the address of the faulting instruction
+	TrapCode trap;
+	uint64_t faultIp;
+	std::string faultMessage;
+	// when non zero, faults jump here with the trap code in A and the
+	// faulting IP in B instead of stopping the run; cleared on delivery so
+	// a fault inside the handler stops the VM, re-arm with BIOS_TRAP_VECTOR
+	uint64_t trapVector;
+
+	void setMode(ExecMode mode);
+	ExecMode getMode();
+	// what ExecMode::Blocks has decoded so far
+	BlockStats getBlockStats();
+	// counts instructions, BIOS calls, faults and blocked runs of this VM
+	// in Metrics::process() under name, and of every vCPU it starts from
+	// then on; runs without a budget are metered in METRICS_SLICE steps
+	// so the counts move while the guest runs
+	void enableMetrics(std::string name);
+	std::shared_ptr<VmMetrics> getMetrics();
+	// runs the guest through a translated program instead of the
+	// interpreter, the VM must have the image it was translated from
+	// loaded at the same address; nullptr goes back to the interpreter
+	void setNative(std::shared_ptr<NativeProgram> program);
+	// Record: logs the current state and from then on every BIOS call.
+	// Replay: sets the registers to the logged state and answers BIOS calls
+	// from the log without calling the handlers, so the guest has to be
+	// loaded with the same image; a run that strays from the log or goes
+	// past its end faults with HostError. nullptr stops either. vCPUs
+	// and mapped files cannot be recorded: BIOS_START_CPU, BIOS_MAP_FILE and
+	// BIOS_UNMAP fault with HostError while either mode is on, and a VM that
+	// started vCPUs or mapped files throws here
+	void setRecording(std::shared_ptr<Recording> recording);
+	std::ostream *traceOut;
+	std::vector<uint64_t> opcodeCounts;
+	void dumpVm(std::ostream &out);
+	bool halted();
+	uint64_t getRegister(Reg r);
+	void setRegister(Reg r, uint64_t v);
+	// logs guest writes to [addr, addr + words) in watchHits, and stops the
+	// run with StopReason::Watchpoint if stop is set; watched pages are write
+	// protected, so code that does not write to them runs at full speed.
+	// Watchpoints belong to the memory, see RAM::watch; a write lifts the
+	// protection of its page for every thread, so watch() throws while
+	// started vCPUs run and startCpu() throws on watched memory; not for
+	// native programs or batches
+	void watch(uint64_t addr, uint64_t words, bool stop = false);
+	void unwatch(uint64_t addr);
+	std::vector<WatchHit> watchHits;
+	// replaces the BIOS call table, by default every VM uses Bios::defaults()
+	void setBios(std::shared_ptr<Bios> bios);
+	Bios &getBios();
+
+	// makes one end of a channel reachable from the guest and returns its
+	// handle; throws if that end is attached to another VM already
+	uint64_t attachChannel(std::shared_ptr<Channel> channel, ChannelEnd end);
+	// throws on a bad handle, or one for the other end
+	Channel &getChannel(uint64_t handle, ChannelEnd end);
+	// either end, for closing
+	Channel &getChannel(uint64_t handle);
+	// moves an endpoint to the next vCPU this one starts, where handles
+	// count from 0 in the order they were passed; the handle is dead here
+	void passChannel(uint64_t handle);
+	// for BIOS handlers: block() until the endpoint can move words
+	void blockOnChannel(uint64_t handle);
+	// opens a host file for the guest, which names it by the returned
+	// handle in BIOS_MAP_FILE and the file I/O calls; guests cannot open
+	// files on their own
+	uint64_t offerFile(std::string path, bool writable = false);
+	// throws on a bad handle
+	std::shared_ptr<HostFile> getFile(uint64_t handle);
+	// BIOS_MAP_FILE and BIOS_UNMAP: the guest can only unmap what it mapped
+	// itself, not host buffers or files the host mapped. Both throw while
+	// recording or replaying, since the log does not hold the file, and
+	// while started vCPUs run, see RAM::mapHostFile()
+	uint64_t mapFile(uint64_t handle, uint64_t addr);
+	void unmapFile(uint64_t addr);
+	// pool for the file I/O calls, IoPool::defaults() unless set
+	void setIoPool(std::shared_ptr<IoPool> pool);
+	// for BIOS handlers that wait on the pool: startIo() submits the request
+	// and blocks the VM, the call is retried until finishIo() hands back the
+	// done request, before that it returns nullptr and blocks again
+	void startIo(std::shared_ptr<IoRequest> request);
+	bool ioPending();
+	std::shared_ptr<IoRequest> finishIo();
+	// for whoever runs a VM that stopped with StopReason::Blocked: has wake
+	// called when its I/O is done and returns true, false if there is
+	// nothing to wait for; waitIo() just waits
+	bool parkIo(std::function<void()> wake);
+	void waitIo();
+	// the same for I/O or a channel, see Channel::park(); unparkBlocked()
+	// drops a wake that was not called yet
+	bool parkBlocked(std::function<void()> wake);
+	void unparkBlocked();
+	// after StopReason::Blocked: waits for the I/O or the channel the VM is
+	// blocked on, for channels at most BLOCKED_WAIT_MS, so the caller can
+	// look for a reason to stop in between
+	void waitBlocked();
+	// heap for the allocation BIOS calls, set by the host or by the guest
+	// with BIOS_HEAP_INIT; vCPUs get the heap of the vCPU that starts them
+	void setHeap(std::shared_ptr<GuestHeap> heap);
+	// BIOS_HEAP_INIT: throws if there is a heap already
+	void initHeap(uint64_t base, uint64_t words);
+	// throws when there is none
+	GuestHeap &getHeap();
+	// called by a BIOS handler that cannot finish yet: run() stops with
+	// StopReason::Blocked and the SYS is executed again on the next run,
+	// so the handler must leave the registers alone
+	void block();
+
+	// starts a vCPU at ip with arg in A on its own host thread; it shares
+	// RAM, BIOS and mode with this one, gets the channels passed with
+	// passChannel() and no others, and runs until it halts, traps,
+	// faults or runs out of fuel; with a fuel limit it takes half of what
+	// this one has left, so a guest cannot multiply its fuel by starting
+	// vCPUs; returns its number, the boot vCPU is 0, throws past CPU_MAX,
+	// while recording or replaying and on watched memory
+	uint64_t startCpu(uint64_t ip, uint64_t arg);
+	// asks every started vCPU to stop after its current slice
+	void stopCpus();
+	// waits for every started vCPU, only the host may call this
+	void joinCpus();
+	// started vCPU by number, for inspecting registers and faults after a join
+	VirtualMachine *getCpu(uint64_t id);
+	uint64_t cpuId = 0;
 };
@@ -0,0 +1,458 @@
+#include <sigma-vm/Batch.hpp>
+#include <sigma-vm/ImageCache.hpp>
+#include <stdexcept>
+
+// AVX2 and plain builds of the lane kernels, picked at load time
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LANE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_KERNEL
+#endif
+
+// register index in Batch::regs, -1 if there is no such register
+static int regIndex(uint8_t flag, uint16_t v) {
+	if (flag != 0) {
+		return v < ADD_REGS_COUNT ? 7 + v : -1;
+	}
+	return v <= REG_FLG ? v : -1;
+}
+
+template <class F>
+static inline void blend(uint64_t *dst, const uint64_t *mask, uint64_t n, F f) {
+	for (uint64_t l = 0; l < n; l++) {
+		dst[l] = (f(l) & mask[l]) | (dst[l] & ~mask[l]);
+	}
+}
+
+// C = A op B on the masked lanes, false for opcodes that are not plain ALU ops
+LANE_KERNEL static bool alu(uint16_t op, uint64_t *c, const uint64_t *a, const uint64_t *b, const uint64_t *mask, uint64_t n) {
+	switch (op) {
+	case CMD_ADD:
+		blend(c, mask, n, [&](uint64_t l) { return a[l] + b[l]; });
+		break;
+	case CMD_MIN:
+		blend(c, mask, n, [&](uint64_t l) { return a[l] - b[l]; });
+		break;
+	case CMD_MUL:
+		blend(c, mask, n, [&](uint64_t l) { return a[l] * b[l]; });
+		break;
+	case CMD_GTH:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] > b[l]); });
+		break;
+	case CMD_LTH:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] < b[l]); });
+		break;
+	case CMD_GEQ:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] >= b[l]); });
+		break;
+	case CMD_LEQ:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] <= b[l]); });
+		break;
+	case CMD_EQU:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] == b[l]); });
+		break;
+	case CMD_NEQ:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] != b[l]); });
+		break;
+	case CMD_LAND:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] && b[l]); });
+		break;
+	case CMD_LOR:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)(a[l] || b[l]); });
+		break;
+	case CMD_NOT:
+		blend(c, mask, n, [&](uint64_t l) { return (uint64_t)!a[l]; });
+		break;
+	case CMD_BAND:
+		blend(c, mask, n, [&](uint64_t l) { return a[l] & b[l]; });
+		break;
+	case CMD_BOR:
+		blend(c, mask, n, [&](uint64_t l) { return a[l] | b[l]; });
+		break;
+	case CMD_BNOT:
+		blend(c, mask, n, [&](uint64_t l) { return ~a[l]; });
+		break;
+	case CMD_XOR:
+		blend(c, mask, n, [&](uint64_t l) { return a[l] ^ b[l]; });
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+LANE_KERNEL static void fill(uint64_t *dst, uint64_t value, const uint64_t *mask, uint64_t n) {
+	blend(dst, mask, n, [&](uint64_t) { return value; });
+}
+
+LANE_KERNEL static void copy(uint64_t *dst, const uint64_t *src, const uint64_t *mask, uint64_t n) {
+	blend(dst, mask, n, [&](uint64_t l) { return src[l]; });
+}
+
+// IP after a conditional jump: target where B matches, next elsewhere
+LANE_KERNEL static void branch(uint64_t *ip, const uint64_t *target, uint64_t targetValue, const uint64_t *b, bool ifZero, uint64_t next, const uint64_t *mask, uint64_t n) {
+	blend(ip, mask, n, [&](uint64_t l) {
+		uint64_t t = target ? target[l] : targetValue;
+		return (b[l] == 0) == ifZero ? t : next;
+	});
+}
+
+Batch::Batch(const Image &image, uint64_t lanes, uint64_t ramSize)
+    : width(0), running(0), groupIp(0), leader(0), uniform(false), regroup(true), fueled(false), drained(false) {
+	SharedImage shared(image);
+	for (uint64_t l = 0; l < lanes; l++) {
+		auto vm = std::make_unique<VirtualMachine>(ramSize);
+		vm->loadImage(shared);
+		this->lanes.push_back(std::move(vm));
+	}
+	this->reasons.resize(lanes, StopReason::Budget);
+	for (auto &r : this->regs) {
+		r.resize(lanes);
+	}
+	this->slotLane.resize(lanes);
+	this->alive.resize(lanes);
+	this->mask.resize(lanes);
+	this->fuel.resize(lanes);
+}
+
+uint64_t Batch::size() {
+	return this->lanes.size();
+}
+
+VirtualMachine &Batch::lane(uint64_t i) {
+	if (i >= this->lanes.size()) {
+		throw std::runtime_error("lane is out of range");
+	}
+	return *this->lanes[i];
+}
+
+StopReason Batch::reason(uint64_t i) {
+	if (i >= this->lanes.size()) {
+		throw std::runtime_error("lane is out of range");
+	}
+	return this->reasons[i];
+}
+
+// the running lanes with the lowest IP form the next group
+void Batch::pickGroup() {
+	uint64_t n = this->width;
+	uint64_t *ip = this->regs[REG_IP].data();
+	uint64_t low = UINT64_MAX;
+	for (uint64_t l = 0; l < n; l++) {
+		if (this->alive[l] && ip[l] < low) {
+			low = ip[l];
+		}
+	}
+	uint64_t members = 0;
+	this->leader = n;
+	for (uint64_t l = 0; l < n; l++) {
+		this->mask[l] = (this->alive[l] && ip[l] == low) ? ~0ull : 0;
+		if (this->mask[l]) {
+			members++;
+			if (this->leader == n) {
+				this->leader = l;
+			}
+		}
+	}
+	this->groupIp = low;
+	this->uniform = members == this->running;
+	this->regroup = false;
+}
+
+// writes the group IP back into the lanes before they may split up
+void Batch::syncIp() {
+	if (this->uniform) {
+		fill(this->regs[REG_IP].data(), this->groupIp, this->mask.data(), this->width);
+		this->uniform = false;
+	}
+}
+
+// charges an instruction to every lane of the group, for the vector paths;
+// tick() charges the lanes that go through their VM
+void Batch::charge() {
+	if (!this->fueled) {
+		return;
+	}
+	uint64_t *fuel = this->fuel.data();
+	const uint64_t *m = this->mask.data();
+	bool empty = false;
+	for (uint64_t l = 0; l < this->width; l++) {
+		fuel[l] -= (m[l] & 1) & (fuel[l] != UINT64_MAX);
+		empty |= m[l] && fuel[l] == 0;
+	}
+	this->drained |= empty;
+}
+
+// lanes without fuel stop before their next instruction, as in tick()
+void Batch::stopDrained() {
+	this->syncIp();
+	for (uint64_t l = 0; l < this->width; l++) {
+		if (this->alive[l] && this->fuel[l] == 0) {
+			this->save(l);
+			this->reasons[this->slotLane[l]] = StopReason::OutOfFuel;
+			this->alive[l] = 0;
+			this->running--;
+		}
+	}
+	this->drained = false;
+	this->regroup = true;
+}
+
+// runs the current instruction of one lane through its VM, for anything
+// the vector path does not cover
+void Batch::slowLane(size_t l) {
+	VirtualMachine &vm = *this->lanes[this->slotLane[l]];
+	this->regs[REG_IP][l] = this->groupIp;
+	this->save(l);
+
+	StopReason reason = vm.tick();
+	this->fuel[l] = vm.getFuel();
+	if (this->fuel[l] == 0) {
+		this->drained = true;
+	}
+
+	uint64_t back[] = {vm.regA, vm.regB, vm.regC, vm.regIp, vm.regSp, vm.regSbp, vm.regFlag};
+	for (int r = 0; r < 7; r++) {
+		this->regs[r][l] = back[r];
+	}
+	for (int r = 0; r < ADD_REGS_COUNT; r++) {
+		this->regs[7 + r][l] = vm.addRegs[r];
+	}
+	if (reason != StopReason::Budget) {
+		this->reasons[this->slotLane[l]] = reason;
+		this->alive[l] = 0;
+		this->running--;
+	}
+	this->regroup = true;
+}
+
+void Batch::slowPath() {
+	this->syncIp();
+	for (size_t l = 0; l < this->width; l++) {
+		if (this->mask[l]) {
+			this->slowLane(l);
+		}
+	}
+}
+
+void Batch::execute() {
+	uint64_t n = this->width;
+	const uint64_t *m = this->mask.data();
+	uint64_t info, val;
+	RAM &code = this->lanes[this->slotLane[this->leader]]->ram;
+	if (!code.load(this->groupIp, info) || !code.load(this->groupIp + 1, val)) {
+		this->slowPath();
+		return;
+	}
+	uint16_t op = (info >> 0) & 0xFFFF;
+	uint16_t flag = (info >> 16) & 0xFFFF;
+	uint16_t larg = (info >> 32) & 0xFFFF;
+	uint16_t rarg = (info >> 48) & 0xFFFF;
+	uint64_t next = this->groupIp + 2;
+	uint64_t *a = this->regs[REG_A].data();
+	uint64_t *b = this->regs[REG_B].data();
+	uint64_t *ip = this->regs[REG_IP].data();
+
+	switch (op) {
+	case CMD_MOV:
+	case CMD_LDI:
+	case CMD_LEA: {
+		int dst = regIndex(flag & 0xFF, larg);
+		int src = op == CMD_MOV ? regIndex(flag >> 8, rarg) : 0;
+		if (dst < 0 || src < 0 || dst == REG_FLG) {
+			this->slowPath();
+			return;
+		}
+		if (dst == REG_IP) {
+			this->syncIp();
+			this->regroup = true;
+		}
+		if (op != CMD_MOV || src == REG_IP) {
+			uint64_t value = op == CMD_LDI ? val : op == CMD_LEA ? next + val : next;
+			fill(this->regs[dst].data(), value, m, n);
+		} else {
+			copy(this->regs[dst].data(), this->regs[src].data(), m, n);
+		}
+		if (dst == REG_IP) {
+			this->charge();
+			return;
+		}
+	} break;
+	case CMD_LOD:
+	case CMD_SAV:
+		// lanes with an address outside of plain guest memory go one by
+		// one and leave the group, they are past the instruction already
+		for (uint64_t l = 0; l < n; l++) {
+			if (!m[l]) {
+				continue;
+			}
+			if (b[l] < this->memoryWords[l]) {
+				if (op == CMD_LOD) {
+					a[l] = this->memory[l][b[l]];
+				} else {
+					this->memory[l][b[l]] = a[l];
+				}
+			} else {
+				this->syncIp();
+				this->slowLane(l);
+				this->mask[l] = 0;
+			}
+		}
+		break;
+	case CMD_DIV:
+	case CMD_MOD:
+		for (uint64_t l = 0; l < n; l++) {
+			if (m[l] && b[l] == 0) {
+				this->slowPath();
+				return;
+			}
+		}
+		for (uint64_t l = 0; l < n; l++) {
+			if (m[l]) {
+				this->regs[REG_C][l] = op == CMD_DIV ? a[l] / b[l] : a[l] % b[l];
+			}
+		}
+		break;
+	case CMD_JMP:
+		this->syncIp();
+		copy(ip, a, m, n);
+		this->regroup = true;
+		this->charge();
+		return;
+	case CMD_JIZ:
+	case CMD_JNZ:
+		this->syncIp();
+		branch(ip, a, 0, b, op == CMD_JIZ, next, m, n);
+		this->regroup = true;
+		this->charge();
+		return;
+	case CMD_BRA:
+		this->syncIp();
+		fill(ip, next + val, m, n);
+		this->regroup = true;
+		this->charge();
+		return;
+	case CMD_BIZ:
+	case CMD_BNZ:
+		this->syncIp();
+		branch(ip, nullptr, next + val, b, op == CMD_BIZ, next, m, n);
+		this->regroup = true;
+		this->charge();
+		return;
+	default:
+		if (!alu(op, this->regs[REG_C].data(), a, b, m, n)) {
+			// SYS, atomics and anything unknown
+			this->slowPath();
+			return;
+		}
+		break;
+	}
+	// lanes that went through slowLane() left the group and are charged
+	this->charge();
+	if (this->uniform) {
+		this->groupIp = next;
+	} else {
+		fill(ip, next, m, n);
+		this->regroup = true;
+	}
+}
+
+// moves the running lanes into the first slots; lanes only stop in
+// slowLane(), so the VMs of the stopped ones are already up to date
+void Batch::compact() {
+	this->syncIp();
+	uint64_t to = 0;
+	for (uint64_t from = 0; from < this->width; from++) {
+		if (!this->alive[from]) {
+			continue;
+		}
+		if (from != to) {
+			for (auto &r : this->regs) {
+				r[to] = r[from];
+			}
+			this->slotLane[to] = this->slotLane[from];
+			this->memory[to] = this->memory[from];
+			this->memoryWords[to] = this->memoryWords[from];
+			this->fuel[to] = this->fuel[from];
+			this->alive[to] = this->alive[from];
+		}
+		to++;
+	}
+	this->width = to;
+	this->regroup = true;
+}
+
+uint64_t Batch::run(uint64_t maxSteps) {
+	uint64_t n = this->lanes.size();
+	this->running = 0;
+	this->width = n;
+	this->fueled = false;
+	this->drained = false;
+	this->memory.resize(n);
+	this->memoryWords.resize(n);
+	for (uint64_t l = 0; l < n; l++) {
+		VirtualMachine &vm = *this->lanes[l];
+		this->slotLane[l] = l;
+		uint64_t values[] = {vm.regA, vm.regB, vm.regC, vm.regIp, vm.regSp, vm.regSbp, vm.regFlag};
+		for (int r = 0; r < 7; r++) {
+			this->regs[r][l] = values[r];
+		}
+		for (int r = 0; r < ADD_REGS_COUNT; r++) {
+			this->regs[7 + r][l] = vm.addRegs[r];
+		}
+		this->memoryWords[l] = vm.ram.getSize();
+		this->memory[l] = this->memoryWords[l] ? vm.ram.pointer(0, true) : nullptr;
+		this->fuel[l] = vm.getFuel();
+		this->fueled |= this->fuel[l] != UINT64_MAX;
+		StopReason last = this->reasons[l];
+		bool resumable = last == StopReason::Budget || last == StopReason::Trap || last == StopReason::Blocked || last == StopReason::OutOfFuel;
+		this->alive[l] = (!vm.halted() && resumable) ? ~0ull : 0;
+		if (this->alive[l] && this->fuel[l] == 0) {
+			this->reasons[l] = StopReason::OutOfFuel;
+			this->alive[l] = 0;
+		}
+		if (this->alive[l]) {
+			this->running++;
+		}
+	}
+	this->regroup = true;
+	for (uint64_t step = 0; step < maxSteps && this->running; step++) {
+		if (this->drained) {
+			this->stopDrained();
+			if (!this->running) {
+				break;
+			}
+		}
+		if (this->running * 2 <= this->width) {
+			this->compact();
+		}
+		if (this->regroup) {
+			this->pickGroup();
+		}
+		this->execute();
+	}
+	this->syncIp();
+	for (uint64_t l = 0; l < this->width; l++) {
+		this->save(l);
+		if (this->alive[l]) {
+			this->reasons[this->slotLane[l]] = StopReason::Budget;
+		}
+	}
+	return this->running;
+}
+
+// copies a slot back into its lane VM
+void Batch::save(uint64_t l) {
+	VirtualMachine &vm = *this->lanes[this->slotLane[l]];
+	vm.regA = this->regs[REG_A][l];
+	vm.regB = this->regs[REG_B][l];
+	vm.regC = this->regs[REG_C][l];
+	vm.regIp = this->regs[REG_IP][l];
+	vm.regSp = this->regs[REG_SP][l];
+	vm.regSbp = this->regs[REG_SBP][l];
+	vm.regFlag = this->regs[REG_FLG][l];
+	for (int r = 0; r < ADD_REGS_COUNT; r++) {
+		vm.addRegs[r] = this->regs[7 + r][l];
+	}
+	vm.setFuel(this->fuel[l]);
+}
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <iostream>
+#include <sigma-vm/Bios.hpp>
+#include <sigma-vm/Channel.hpp>
+#include <sigma-vm/VirtualMachine.hpp>
+#include <stdexcept>
+
+// the first try submits the request and blocks, the retries that follow
+// block until it is done and the last one hands the result to the guest
+static void fileIo(VirtualMachine &vm, bool write) {
+	if (!vm.ioPending()) {
+		// the range is checked before the request allocates its buffer
+		std::span<uint64_t> buffer = vm.ram.span(vm.regC, vm.addRegs[0]);
+		auto request = std::make_shared<IoRequest>(vm.getFile(vm.regB), write, vm.addRegs[1], buffer.size());
+		if (write) {
+			std::copy(buffer.begin(), buffer.end(), request->data.begin());
+		}
+		vm.startIo(request);
+		return;
+	}
+	std::shared_ptr<IoRequest> request = vm.finishIo();
+	if (!request) {
+		return;
+	}
+	if (!request->error.empty()) {
+		throw std::runtime_error(request->error);
+	}
+	if (!write) {
+		std::copy(request->data.begin(), request->data.end(), vm.ram.span(vm.regC, vm.addRegs[0]).begin());
+	}
+	vm.regA = request->words;
+}
+
+Bios::Bios() {
+	this->bind(BIOS_PUTCHAR, [](VirtualMachine &vm) {
+		std::cout << (char)vm.regB;
+	});
+	this->bind(BIOS_TRAP_VECTOR, [](VirtualMachine &vm) {
+		vm.trapVector = vm.regB;
+	});
+	this->bind(BIOS_START_CPU, [](VirtualMachine &vm) {
+		vm.regA = vm.startCpu(vm.regB, vm.regC);
+	});
+	this->bind(BIOS_CHAN_SEND, [](VirtualMachine &vm) {
+		Channel &channel = vm.getChannel(vm.regB, ChannelEnd::Send);
+		uint64_t n = channel.send(vm.ram.span(vm.regC, vm.addRegs[0]));
+		if (n == 0 && vm.addRegs[0] != 0 && !channel.closed()) {
+			vm.blockOnChannel(vm.regB);
+			return;
+		}
+		vm.regA = n;
+	});
+	this->bind(BIOS_CHAN_RECV, [](VirtualMachine &vm) {
+		Channel &channel = vm.getChannel(vm.regB, ChannelEnd::Receive);
+		std::span<uint64_t> dst = vm.ram.span(vm.regC, vm.addRegs[0]);
+		uint64_t n = channel.receive(dst);
+		if (n == 0 && !dst.empty()) {
+			if (!channel.closed()) {
+				vm.blockOnChannel(vm.regB);
+				return;
+			}
+			// words sent before the close are visible once closed() is
+			n = channel.receive(dst);
+		}
+		vm.regA = n;
+	});
+	this->bind(BIOS_CHAN_CLOSE, [](VirtualMachine &vm) {
+		vm.getChannel(vm.regB).close();
+	});
+	this->bind(BIOS_CHAN_PASS, [](VirtualMachine &vm) {
+		vm.passChannel(vm.regB);
+	});
+	this->bind(BIOS_HEAP_INIT, [](VirtualMachine &vm) {
+		vm.initHeap(vm.regB, vm.regC);
+	});
+	this->bind(BIOS_ALLOC, [](VirtualMachine &vm) {
+		vm.regA = vm.getHeap().alloc(vm.regB);
+	});
+	this->bind(BIOS_FREE, [](VirtualMachine &vm) {
+		vm.getHeap().free(vm.regB);
+	});
+	this->bind(BIOS_REALLOC, [](VirtualMachine &vm) {
+		vm.regA = vm.getHeap().realloc(vm.ram, vm.regB, vm.regC);
+	});
+	this->bind(BIOS_MAP_FILE, [](VirtualMachine &vm) {
+		vm.regA = vm.mapFile(vm.regB, vm.regC);
+	});
+	this->bind(BIOS_UNMAP, [](VirtualMachine &vm) {
+		vm.unmapFile(vm.regB);
+	});
+	this->bind(BIOS_FILE_READ, [](VirtualMachine &vm) {
+		fileIo(vm, false);
+	});
+	this->bind(BIOS_FILE_WRITE, [](VirtualMachine &vm) {
+		fileIo(vm, true);
+	});
+}
+
+void Bios::bind(uint64_t number, BiosHandler handler) {
+	if (number < BIOS_DIRECT_CALLS) {
+		if (number >= this->direct.size()) {
+			this->direct.resize(number + 1);
+		}
+		this->direct[number] = handler;
+		return;
+	}
+	this->handlers.insert_or_assign(number, handler);
+}
+
+void Bios::unbind(uint64_t number) {
+	if (number < this->direct.size()) {
+		this->direct[number] = nullptr;
+	}
+	this->handlers.erase(number);
+}
+
+bool Bios::call(uint64_t number, VirtualMachine &vm) {
+	if (number < this->direct.size()) {
+		BiosHandler &handler = this->direct[number];
+		if (!handler) {
+			return false;
+		}
+		handler(vm);
+		return true;
+	}
+	auto it = this->handlers.find(number);
+	if (it == this->handlers.end()) {
+		return false;
+	}
+	it->second(vm);
+	return true;
+}
+
+std::shared_ptr<Bios> Bios::defaults() {
+	static std::shared_ptr<Bios> bios = std::make_shared<Bios>();
+	return bios;
+}
@@ -0,0 +1,40 @@
+#include <algorithm>
+#include <sigma-vm/BlockCache.hpp>
+
+static_assert((BLOCK_TABLE_SIZE & (BLOCK_TABLE_SIZE - 1)) == 0);
+
+BlockCache::BlockCache()
+    : table(BLOCK_TABLE_SIZE, Slot{UINT64_MAX, nullptr}) {
+}
+
+Block *BlockCache::findSlow(uint64_t ip) {
+	auto it = this->blocks.find(ip);
+	if (it == this->blocks.end()) {
+		return nullptr;
+	}
+	this->table[(ip >> 1) & (BLOCK_TABLE_SIZE - 1)] = Slot{ip, it->second.get()};
+	return it->second.get();
+}
+
+Block *BlockCache::add(std::unique_ptr<Block> block) {
+	Block *p = block.get();
+	this->table[(p->start >> 1) & (BLOCK_TABLE_SIZE - 1)] = Slot{p->start, p};
+	this->blocks[p->start] = std::move(block);
+	this->stats.blocks = this->blocks.size();
+	this->stats.decoded++;
+	return p;
+}
+
+bool BlockCache::sync(uint64_t codeVersion) {
+	if (codeVersion == this->version && this->blocks.size() < BLOCK_CACHE_LIMIT) {
+		return false;
+	}
+	this->version = codeVersion;
+	this->blocks.clear();
+	std::fill(this->table.begin(), this->table.end(), Slot{UINT64_MAX, nullptr});
+	if (this->stats.blocks) {
+		this->stats.flushes++;
+	}
+	this->stats.blocks = 0;
+	return true;
+}
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <sigma-vm/Channel.hpp>
+#include <stdexcept>
+
+Channel::Channel(uint64_t capacity)
+    : mask(0), head(0), cachedTail(0), tail(0), cachedHead(0), shut(false), claimed{false, false}, sleepers(0) {
+	if (capacity == 0 || capacity > (1ull << 40)) {
+		throw std::runtime_error("channel capacity is out of range");
+	}
+	uint64_t size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	this->ring.resize(size);
+	this->mask = size - 1;
+}
+
+uint64_t Channel::send(std::span<const uint64_t> words) {
+	if (this->shut.load(std::memory_order_relaxed)) {
+		return 0;
+	}
+	uint64_t t = this->tail.load(std::memory_order_relaxed);
+	uint64_t size = this->ring.size();
+	if (t - this->cachedHead + words.size() > size) {
+		this->cachedHead = this->head.load(std::memory_order_acquire);
+	}
+	uint64_t n = std::min<uint64_t>(words.size(), size - (t - this->cachedHead));
+	if (n == 0) {
+		return 0;
+	}
+	// at most two copies, before and after the end of the ring
+	uint64_t at = t & this->mask;
+	uint64_t first = std::min(n, size - at);
+	std::memcpy(this->ring.data() + at, words.data(), first * sizeof(uint64_t));
+	std::memcpy(this->ring.data(), words.data() + first, (n - first) * sizeof(uint64_t));
+	this->tail.store(t + n, std::memory_order_release);
+	this->notify();
+	return n;
+}
+
+uint64_t Channel::receive(std::span<uint64_t> words) {
+	uint64_t h = this->head.load(std::memory_order_relaxed);
+	if (this->cachedTail - h < words.size()) {
+		this->cachedTail = this->tail.load(std::memory_order_acquire);
+	}
+	uint64_t n = std::min<uint64_t>(words.size(), this->cachedTail - h);
+	if (n == 0) {
+		return 0;
+	}
+	uint64_t size = this->ring.size();
+	uint64_t at = h & this->mask;
+	uint64_t first = std::min(n, size - at);
+	std::memcpy(words.data(), this->ring.data() + at, first * sizeof(uint64_t));
+	std::memcpy(words.data() + first, this->ring.data(), (n - first) * sizeof(uint64_t));
+	this->head.store(h + n, std::memory_order_release);
+	this->notify();
+	return n;
+}
+
+void Channel::close() {
+	this->shut.store(true, std::memory_order_release);
+	this->notify();
+}
+
+bool Channel::closed() {
+	return this->shut.load(std::memory_order_acquire);
+}
+
+uint64_t Channel::capacity() {
+	return this->ring.size();
+}
+
+void Channel::claim(ChannelEnd end) {
+	if (this->claimed[(int)end].exchange(true)) {
+		throw std::runtime_error(std::format("the {} end of the channel is already attached", end == ChannelEnd::Send ? "sending" : "receiving"));
+	}
+}
+
+// the fence orders the store of head, tail or shut before the check of
+// sleepers, against wait() and park() counting themselves in before they
+// check them
+void Channel::notify() {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!this->sleepers.load(std::memory_order_relaxed)) {
+		return;
+	}
+	std::function<void()> wake[2];
+	{
+		std::lock_guard<std::mutex> lock(this->waitLock);
+		this->changed.notify_all();
+		for (int end = 0; end < 2; end++) {
+			if (this->wakers[end] && this->ready((ChannelEnd)end)) {
+				wake[end] = std::move(this->wakers[end]);
+				this->wakers[end] = nullptr;
+				this->sleepers.fetch_sub(1);
+			}
+		}
+	}
+	for (auto &w : wake) {
+		if (w) {
+			w();
+		}
+	}
+}
+
+bool Channel::ready(ChannelEnd end) {
+	if (this->shut.load(std::memory_order_acquire)) {
+		return true;
+	}
+	uint64_t h = this->head.load(std::memory_order_acquire);
+	uint64_t t = this->tail.load(std::memory_order_acquire);
+	return end == ChannelEnd::Receive ? t != h : t - h < this->ring.size();
+}
+
+void Channel::wait(ChannelEnd end, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock(this->waitLock);
+	this->sleepers.fetch_add(1);
+	this->changed.wait_for(lock, timeout, [this, end] {
+		return this->ready(end);
+	});
+	this->sleepers.fetch_sub(1);
+}
+
+bool Channel::park(ChannelEnd end, std::function<void()> wake) {
+	std::lock_guard<std::mutex> lock(this->waitLock);
+	this->sleepers.fetch_add(1);
+	if (this->ready(end)) {
+		this->sleepers.fetch_sub(1);
+		return false;
+	}
+	this->wakers[(int)end] = std::move(wake);
+	return true;
+}
+
+void Channel::unpark(ChannelEnd end) {
+	std::lock_guard<std::mutex> lock(this->waitLock);
+	if (this->wakers[(int)end]) {
+		this->wakers[(int)end] = nullptr;
+		this->sleepers.fetch_sub(1);
+	}
+}
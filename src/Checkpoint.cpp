@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <format>
+#include <sigma-vm/Checkpoint.hpp>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+static_assert(sizeof(CheckpointHeader) <= CHECKPOINT_ALIGN);
+
+static void writeAt(int fd, const void *src, uint64_t size, uint64_t offset) {
+	const char *p = (const char *)src;
+	while (size) {
+		ssize_t n = pwrite(fd, p, size, offset);
+		if (n <= 0) {
+			throw std::runtime_error("unable to write checkpoint");
+		}
+		p += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+static bool zero(const uint64_t *words, uint64_t n) {
+	uint64_t any = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		any |= words[i];
+	}
+	return any == 0;
+}
+
+void Checkpoint::write(std::string path, CheckpointHeader &header, RAM &ram, const std::vector<uint64_t> &heap) {
+	// unique, so VMs that checkpoint to one path never write into the
+	// same temporary file
+	std::string temp = std::format("{}.{}.{}.tmp", path, getpid(), std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		throw std::runtime_error(std::format("unable to open {} for writing", temp));
+	}
+	try {
+		header.magic = CHECKPOINT_MAGIC;
+		header.version = CHECKPOINT_VERSION;
+		header.memoryWords = ram.getSize();
+		header.pages = 0;
+		header.heapWords = heap.size();
+		uint64_t heapOffset = CHECKPOINT_ALIGN + header.memoryWords * sizeof(uint64_t);
+		if (ftruncate(fd, heapOffset + heap.size() * sizeof(uint64_t)) != 0) {
+			throw std::runtime_error(std::format("unable to write {}", temp));
+		}
+		std::span<uint64_t> memory = ram.span(0, header.memoryWords);
+		for (uint64_t addr = 0; addr < memory.size(); addr += CHECKPOINT_PAGE_WORDS) {
+			uint64_t words = std::min<uint64_t>(CHECKPOINT_PAGE_WORDS, memory.size() - addr);
+			if (zero(&memory[addr], words)) {
+				continue;
+			}
+			writeAt(fd, &memory[addr], words * sizeof(uint64_t), CHECKPOINT_ALIGN + addr * sizeof(uint64_t));
+			header.pages++;
+		}
+		writeAt(fd, heap.data(), heap.size() * sizeof(uint64_t), heapOffset);
+		writeAt(fd, &header, sizeof(header), 0);
+	} catch (...) {
+		close(fd);
+		unlink(temp.c_str());
+		throw;
+	}
+	close(fd);
+	if (rename(temp.c_str(), path.c_str()) != 0) {
+		unlink(temp.c_str());
+		throw std::runtime_error(std::format("unable to write {}", path));
+	}
+}
+
+CheckpointHeader Checkpoint::load(std::string path, RAM &ram, std::vector<uint64_t> &heap) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error(std::format("unable to open checkpoint {}", path));
+	}
+	CheckpointHeader header;
+	try {
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CHECKPOINT_MAGIC) {
+			throw std::runtime_error(std::format("{} is not a checkpoint", path));
+		}
+		if (header.version != CHECKPOINT_VERSION) {
+			throw std::runtime_error(std::format("unsupported checkpoint version {}", header.version));
+		}
+		if (header.memoryWords != ram.getSize()) {
+			throw std::runtime_error(std::format("checkpoint {} is for {} words of memory, not {}", path, header.memoryWords, ram.getSize()));
+		}
+		struct stat st;
+		uint64_t heapOffset = CHECKPOINT_ALIGN + header.memoryWords * sizeof(uint64_t);
+		if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < heapOffset || header.heapWords > ((uint64_t)st.st_size - heapOffset) / sizeof(uint64_t)) {
+			throw std::runtime_error(std::format("checkpoint {} is cut short", path));
+		}
+		heap.resize(header.heapWords);
+		if (pread(fd, heap.data(), heap.size() * sizeof(uint64_t), heapOffset) != (ssize_t)(heap.size() * sizeof(uint64_t))) {
+			throw std::runtime_error(std::format("unable to read checkpoint {}", path));
+		}
+		ram.mapFile(0, fd, CHECKPOINT_ALIGN, header.memoryWords);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return header;
+}
@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <format>
+#include <sigma-vm/Heap.hpp>
+#include <stdexcept>
+
+// block sizes in words, about 25% apart so rounding wastes little
+static constexpr uint16_t classWords[HEAP_SIZE_CLASSES] = {
+    1, 2, 3, 4, 5, 6, 8, 10, 12, 14, 16, 20, 24, 28, 32, 40, 48, 56, 64, 80, 96, 128, 192, 256};
+
+static uint8_t sizeClass(uint64_t words) {
+	return std::lower_bound(std::begin(classWords), std::end(classWords), words) - std::begin(classWords);
+}
+
+static_assert(classWords[HEAP_SIZE_CLASSES - 1] == HEAP_SMALL_WORDS);
+
+GuestHeap::GuestHeap(uint64_t base, uint64_t words)
+    : base(base), words(words / HEAP_PAGE_WORDS * HEAP_PAGE_WORDS), stats{} {
+	if (base == 0 || base + words < base) {
+		throw std::runtime_error("a heap cannot start at address 0");
+	}
+	this->pages.resize(this->words / HEAP_PAGE_WORDS);
+	if (!this->pages.empty()) {
+		this->freeRuns[0] = this->pages.size();
+	}
+	this->stats.size = this->words;
+}
+
+// first fit, UINT64_MAX if no run is long enough
+uint64_t GuestHeap::takePages(uint64_t n) {
+	for (auto it = this->freeRuns.begin(); it != this->freeRuns.end(); it++) {
+		auto [first, length] = *it;
+		if (length < n) {
+			continue;
+		}
+		this->freeRuns.erase(it);
+		if (length > n) {
+			this->freeRuns[first + n] = length - n;
+		}
+		return first;
+	}
+	return UINT64_MAX;
+}
+
+void GuestHeap::releasePages(uint64_t first, uint64_t n) {
+	for (uint64_t i = first; i < first + n; i++) {
+		this->pages[i] = Page{};
+	}
+	auto next = this->freeRuns.lower_bound(first);
+	if (next != this->freeRuns.end() && next->first == first + n) {
+		n += next->second;
+		next = this->freeRuns.erase(next);
+	}
+	if (next != this->freeRuns.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == first) {
+			prev->second += n;
+			return;
+		}
+	}
+	this->freeRuns[first] = n;
+}
+
+// pages for a large block, without rounding past UINT64_MAX
+static uint64_t pagesFor(uint64_t words) {
+	return words / HEAP_PAGE_WORDS + (words % HEAP_PAGE_WORDS != 0);
+}
+
+uint64_t GuestHeap::allocLocked(uint64_t words) {
+	words = std::max<uint64_t>(words, 1);
+	if (words > this->words) {
+		return 0;
+	}
+	if (words > HEAP_SMALL_WORDS) {
+		uint64_t n = pagesFor(words);
+		if (n > this->pages.size()) {
+			return 0;
+		}
+		uint64_t first = this->takePages(n);
+		if (first == UINT64_MAX) {
+			return 0;
+		}
+		this->pages[first].kind = PAGE_LARGE;
+		this->pages[first].pages = n;
+		for (uint64_t i = first + 1; i < first + n; i++) {
+			this->pages[i].kind = PAGE_TAIL;
+		}
+		this->stats.inUse += n * HEAP_PAGE_WORDS;
+		this->stats.blocks++;
+		this->stats.allocs++;
+		return this->base + first * HEAP_PAGE_WORDS;
+	}
+
+	uint8_t c = sizeClass(words);
+	std::vector<uint64_t> &partial = this->partial[c];
+	if (partial.empty()) {
+		uint64_t first = this->takePages(1);
+		if (first == UINT64_MAX) {
+			return 0;
+		}
+		Page &page = this->pages[first];
+		uint16_t slots = HEAP_PAGE_WORDS / classWords[c];
+		page.kind = PAGE_SMALL;
+		page.sizeClass = c;
+		page.free.resize(slots);
+		for (uint16_t i = 0; i < slots; i++) {
+			page.free[i] = slots - 1 - i; // lowest slot first
+		}
+		page.occupied.assign((slots + 63) / 64, 0);
+		partial.push_back(first);
+	}
+	uint64_t index = partial.back();
+	Page &page = this->pages[index];
+	uint16_t slot = page.free.back();
+	page.free.pop_back();
+	page.occupied[slot / 64] |= 1ull << (slot % 64);
+	page.used++;
+	if (page.free.empty()) {
+		partial.pop_back();
+	}
+	this->stats.inUse += classWords[c];
+	this->stats.blocks++;
+	this->stats.allocs++;
+	return this->base + index * HEAP_PAGE_WORDS + slot * classWords[c];
+}
+
+uint64_t GuestHeap::blockWords(uint64_t addr) {
+	if (addr >= this->base && addr - this->base < this->words) {
+		uint64_t offset = addr - this->base;
+		Page &page = this->pages[offset / HEAP_PAGE_WORDS];
+		uint64_t inPage = offset % HEAP_PAGE_WORDS;
+		if (page.kind == PAGE_LARGE && inPage == 0) {
+			return page.pages * HEAP_PAGE_WORDS;
+		}
+		if (page.kind == PAGE_SMALL) {
+			uint64_t size = classWords[page.sizeClass];
+			uint64_t slot = inPage / size;
+			if (inPage % size == 0 && slot < HEAP_PAGE_WORDS / size && (page.occupied[slot / 64] >> (slot % 64)) & 1) {
+				return size;
+			}
+		}
+	}
+	throw std::runtime_error(std::format("{:#x} is not an allocated heap block", addr));
+}
+
+void GuestHeap::freeLocked(uint64_t addr) {
+	uint64_t size = this->blockWords(addr);
+	uint64_t offset = addr - this->base;
+	uint64_t index = offset / HEAP_PAGE_WORDS;
+	Page &page = this->pages[index];
+	this->stats.inUse -= size;
+	this->stats.blocks--;
+	this->stats.frees++;
+	if (page.kind == PAGE_LARGE) {
+		this->releasePages(index, page.pages);
+		return;
+	}
+	uint16_t slot = offset % HEAP_PAGE_WORDS / size;
+	page.occupied[slot / 64] &= ~(1ull << (slot % 64));
+	page.free.push_back(slot);
+	page.used--;
+	std::vector<uint64_t> &partial = this->partial[page.sizeClass];
+	if (page.free.size() == 1) {
+		partial.push_back(index);
+	}
+	// an empty page goes back unless it is the last one of its class, so
+	// a block that is allocated and freed over and over keeps its page
+	if (page.used == 0 && partial.size() > 1) {
+		partial.erase(std::find(partial.begin(), partial.end(), index));
+		this->releasePages(index, 1);
+	}
+}
+
+uint64_t GuestHeap::alloc(uint64_t words) {
+	std::lock_guard<std::mutex> lock(this->lock);
+	return this->allocLocked(words);
+}
+
+void GuestHeap::free(uint64_t addr) {
+	if (addr == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->lock);
+	this->freeLocked(addr);
+}
+
+uint64_t GuestHeap::realloc(RAM &ram, uint64_t addr, uint64_t words) {
+	std::lock_guard<std::mutex> lock(this->lock);
+	if (addr == 0) {
+		return this->allocLocked(words);
+	}
+	uint64_t old = this->blockWords(addr);
+	words = std::max<uint64_t>(words, 1);
+	if (words > this->words) {
+		return 0;
+	}
+	uint64_t fits = words > HEAP_SMALL_WORDS ? pagesFor(words) * HEAP_PAGE_WORDS : classWords[sizeClass(words)];
+	if (fits == old) {
+		return addr;
+	}
+	uint64_t moved = this->allocLocked(words);
+	if (moved == 0) {
+		return 0;
+	}
+	uint64_t keep = std::min(old, words);
+	std::span<uint64_t> from = ram.span(addr, keep);
+	std::copy(from.begin(), from.end(), ram.span(moved, keep).begin());
+	this->freeLocked(addr);
+	return moved;
+}
+
+uint64_t GuestHeap::size(uint64_t addr) {
+	std::lock_guard<std::mutex> lock(this->lock);
+	return this->blockWords(addr);
+}
+
+HeapStats GuestHeap::getStats() {
+	std::lock_guard<std::mutex> lock(this->lock);
+	HeapStats stats = this->stats;
+	for (auto [first, length] : this->freeRuns) {
+		stats.freeWords += length * HEAP_PAGE_WORDS;
+		stats.largestFree = std::max(stats.largestFree, length * HEAP_PAGE_WORDS);
+	}
+	for (auto &partial : this->partial) {
+		for (uint64_t index : partial) {
+			stats.slack += this->pages[index].free.size() * classWords[this->pages[index].sizeClass];
+		}
+	}
+	return stats;
+}
+
+// base, size and counters, then every page, the runs of free pages and
+// the pages with free slots of each class, in their order so a restored
+// heap hands out the same blocks
+std::vector<uint64_t> GuestHeap::save() {
+	std::lock_guard<std::mutex> lock(this->lock);
+	std::vector<uint64_t> out = {this->base, this->words, this->stats.inUse, this->stats.blocks, this->stats.allocs, this->stats.frees};
+	for (Page &page : this->pages) {
+		out.push_back(page.kind | (uint64_t)page.sizeClass << 8 | (uint64_t)page.used << 16 | (uint64_t)page.free.size() << 32);
+		out.push_back(page.pages);
+		if (page.kind != PAGE_SMALL) {
+			continue;
+		}
+		for (size_t i = 0; i < page.free.size(); i += 4) {
+			uint64_t word = 0;
+			for (size_t j = i; j < std::min(i + 4, page.free.size()); j++) {
+				word |= (uint64_t)page.free[j] << 16 * (j - i);
+			}
+			out.push_back(word);
+		}
+		out.insert(out.end(), page.occupied.begin(), page.occupied.end());
+	}
+	out.push_back(this->freeRuns.size());
+	for (auto [first, length] : this->freeRuns) {
+		out.push_back(first);
+		out.push_back(length);
+	}
+	for (auto &partial : this->partial) {
+		out.push_back(partial.size());
+		out.insert(out.end(), partial.begin(), partial.end());
+	}
+	return out;
+}
+
+std::shared_ptr<GuestHeap> GuestHeap::load(std::span<const uint64_t> saved) {
+	size_t at = 0;
+	auto next = [&]() {
+		if (at >= saved.size()) {
+			throw std::runtime_error("saved heap is cut short");
+		}
+		return saved[at++];
+	};
+	auto check = [](bool ok) {
+		if (!ok) {
+			throw std::runtime_error("saved heap is damaged");
+		}
+	};
+	std::shared_ptr<GuestHeap> heap(new GuestHeap());
+	heap->base = next();
+	heap->words = next();
+	check(heap->base != 0 && heap->words % HEAP_PAGE_WORDS == 0 && heap->base + heap->words >= heap->base);
+	heap->stats = HeapStats{};
+	heap->stats.size = heap->words;
+	heap->stats.inUse = next();
+	heap->stats.blocks = next();
+	heap->stats.allocs = next();
+	heap->stats.frees = next();
+	uint64_t count = heap->words / HEAP_PAGE_WORDS;
+	check(count <= saved.size());
+	heap->pages.resize(count);
+	for (uint64_t index = 0; index < count; index++) {
+		Page &page = heap->pages[index];
+		uint64_t info = next();
+		page.kind = (Kind)(info & 0xff);
+		page.sizeClass = info >> 8 & 0xff;
+		page.used = info >> 16 & 0xffff;
+		uint64_t free = info >> 32;
+		page.pages = next();
+		check(page.kind <= PAGE_TAIL);
+		if (page.kind == PAGE_LARGE) {
+			check(page.pages != 0 && page.pages <= count - index);
+		}
+		if (page.kind != PAGE_SMALL) {
+			continue;
+		}
+		check(page.sizeClass < HEAP_SIZE_CLASSES);
+		uint64_t slots = HEAP_PAGE_WORDS / classWords[page.sizeClass];
+		check(free <= slots && page.used <= slots);
+		page.free.resize(free);
+		for (uint64_t i = 0; i < free; i += 4) {
+			uint64_t word = next();
+			for (uint64_t j = i; j < std::min<uint64_t>(i + 4, free); j++) {
+				page.free[j] = word >> 16 * (j - i) & 0xffff;
+				check(page.free[j] < slots);
+			}
+		}
+		page.occupied.resize((slots + 63) / 64);
+		for (uint64_t &word : page.occupied) {
+			word = next();
+		}
+	}
+	for (uint64_t runs = next(); runs > 0; runs--) {
+		uint64_t first = next(), length = next();
+		check(first < count && length != 0 && length <= count - first);
+		heap->freeRuns[first] = length;
+	}
+	for (uint8_t c = 0; c < HEAP_SIZE_CLASSES; c++) {
+		uint64_t n = next();
+		check(n <= count);
+		for (uint64_t i = 0; i < n; i++) {
+			uint64_t index = next();
+			check(index < count && heap->pages[index].kind == PAGE_SMALL && heap->pages[index].sizeClass == c && !heap->pages[index].free.empty());
+			heap->partial[c].push_back(index);
+		}
+	}
+	check(at == saved.size());
+	return heap;
+}
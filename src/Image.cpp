@@ -0,0 +1,200 @@
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <fstream>
+#include <sigma-vm/Image.hpp>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t alignUp(uint64_t v, uint64_t a) {
+	return (v + a - 1) / a * a;
+}
+
+static void readAt(int fd, void *dst, uint64_t size, uint64_t offset) {
+	char *p = (char *)dst;
+	while (size) {
+		ssize_t n = pread(fd, p, size, offset);
+		if (n <= 0) {
+			throw std::runtime_error("image file is truncated");
+		}
+		p += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+// checks that count entries of the given size starting at offset lie inside
+// the file, without letting a hostile header wrap the arithmetic around
+static void checkRange(const char *what, uint64_t offset, uint64_t count, uint64_t size, uint64_t fileSize) {
+	if (offset > fileSize || count > (fileSize - offset) / size) {
+		throw std::runtime_error(std::format("image {} is out of range", what));
+	}
+}
+
+static ImageHeader readHeader(int fd) {
+	ImageHeader header;
+	readAt(fd, &header, sizeof(header), 0);
+	if (header.magic != IMAGE_MAGIC) {
+		throw std::runtime_error("not a sigma image");
+	}
+	if (header.version != IMAGE_VERSION) {
+		throw std::runtime_error(std::format("unsupported image version {}", header.version));
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		throw std::runtime_error("unable to stat image file");
+	}
+	uint64_t fileSize = st.st_size;
+	checkRange("code section", header.codeOffset, header.codeWords, sizeof(uint64_t), fileSize);
+	checkRange("data section", header.dataOffset, header.dataWords, sizeof(uint64_t), fileSize);
+	checkRange("symbol table", header.symOffset, header.symCount, sizeof(ImageSymbolEntry), fileSize);
+	checkRange("relocation table", header.relocOffset, header.relocCount, sizeof(ImageRelocEntry), fileSize);
+	checkRange("string table", header.strOffset, header.strSize, 1, fileSize);
+	if (header.dataAddr > UINT64_MAX - header.dataWords) {
+		throw std::runtime_error("image data address is out of range");
+	}
+	return header;
+}
+
+void Image::write(std::string path) {
+	ImageHeader header{};
+	header.magic = IMAGE_MAGIC;
+	header.version = IMAGE_VERSION;
+	header.flags = this->flags;
+	header.entry = this->entry;
+	header.codeOffset = IMAGE_ALIGN;
+	header.codeWords = this->code.size();
+	header.dataOffset = alignUp(header.codeOffset + this->code.size() * sizeof(uint64_t), IMAGE_ALIGN);
+	header.dataWords = this->data.size();
+	header.dataAddr = this->dataAddr;
+	header.symOffset = alignUp(header.dataOffset + this->data.size() * sizeof(uint64_t), IMAGE_ALIGN);
+	header.symCount = this->symbols.size();
+	header.relocOffset = header.symOffset + this->symbols.size() * sizeof(ImageSymbolEntry);
+	header.relocCount = this->relocs.size();
+	header.strOffset = header.relocOffset + this->relocs.size() * sizeof(ImageRelocEntry);
+
+	std::string strings;
+	std::vector<ImageSymbolEntry> symbolEntries;
+	for (auto &sym : this->symbols) {
+		symbolEntries.push_back(ImageSymbolEntry{strings.size(), sym.value, sym.section, sym.flags});
+		strings += sym.name;
+		strings += '\0';
+	}
+	header.strSize = strings.size();
+
+	std::vector<char> file(header.strOffset + header.strSize);
+	std::memcpy(file.data(), &header, sizeof(header));
+	std::memcpy(file.data() + header.codeOffset, this->code.data(), this->code.size() * sizeof(uint64_t));
+	std::memcpy(file.data() + header.dataOffset, this->data.data(), this->data.size() * sizeof(uint64_t));
+	std::memcpy(file.data() + header.symOffset, symbolEntries.data(), symbolEntries.size() * sizeof(ImageSymbolEntry));
+	std::memcpy(file.data() + header.relocOffset, this->relocs.data(), this->relocs.size() * sizeof(ImageRelocEntry));
+	std::memcpy(file.data() + header.strOffset, strings.data(), strings.size());
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		throw std::runtime_error(std::format("unable to open {} for writing", path));
+	}
+	out.write(file.data(), file.size());
+	if (!out) {
+		throw std::runtime_error(std::format("unable to write {}", path));
+	}
+}
+
+Image Image::read(std::string path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error(std::format("unable to open image {}", path));
+	}
+	Image image;
+	try {
+		ImageHeader header = readHeader(fd);
+		image.flags = header.flags;
+		image.entry = header.entry;
+		image.dataAddr = header.dataAddr;
+		image.code.resize(header.codeWords);
+		readAt(fd, image.code.data(), header.codeWords * sizeof(uint64_t), header.codeOffset);
+		image.data.resize(header.dataWords);
+		readAt(fd, image.data.data(), header.dataWords * sizeof(uint64_t), header.dataOffset);
+		image.relocs.resize(header.relocCount);
+		readAt(fd, image.relocs.data(), header.relocCount * sizeof(ImageRelocEntry), header.relocOffset);
+
+		std::vector<ImageSymbolEntry> symbolEntries(header.symCount);
+		readAt(fd, symbolEntries.data(), header.symCount * sizeof(ImageSymbolEntry), header.symOffset);
+		std::string strings(header.strSize, '\0');
+		readAt(fd, strings.data(), header.strSize, header.strOffset);
+		for (auto &entry : symbolEntries) {
+			if (entry.nameOffset >= strings.size()) {
+				throw std::runtime_error("image symbol name is out of range");
+			}
+			image.symbols.push_back(ImageSymbol{std::string(strings.c_str() + entry.nameOffset), entry.value, entry.section, entry.flags});
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return image;
+}
+
+uint64_t Image::place(RAM &ram, uint64_t base) {
+	if (this->flags & IMAGE_FLAG_OBJECT) {
+		throw std::runtime_error("object modules have to be linked before they are loaded");
+	}
+	for (size_t i = 0; i < this->code.size(); i++) {
+		ram.setAt(base + i, this->code[i]);
+	}
+	for (size_t i = 0; i < this->data.size(); i++) {
+		ram.setAt(base + this->dataAddr + i, this->data[i]);
+	}
+	if (base != 0) {
+		for (auto &r : this->relocs) {
+			ram.setAt(base + r.addr, ram.getAt(base + r.addr) + base);
+		}
+	}
+	return base + this->entry;
+}
+
+uint64_t Image::load(std::string path, RAM &ram, uint64_t base) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error(std::format("unable to open image {}", path));
+	}
+	try {
+		ImageHeader header = readHeader(fd);
+		if (header.flags & IMAGE_FLAG_OBJECT) {
+			throw std::runtime_error(std::format("{} is an object module, link it first", path));
+		}
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		bool mappable = (base * sizeof(uint64_t)) % page == 0 &&
+		                ((base + header.dataAddr) * sizeof(uint64_t)) % page == 0 &&
+		                header.codeOffset % page == 0 && header.dataOffset % page == 0;
+		if (mappable) {
+			ram.mapFile(base, fd, header.codeOffset, header.codeWords);
+			ram.mapFile(base + header.dataAddr, fd, header.dataOffset, header.dataWords);
+		} else {
+			std::vector<uint64_t> buffer(header.codeWords);
+			readAt(fd, buffer.data(), header.codeWords * sizeof(uint64_t), header.codeOffset);
+			for (size_t i = 0; i < buffer.size(); i++) {
+				ram.setAt(base + i, buffer[i]);
+			}
+			buffer.resize(header.dataWords);
+			readAt(fd, buffer.data(), header.dataWords * sizeof(uint64_t), header.dataOffset);
+			for (size_t i = 0; i < buffer.size(); i++) {
+				ram.setAt(base + header.dataAddr + i, buffer[i]);
+			}
+		}
+		if (base != 0 && header.relocCount) {
+			std::vector<ImageRelocEntry> relocs(header.relocCount);
+			readAt(fd, relocs.data(), header.relocCount * sizeof(ImageRelocEntry), header.relocOffset);
+			for (auto &r : relocs) {
+				ram.setAt(base + r.addr, ram.getAt(base + r.addr) + base);
+			}
+		}
+		close(fd);
+		return base + header.entry;
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+}
@@ -0,0 +1,136 @@
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <sigma-vm/ImageCache.hpp>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t alignUp(uint64_t v, uint64_t a) {
+	return (v + a - 1) / a * a;
+}
+
+static void writeAt(int fd, const void *src, uint64_t size, uint64_t offset) {
+	const char *p = (const char *)src;
+	while (size) {
+		ssize_t n = pwrite(fd, p, size, offset);
+		if (n <= 0) {
+			throw std::runtime_error("unable to write shared image");
+		}
+		p += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+static void readAt(int fd, void *dst, uint64_t size, uint64_t offset) {
+	char *p = (char *)dst;
+	while (size) {
+		ssize_t n = pread(fd, p, size, offset);
+		if (n <= 0) {
+			throw std::runtime_error("unable to read shared image");
+		}
+		p += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+SharedImage::SharedImage(const Image &image, uint64_t base)
+    : fd(-1), sealed(false), codeWords(image.code.size()), dataWords(image.data.size()), base(base), dataAddr(image.dataAddr), entry(base + image.entry) {
+	if (image.flags & IMAGE_FLAG_OBJECT) {
+		throw std::runtime_error("object modules have to be linked before they are loaded");
+	}
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	this->dataOffset = alignUp(this->codeWords * sizeof(uint64_t), page);
+	uint64_t size = this->dataOffset + alignUp(this->dataWords * sizeof(uint64_t), page);
+
+	// relocations are applied here once instead of in every VM
+	std::vector<uint64_t> code = image.code, data = image.data;
+	if (base != 0) {
+		for (auto &r : image.relocs) {
+			if (r.addr < code.size()) {
+				code[r.addr] += base;
+			} else if (r.addr >= image.dataAddr && r.addr - image.dataAddr < data.size()) {
+				data[r.addr - image.dataAddr] += base;
+			} else {
+				throw std::runtime_error(std::format("relocation at {} is outside of the image", r.addr));
+			}
+		}
+	}
+
+	this->fd = memfd_create("sigma-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (this->fd < 0) {
+		throw std::runtime_error("unable to create shared image");
+	}
+	try {
+		if (ftruncate(this->fd, size) != 0) {
+			throw std::runtime_error("unable to size shared image");
+		}
+		writeAt(this->fd, code.data(), code.size() * sizeof(uint64_t), 0);
+		writeAt(this->fd, data.data(), data.size() * sizeof(uint64_t), this->dataOffset);
+		// guests only ever get private mappings, sealing keeps the shared
+		// pages immutable for the life of the file; without the seals they
+		// are not mapped at all, map() copies them
+		this->sealed = fcntl(this->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+	} catch (...) {
+		close(this->fd);
+		throw;
+	}
+}
+
+SharedImage::~SharedImage() {
+	if (this->fd >= 0) {
+		close(this->fd);
+	}
+}
+
+uint64_t SharedImage::map(RAM &ram) {
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t pageWords = page / sizeof(uint64_t);
+	uint64_t dataBase = this->base + this->dataAddr;
+	bool mappable = this->sealed && (this->base * sizeof(uint64_t)) % page == 0 && (dataBase * sizeof(uint64_t)) % page == 0;
+	if (!mappable) {
+		// same fallback as Image::load, the words still come from the shared copy
+		std::vector<uint64_t> buffer(this->codeWords);
+		readAt(this->fd, buffer.data(), this->codeWords * sizeof(uint64_t), 0);
+		for (uint64_t i = 0; i < this->codeWords; i++) {
+			ram.setAt(this->base + i, buffer[i]);
+		}
+		buffer.resize(this->dataWords);
+		readAt(this->fd, buffer.data(), this->dataWords * sizeof(uint64_t), this->dataOffset);
+		for (uint64_t i = 0; i < this->dataWords; i++) {
+			ram.setAt(dataBase + i, buffer[i]);
+		}
+		return this->entry;
+	}
+	// the file is zero padded to whole pages, and so is fresh guest memory,
+	// so whole pages can be mapped whenever they fit
+	uint64_t codeMap = alignUp(this->codeWords, pageWords);
+	uint64_t dataMap = alignUp(this->dataWords, pageWords);
+	ram.mapFile(this->base, this->fd, 0, this->base + codeMap <= ram.getSize() ? codeMap : this->codeWords);
+	ram.mapFile(dataBase, this->fd, this->dataOffset, dataBase + dataMap <= ram.getSize() ? dataMap : this->dataWords);
+	return this->entry;
+}
+
+std::shared_ptr<SharedImage> ImageCache::get(std::string path, uint64_t base) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		throw std::runtime_error(std::format("unable to open image {}", path));
+	}
+	Key key{st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, base};
+	std::lock_guard<std::mutex> lock(this->lock);
+	auto it = this->entries.find(key);
+	if (it != this->entries.end()) {
+		return it->second;
+	}
+	auto image = std::make_shared<SharedImage>(Image::read(path), base);
+	this->entries.emplace(key, image);
+	return image;
+}
+
+void ImageCache::clear() {
+	std::lock_guard<std::mutex> lock(this->lock);
+	this->entries.clear();
+}
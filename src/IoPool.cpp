@@ -0,0 +1,139 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <sigma-vm/IoPool.hpp>
+#include <stdexcept>
+#include <unistd.h>
+
+HostFile::HostFile(std::string path, bool writable)
+    : path(path), writable(writable) {
+	this->fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+	if (this->fd < 0) {
+		throw std::runtime_error(std::format("unable to open {}", path));
+	}
+}
+
+HostFile::~HostFile() {
+	close(this->fd);
+}
+
+IoRequest::IoRequest(std::shared_ptr<HostFile> file, bool write, uint64_t offset, uint64_t words)
+    : file(file), write(write), offset(offset) {
+	this->data.resize(words);
+}
+
+void IoRequest::perform() {
+	if (this->write && !this->file->writable) {
+		this->error = std::format("{} is not writable", this->file->path);
+		return;
+	}
+	char *p = (char *)this->data.data();
+	size_t bytes = this->data.size() * sizeof(uint64_t), moved = 0;
+	off_t at = this->offset * sizeof(uint64_t);
+	while (moved < bytes) {
+		ssize_t n = this->write ? pwrite(this->file->fd, p + moved, bytes - moved, at + moved)
+		                        : pread(this->file->fd, p + moved, bytes - moved, at + moved);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			this->error = std::format("{}: {}", this->file->path, strerror(errno));
+			return;
+		}
+		if (n == 0) {
+			break;
+		}
+		moved += n;
+	}
+	this->words = (moved + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+void IoRequest::complete() {
+	std::function<void()> wake;
+	{
+		std::lock_guard<std::mutex> lock(this->lock);
+		this->done = true;
+		wake = std::move(this->onDone);
+	}
+	this->finished.notify_all();
+	if (wake) {
+		wake();
+	}
+}
+
+bool IoRequest::isDone() {
+	std::lock_guard<std::mutex> lock(this->lock);
+	return this->done;
+}
+
+bool IoRequest::park(std::function<void()> wake) {
+	std::lock_guard<std::mutex> lock(this->lock);
+	if (this->done) {
+		return false;
+	}
+	this->onDone = std::move(wake);
+	return true;
+}
+
+void IoRequest::wait() {
+	std::unique_lock<std::mutex> lock(this->lock);
+	this->finished.wait(lock, [this] {
+		return this->done;
+	});
+}
+
+IoPool::IoPool(unsigned threads)
+    : size(threads ? threads : 1) {
+}
+
+IoPool::~IoPool() {
+	{
+		std::lock_guard<std::mutex> lock(this->lock);
+		this->stopping = true;
+	}
+	this->ready.notify_all();
+	for (auto &t : this->threads) {
+		t.join();
+	}
+}
+
+void IoPool::submit(std::shared_ptr<IoRequest> request) {
+	{
+		std::lock_guard<std::mutex> lock(this->lock);
+		if (this->threads.empty()) {
+			for (unsigned i = 0; i < this->size; i++) {
+				this->threads.emplace_back([this] {
+					this->work();
+				});
+			}
+		}
+		this->queue.push_back(request);
+	}
+	this->ready.notify_one();
+}
+
+// requests still queued when the pool goes away are done first
+void IoPool::work() {
+	while (true) {
+		std::shared_ptr<IoRequest> request;
+		{
+			std::unique_lock<std::mutex> lock(this->lock);
+			this->ready.wait(lock, [this] {
+				return this->stopping || !this->queue.empty();
+			});
+			if (this->queue.empty()) {
+				return;
+			}
+			request = this->queue.front();
+			this->queue.pop_front();
+		}
+		request->perform();
+		request->complete();
+	}
+}
+
+std::shared_ptr<IoPool> IoPool::defaults() {
+	static std::shared_ptr<IoPool> pool = std::make_shared<IoPool>();
+	return pool;
+}
@@ -0,0 +1,204 @@
+#include <cstdio>
+#include <format>
+#include <poll.h>
+#include <sigma-vm/Metrics.hpp>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+VmMetrics::VmMetrics(std::string name, uint64_t cpu)
+    : name(name), cpu(cpu) {
+}
+
+std::shared_ptr<VmMetrics> Metrics::add(std::string name, uint64_t cpu) {
+	auto vm = std::make_shared<VmMetrics>(name, cpu);
+	std::lock_guard<std::mutex> lock(this->lock);
+	this->vms.push_back(vm);
+	return vm;
+}
+
+// {vm="name",cpu="n"} with the name escaped
+static std::string labels(const VmMetrics &vm) {
+	std::string out = "{vm=\"";
+	for (char c : vm.name) {
+		if (c == '\\' || c == '"') {
+			out += '\\';
+			out += c;
+		} else if (c == '\n') {
+			out += "\\n";
+		} else {
+			out += c;
+		}
+	}
+	return out + "\",cpu=\"" + std::to_string(vm.cpu) + "\"}";
+}
+
+std::string Metrics::render() {
+	std::vector<std::shared_ptr<VmMetrics>> vms;
+	Totals totals;
+	{
+		std::lock_guard<std::mutex> lock(this->lock);
+		// only the registry holds the ones whose VM is gone
+		for (auto it = this->vms.begin(); it != this->vms.end();) {
+			if (it->use_count() == 1) {
+				VmMetrics &m = **it;
+				this->retired.instructions += m.instructions.load(std::memory_order_relaxed);
+				this->retired.biosCalls += m.biosCalls.load(std::memory_order_relaxed);
+				this->retired.faults += m.faults.load(std::memory_order_relaxed);
+				this->retired.blocked += m.blocked.load(std::memory_order_relaxed);
+				it = this->vms.erase(it);
+			} else {
+				it++;
+			}
+		}
+		vms = this->vms;
+		totals = this->retired;
+	}
+
+	struct Counter {
+		const char *name, *type, *help;
+		std::atomic<uint64_t> VmMetrics::*value;
+		uint64_t Totals::*total;
+	};
+	static const Counter counters[] = {
+	    {"sigma_vm_instructions_total", "counter", "Guest instructions executed.", &VmMetrics::instructions, &Totals::instructions},
+	    {"sigma_vm_bios_calls_total", "counter", "BIOS calls completed.", &VmMetrics::biosCalls, &Totals::biosCalls},
+	    {"sigma_vm_faults_total", "counter", "Guest traps and host errors.", &VmMetrics::faults, &Totals::faults},
+	    {"sigma_vm_blocked_total", "counter", "Runs that stopped on a blocked BIOS call.", &VmMetrics::blocked, &Totals::blocked},
+	    {"sigma_vm_memory_words", "gauge", "Guest memory plus mapped host buffers and files, in words.", &VmMetrics::memoryWords, nullptr},
+	};
+	std::string out;
+	for (auto &c : counters) {
+		out += std::format("# HELP {} {}\n# TYPE {} {}\n", c.name, c.help, c.name, c.type);
+		for (auto &vm : vms) {
+			uint64_t value = ((*vm).*c.value).load(std::memory_order_relaxed);
+			out += std::format("{}{} {}\n", c.name, labels(*vm), value);
+		}
+	}
+	out += "# HELP sigma_vm_running Whether the vCPU is inside run().\n# TYPE sigma_vm_running gauge\n";
+	for (auto &vm : vms) {
+		out += std::format("sigma_vm_running{} {}\n", labels(*vm), vm->running.load(std::memory_order_relaxed) ? 1 : 0);
+	}
+	out += std::format("# HELP sigma_vm_guests vCPUs with metrics that are still alive.\n# TYPE sigma_vm_guests gauge\nsigma_vm_guests {}\n", vms.size());
+	// process totals include vCPUs that are gone
+	for (auto &c : counters) {
+		if (!c.total) {
+			continue;
+		}
+		uint64_t value = totals.*c.total;
+		for (auto &vm : vms) {
+			value += ((*vm).*c.value).load(std::memory_order_relaxed);
+		}
+		std::string name = std::string("sigma_vm_process_") + (c.name + 9);
+		out += std::format("# HELP {} {}\n# TYPE {} counter\n{} {}\n", name, c.help, name, name, value);
+	}
+	return out;
+}
+
+Metrics &Metrics::process() {
+	static Metrics metrics;
+	return metrics;
+}
+
+MetricsExporter::MetricsExporter(Metrics &metrics, MetricsTarget target, std::string path, unsigned intervalMs)
+    : metrics(metrics), target(target), path(path), interval(intervalMs ? intervalMs : 1) {
+	if (target == MetricsTarget::Socket) {
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path)) {
+			throw std::runtime_error(std::format("socket path {} is too long", path));
+		}
+		path.copy(addr.sun_path, path.size());
+		this->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		unlink(path.c_str());
+		if (this->listener < 0 || bind(this->listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(this->listener, 16) != 0) {
+			if (this->listener >= 0) {
+				close(this->listener);
+			}
+			throw std::runtime_error(std::format("unable to listen on {}", path));
+		}
+		this->thread = std::thread([this] {
+			this->serve();
+		});
+		return;
+	}
+	if (!this->writeFile()) {
+		throw std::runtime_error(std::format("unable to write metrics to {}", path));
+	}
+	this->thread = std::thread([this] {
+		std::unique_lock<std::mutex> lock(this->lock);
+		while (!this->stopped.wait_for(lock, std::chrono::milliseconds(this->interval), [this] {
+			return this->stopping;
+		})) {
+			this->writeFile();
+		}
+	});
+}
+
+MetricsExporter::~MetricsExporter() {
+	{
+		std::lock_guard<std::mutex> lock(this->lock);
+		this->stopping = true;
+	}
+	this->stopped.notify_all();
+	this->thread.join();
+	if (this->target == MetricsTarget::Socket) {
+		close(this->listener);
+		unlink(this->path.c_str());
+	} else {
+		this->writeFile();
+	}
+}
+
+// written to a temporary file and renamed, so readers never see half of it
+bool MetricsExporter::writeFile() {
+	std::string text = this->metrics.render();
+	// unique, so exporters of several processes can share one path
+	std::string tmp = std::format("{}.{}.{}.tmp", this->path, getpid(), std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) {
+		return false;
+	}
+	bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+	ok &= fclose(f) == 0;
+	if (!ok || rename(tmp.c_str(), this->path.c_str()) != 0) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+void MetricsExporter::serve() {
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(this->lock);
+			if (this->stopping) {
+				return;
+			}
+		}
+		pollfd p{this->listener, POLLIN, 0};
+		// wakes up now and then to see if the exporter is going away
+		if (poll(&p, 1, 100) <= 0) {
+			continue;
+		}
+		int client = accept4(this->listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client < 0) {
+			continue;
+		}
+		// a client that does not read must not hold up the next scrape or
+		// the destructor
+		timeval timeout{METRICS_SEND_TIMEOUT_MS / 1000, METRICS_SEND_TIMEOUT_MS % 1000 * 1000};
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		std::string text = this->metrics.render();
+		for (size_t sent = 0; sent < text.size();) {
+			ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+		close(client);
+	}
+}
@@ -0,0 +1,25 @@
+#include <dlfcn.h>
+#include <format>
+#include <sigma-vm/NativeProgram.hpp>
+#include <stdexcept>
+
+NativeProgram::NativeProgram(std::string path) {
+	this->handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!this->handle) {
+		throw std::runtime_error(std::format("unable to load {}: {}", path, dlerror()));
+	}
+	const int *abi = (const int *)dlsym(this->handle, NATIVE_ABI_SYMBOL);
+	this->entry = (NativeEntry)dlsym(this->handle, NATIVE_ENTRY);
+	if (!abi || !this->entry) {
+		dlclose(this->handle);
+		throw std::runtime_error(std::format("{} is not a translated sigma program", path));
+	}
+	if (*abi != NATIVE_ABI) {
+		dlclose(this->handle);
+		throw std::runtime_error(std::format("{} was translated for native ABI {}, expected {}", path, *abi, NATIVE_ABI));
+	}
+}
+
+NativeProgram::~NativeProgram() {
+	dlclose(this->handle);
+}
@@ -1,26 +1,347 @@
+#include <algorithm>
 #include <cstdint>
+#include <fcntl.h>
+#include <format>
 #include <sigma-vm/RAM.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-RAM::RAM(uint64_t size) {
-	this->content = std::vector<uint64_t>(size);
+RAM::RAM(uint64_t size)
+    : content(nullptr), size(size), quota(UINT64_MAX), mapped(size), touched(nullptr), watchTouched(nullptr), pageWords(sysconf(_SC_PAGESIZE) / sizeof(uint64_t)), codeVersion(0), runners(0) {
+	if (size == 0) {
+		return;
+	}
+	this->codePages = std::make_unique<std::atomic<uint8_t>[]>((size + RAM_CODE_WORDS - 1) / RAM_CODE_WORDS);
+	// anonymous mappings are page aligned and zero filled lazily, which lets
+	// image and checkpoint loaders map files directly over guest memory
+	void *p = mmap(nullptr, size * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		throw std::runtime_error("unable to allocate guest memory");
+	}
+	this->content = (uint64_t *)p;
+}
+
+RAM::RAM(RAM &&other)
+    : content(other.content), size(other.size), regions(std::move(other.regions)), quota(other.quota), mapped(other.mapped), touched(other.touched), watchTouched(other.watchTouched), watchpoints(std::move(other.watchpoints)), pageWatches(std::move(other.pageWatches)), pageWords(other.pageWords), codePages(std::move(other.codePages)), codeVersion(other.codeVersion.load()), runners(other.runners.load()) {
+	other.content = nullptr;
+	other.size = 0;
+}
+
+RAM::~RAM() {
+	for (auto &r : this->regions) {
+		if (r.fileBytes) {
+			munmap(r.host, r.fileBytes);
+		}
+	}
+	if (this->content) {
+		munmap(this->content, this->size * sizeof(uint64_t));
+	}
 }
 
 uint64_t RAM::getAt(uint64_t i) {
-	if (i >= this->content.size()) {
+	uint64_t v;
+	if (!this->load(i, v)) {
 		throw std::runtime_error("Memory address is out of range");
 	}
-	if (i < 0) {
-		throw std::runtime_error("Memory address cannot be less than 0");
-	}
-	return this->content[(size_t)i];
+	return v;
 }
 
 void RAM::setAt(uint64_t i, uint64_t v) {
-	if (i >= this->content.size()) {
-		throw std::runtime_error("Memory address is out of range");
+	if (this->watchTouched && i < this->size) {
+		this->logWatched(i, 1);
+	}
+	if (this->touched) {
+		uint64_t old;
+		if (this->load(i, old)) {
+			this->touched->ranges.push_back({i, 1});
+			this->touched->before.push_back(old);
+		}
+	}
+	if (!this->store(i, v)) {
+		throw std::runtime_error("Memory address is out of range or read only");
+	}
+}
+
+std::span<uint64_t> RAM::span(uint64_t addr, uint64_t words) {
+	if (words == 0) {
+		return std::span<uint64_t>();
+	}
+	if (addr + words < addr) {
+		throw std::runtime_error("Memory range wraps around");
+	}
+	std::span<uint64_t> view;
+	if (addr + words <= this->size) {
+		view = std::span<uint64_t>(this->content + addr, words);
+	}
+	for (auto &r : this->regions) {
+		if (view.empty() && addr >= r.addr && addr + words <= r.addr + r.words) {
+			view = std::span<uint64_t>(r.host + (addr - r.addr), words);
+		}
+	}
+	if (!view.empty()) {
+		if (addr < this->size) {
+			this->codeWritten(addr, words);
+			if (this->watchTouched) {
+				this->logWatched(addr, words);
+			}
+		}
+		if (this->touched) {
+			this->touched->ranges.push_back({addr, words});
+			this->touched->before.insert(this->touched->before.end(), view.begin(), view.end());
+		}
+		return view;
+	}
+	throw std::runtime_error(std::format("Memory range {}..{} is out of range", addr, addr + words));
+}
+
+void RAM::track(TouchLog *log) {
+	this->touched = log;
+}
+
+void RAM::trackWatched(std::vector<std::pair<uint64_t, uint64_t>> *log) {
+	this->watchTouched = log;
+}
+
+// only the words under watchpoints, so the cost does not depend on how
+// much a handler touches
+void RAM::logWatched(uint64_t addr, uint64_t words) {
+	for (auto &w : this->watchpoints) {
+		uint64_t from = std::max(addr, w.addr), to = std::min(addr + words, w.addr + w.words);
+		for (uint64_t i = from; i < to; i++) {
+			this->watchTouched->push_back({i, this->content[i]});
+		}
+	}
+}
+
+void RAM::markCode(uint64_t addr, uint64_t words) {
+	for (uint64_t page = addr / RAM_CODE_WORDS; page <= (addr + words - 1) / RAM_CODE_WORDS; page++) {
+		this->codePages[page].store(1);
+	}
+}
+
+// span() cannot tell reads from writes, so handing out a view counts as one
+void RAM::codeWritten(uint64_t i, uint64_t words) {
+	bool written = false;
+	for (uint64_t page = i / RAM_CODE_WORDS; page <= (i + words - 1) / RAM_CODE_WORDS; page++) {
+		if (this->codePages[page].load(std::memory_order_relaxed)) {
+			this->codePages[page].store(0, std::memory_order_relaxed);
+			written = true;
+		}
+	}
+	if (written) {
+		this->codeVersion.fetch_add(1);
+	}
+}
+
+// slow path for addresses above guest memory
+uint64_t *RAM::locate(uint64_t i, bool write) {
+	for (auto &r : this->regions) {
+		if (i >= r.addr && i - r.addr < r.words) {
+			if (write && !r.writable) {
+				return nullptr;
+			}
+			return r.host + (i - r.addr);
+		}
+	}
+	return nullptr;
+}
+
+void RAM::addRunner() {
+	this->runners.fetch_add(1);
+}
+
+void RAM::removeRunner() {
+	this->runners.fetch_sub(1);
+}
+
+void RAM::checkRunners() {
+	if (this->runners.load()) {
+		throw std::runtime_error("mappings cannot change while started vCPUs are running");
+	}
+}
+
+void RAM::mapBuffer(uint64_t addr, uint64_t *buffer, uint64_t words, bool writable) {
+	this->checkRunners();
+	if (addr < this->size || addr + words < addr) {
+		throw std::runtime_error(std::format("buffer at {} overlaps guest memory", addr));
+	}
+	for (auto &r : this->regions) {
+		if (addr < r.addr + r.words && r.addr < addr + words) {
+			throw std::runtime_error(std::format("buffer at {} overlaps another mapping", addr));
+		}
 	}
-	if (i < 0) {
-		throw std::runtime_error("Memory address cannot be less than 0");
+	if (words > this->quota - this->mapped) {
+		throw QuotaExceeded(std::format("mapping {} words at {} exceeds the memory quota of {} words", words, addr, this->quota));
+	}
+	this->regions.push_back(Region{addr, words, buffer, writable});
+	this->mapped += words;
+}
+
+uint64_t RAM::mapHostFile(uint64_t addr, std::string path, bool writable) {
+	this->checkRunners();
+	int fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(std::format("unable to open {}", path));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		throw std::runtime_error(std::format("{} is empty or not a file", path));
+	}
+	size_t bytes = st.st_size;
+	void *p = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		throw std::runtime_error(std::format("unable to map {}", path));
+	}
+	uint64_t words = (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	try {
+		this->mapBuffer(addr, (uint64_t *)p, words, writable);
+	} catch (...) {
+		munmap(p, bytes);
+		throw;
+	}
+	this->regions.back().fileBytes = bytes;
+	return words;
+}
+
+void RAM::unmapBuffer(uint64_t addr) {
+	this->checkRunners();
+	for (auto it = this->regions.begin(); it != this->regions.end(); it++) {
+		if (it->addr == addr) {
+			if (it->fileBytes) {
+				munmap(it->host, it->fileBytes);
+			}
+			this->mapped -= it->words;
+			this->regions.erase(it);
+			return;
+		}
+	}
+	throw std::runtime_error(std::format("nothing is mapped at {}", addr));
+}
+
+uint64_t RAM::getSize() {
+	return this->size;
+}
+
+void RAM::setQuota(uint64_t words) {
+	if (this->mapped > words) {
+		throw QuotaExceeded(std::format("{} words are already mapped, more than the quota of {} words", this->mapped, words));
+	}
+	this->quota = words;
+}
+
+uint64_t RAM::getQuota() {
+	return this->quota;
+}
+
+uint64_t RAM::used() {
+	return this->mapped;
+}
+
+void RAM::mapFile(uint64_t addr, int fd, uint64_t offset, uint64_t words) {
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	if (words == 0) {
+		return;
+	}
+	if (addr + words > this->size || addr + words < addr) {
+		throw std::runtime_error("mapped file does not fit into guest memory");
+	}
+	if ((addr * sizeof(uint64_t)) % page != 0 || offset % page != 0) {
+		throw std::runtime_error(std::format("file mapping at {} is not page aligned", addr));
+	}
+	this->codeWritten(addr, words);
+	// the tail of the last page would be file contents past the section, so
+	// map only whole pages and copy the remainder
+	uint64_t bytes = words * sizeof(uint64_t);
+	uint64_t whole = bytes - bytes % page;
+	if (whole) {
+		void *p = mmap(this->content + addr, whole, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+		if (p == MAP_FAILED) {
+			throw std::runtime_error("unable to map file into guest memory");
+		}
+	}
+	if (bytes > whole) {
+		char *dst = (char *)(this->content + addr) + whole;
+		uint64_t left = bytes - whole;
+		while (left) {
+			ssize_t n = pread(fd, dst, left, offset + whole);
+			if (n <= 0) {
+				throw std::runtime_error("unable to read file into guest memory");
+			}
+			dst += n;
+			whole += n;
+			left -= n;
+		}
+	}
+}
+
+void RAM::setPage(uint64_t page, bool writable) {
+	int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+	if (mprotect(this->content + page * this->pageWords, this->pageWords * sizeof(uint64_t), prot) != 0) {
+		throw std::runtime_error("unable to change the protection of guest memory");
+	}
+}
+
+void RAM::watch(uint64_t addr, uint64_t words, bool stop) {
+	if (words == 0 || addr + words > this->size || addr + words < addr) {
+		throw std::runtime_error(std::format("watchpoint {}..{} is not in guest memory", addr, addr + words));
+	}
+	if (this->pageWatches.empty()) {
+		this->pageWatches.resize((this->size + this->pageWords - 1) / this->pageWords);
+	}
+	for (uint64_t page = addr / this->pageWords; page <= (addr + words - 1) / this->pageWords; page++) {
+		if (this->pageWatches[page]++ == 0) {
+			this->setPage(page, false);
+		}
+	}
+	this->watchpoints.push_back({addr, words, stop});
+}
+
+void RAM::unwatch(uint64_t addr) {
+	for (auto it = this->watchpoints.begin(); it != this->watchpoints.end(); it++) {
+		if (it->addr != addr) {
+			continue;
+		}
+		for (uint64_t page = addr / this->pageWords; page <= (addr + it->words - 1) / this->pageWords; page++) {
+			if (--this->pageWatches[page] == 0) {
+				this->setPage(page, true);
+			}
+		}
+		this->watchpoints.erase(it);
+		return;
+	}
+	throw std::runtime_error(std::format("no watchpoint at {}", addr));
+}
+
+const std::vector<RAM::Watchpoint> &RAM::getWatchpoints() {
+	return this->watchpoints;
+}
+
+uint64_t RAM::watchedAddress(const void *host) {
+	uintptr_t p = (uintptr_t)host;
+	uintptr_t start = (uintptr_t)this->content;
+	if (this->pageWatches.empty() || p < start || p >= start + this->size * sizeof(uint64_t)) {
+		return UINT64_MAX;
+	}
+	uint64_t addr = (p - start) / sizeof(uint64_t);
+	return this->pageWatches[addr / this->pageWords] ? addr : UINT64_MAX;
+}
+
+void RAM::openWatched(bool open) {
+	for (auto &w : this->watchpoints) {
+		uint64_t first = w.addr / this->pageWords, last = (w.addr + w.words - 1) / this->pageWords;
+		int prot = open ? PROT_READ | PROT_WRITE : PROT_READ;
+		if (mprotect(this->content + first * this->pageWords, (last - first + 1) * this->pageWords * sizeof(uint64_t), prot) != 0) {
+			throw std::runtime_error("unable to change the protection of guest memory");
+		}
+	}
+}
+
+void RAM::openWatched(uint64_t addr, bool open) {
+	uint64_t page = addr / this->pageWords;
+	if (page < this->pageWatches.size() && this->pageWatches[page]) {
+		this->setPage(page, open);
 	}
-	this->content[i] = v;
 }
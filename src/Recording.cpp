@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <format>
+#include <sigma-vm/Recording.hpp>
+#include <stdexcept>
+
+static_assert(RECORDING_STATE <= 64);
+
+Recording::Recording(std::string path, RecordingMode mode)
+    : path(path), mode(mode) {
+	auto flags = std::ios::binary | (mode == RecordingMode::Record ? std::ios::out | std::ios::trunc : std::ios::in);
+	this->file.open(path, flags);
+	if (!this->file) {
+		throw std::runtime_error(std::format("unable to open recording {}", path));
+	}
+	if (mode == RecordingMode::Replay) {
+		this->buffer.assign(std::istreambuf_iterator<char>(this->file), std::istreambuf_iterator<char>());
+		this->used = this->buffer.size();
+	} else {
+		this->buffer.resize(RECORDING_BUFFER);
+	}
+}
+
+Recording::~Recording() {
+	if (this->mode == RecordingMode::Record) {
+		this->file.write((const char *)this->buffer.data(), this->used);
+	}
+}
+
+RecordingMode Recording::getMode() {
+	return this->mode;
+}
+
+uint64_t Recording::calls() {
+	return this->count;
+}
+
+// makes room for bytes more, writing out what is collected if needed
+void Recording::reserve(size_t bytes) {
+	if (this->used + bytes > this->buffer.size()) {
+		this->flush();
+	}
+	if (bytes > this->buffer.size()) {
+		this->buffer.resize(bytes);
+	}
+}
+
+// LEB128, most values are small; the caller makes room for 10 bytes
+static inline uint8_t *encode(uint8_t *out, uint64_t v) {
+	while (v >= 0x80) {
+		*out++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*out++ = (uint8_t)v;
+	return out;
+}
+
+void Recording::put(uint64_t v) {
+	this->used = encode(this->buffer.data() + this->used, v) - this->buffer.data();
+}
+
+uint64_t Recording::get() {
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (this->pos == this->used) {
+			throw std::runtime_error(std::format("recording {} is truncated", this->path));
+		}
+		uint8_t c = this->buffer[this->pos++];
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			return v;
+		}
+	}
+	throw std::runtime_error(std::format("recording {} is corrupt", this->path));
+}
+
+void Recording::begin(uint64_t *state) {
+	if (this->mode == RecordingMode::Record) {
+		this->reserve((RECORDING_STATE + 2) * 10);
+		this->put(RECORDING_MAGIC);
+		this->put(RECORDING_VERSION);
+		for (int i = 0; i < RECORDING_STATE; i++) {
+			this->put(state[i]);
+		}
+		return;
+	}
+	if (this->get() != RECORDING_MAGIC) {
+		throw std::runtime_error(std::format("{} is not a recording", this->path));
+	}
+	uint64_t version = this->get();
+	if (version != RECORDING_VERSION) {
+		throw std::runtime_error(std::format("unsupported recording version {}", version));
+	}
+	for (int i = 0; i < RECORDING_STATE; i++) {
+		state[i] = this->get();
+	}
+}
+
+void Recording::write(const RecordedCall &call, const uint64_t *before) {
+	this->reserve((RECORDING_STATE + 5 + 2 * call.writes.size() + call.data.size()) * 10 + call.message.size());
+	uint8_t *out = this->buffer.data() + this->used;
+	out = encode(out, call.ip);
+	out = encode(out, call.number);
+	out = encode(out, (uint64_t)call.result);
+	uint64_t changed = 0;
+	for (int i = 0; i < RECORDING_STATE; i++) {
+		if (call.state[i] != before[i]) {
+			changed |= 1ull << i;
+		}
+	}
+	out = encode(out, changed);
+	for (int i = 0; i < RECORDING_STATE; i++) {
+		if (changed & (1ull << i)) {
+			out = encode(out, call.state[i]);
+		}
+	}
+	if (call.result == CallResult::HostError || call.result == CallResult::Quota) {
+		out = encode(out, call.message.size());
+		out = std::copy(call.message.begin(), call.message.end(), out);
+	}
+	out = encode(out, call.writes.size());
+	for (auto &[addr, words] : call.writes) {
+		out = encode(out, addr);
+		out = encode(out, words);
+	}
+	for (uint64_t w : call.data) {
+		out = encode(out, w);
+	}
+	this->used = out - this->buffer.data();
+	this->count++;
+}
+
+bool Recording::read(RecordedCall &call, const uint64_t *state) {
+	if (this->pos == this->used) {
+		return false;
+	}
+	call.ip = this->get();
+	call.number = this->get();
+	call.result = (CallResult)this->get();
+	uint64_t changed = this->get();
+	for (int i = 0; i < RECORDING_STATE; i++) {
+		call.state[i] = (changed & (1ull << i)) ? this->get() : state[i];
+	}
+	call.message.clear();
+	if (call.result == CallResult::HostError || call.result == CallResult::Quota) {
+		uint64_t size = this->get();
+		if (size > this->used - this->pos) {
+			throw std::runtime_error(std::format("recording {} is truncated", this->path));
+		}
+		call.message.assign((const char *)&this->buffer[this->pos], size);
+		this->pos += size;
+	}
+	call.writes.resize(this->get());
+	uint64_t total = 0;
+	for (auto &[addr, words] : call.writes) {
+		addr = this->get();
+		words = this->get();
+		total += words;
+	}
+	call.data.clear();
+	for (uint64_t i = 0; i < total; i++) {
+		call.data.push_back(this->get());
+	}
+	this->count++;
+	return true;
+}
+
+void Recording::flush() {
+	if (this->mode != RecordingMode::Record) {
+		return;
+	}
+	this->file.write((const char *)this->buffer.data(), this->used);
+	this->file.flush();
+	this->used = 0;
+	if (!this->file) {
+		throw std::runtime_error(std::format("unable to write recording {}", this->path));
+	}
+}
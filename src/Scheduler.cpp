@@ -0,0 +1,96 @@
+#include <format>
+#include <sigma-vm/Scheduler.hpp>
+#include <stdexcept>
+#include <thread>
+
+Scheduler::Scheduler(unsigned threads)
+    : threads(threads ? threads : 1) {
+}
+
+void Scheduler::add(VirtualMachine &vm) {
+	std::lock_guard<std::mutex> lock(this->lock);
+	this->queue.push_back(&vm);
+	this->vms.push_back(&vm);
+	this->live++;
+}
+
+// called by the I/O pool or the other side of a channel when a parked VM
+// can go on
+void Scheduler::wake(VirtualMachine *vm, bool io) {
+	{
+		std::lock_guard<std::mutex> lock(this->lock);
+		(io ? this->parkedIo : this->parkedChannels)--;
+		this->queue.push_back(vm);
+	}
+	this->ready.notify_one();
+}
+
+void Scheduler::work() {
+	std::unique_lock<std::mutex> lock(this->lock);
+	while (true) {
+		if (this->live == 0 || this->deadlocked) {
+			return;
+		}
+		// every VM that is left waits on a channel, and nothing is running
+		// or doing I/O that could wake one of them
+		if (this->inFlight == 0 && this->queue.empty() && this->parkedIo == 0 && this->parkedChannels > 0) {
+			this->deadlocked = true;
+			this->ready.notify_all();
+			return;
+		}
+		if (this->queue.empty()) {
+			this->ready.wait(lock);
+			continue;
+		}
+		VirtualMachine *vm = this->queue.front();
+		this->queue.pop_front();
+		this->inFlight++;
+		lock.unlock();
+
+		StopReason reason = vm->run(SCHEDULER_SLICE);
+		bool io = reason == StopReason::Blocked && vm->ioPending();
+
+		lock.lock();
+		if (reason == StopReason::Blocked) {
+			// still in flight while it parks, so the wake cannot be missed
+			// by the deadlock check
+			(io ? this->parkedIo : this->parkedChannels)++;
+			lock.unlock();
+			if (!vm->parkBlocked([this, vm, io] {
+				    this->wake(vm, io);
+			    })) {
+				this->wake(vm, io);
+			}
+			lock.lock();
+		} else if (reason == StopReason::Budget) {
+			this->queue.push_back(vm);
+			this->ready.notify_one();
+		} else {
+			this->live--;
+			if (this->live == 0) {
+				this->ready.notify_all();
+			}
+		}
+		this->inFlight--;
+	}
+}
+
+void Scheduler::run() {
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < this->threads; i++) {
+		workers.emplace_back([this] {
+			this->work();
+		});
+	}
+	this->work();
+	for (auto &t : workers) {
+		t.join();
+	}
+	if (this->deadlocked) {
+		// the channels must not call back into this scheduler later
+		for (VirtualMachine *vm : this->vms) {
+			vm->unparkBlocked();
+		}
+		throw std::runtime_error(std::format("{} guests are blocked on each other", this->parkedChannels));
+	}
+}
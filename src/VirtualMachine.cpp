@@ -1,14 +1,91 @@
+#include <algorithm>
+#include <atomic>
 #include <climits>
+#include <deque>
+#include <format>
 #include <iomanip>
+#include <mutex>
+#include <setjmp.h>
 #include <sigma-vm/VirtualMachine.hpp>
+#include <signal.h>
 #include <stdexcept>
+#include <thread>
 
-// #define DEBUG_VM
+struct CpuSet {
+	std::mutex lock;
+	std::vector<std::unique_ptr<VirtualMachine>> cpus;
+	std::deque<std::thread> threads; // deque so joining can go on while vCPUs start more
+	std::atomic<bool> stopping{false};
+};
 
-#ifdef DEBUG_VM
-#include <chrono>
-#include <thread>
-#endif
+// the VM running under runWatched() on this thread, and where a guest
+// store to a watched page continues
+struct WatchContext {
+	VirtualMachine *vm;
+	sigjmp_buf jump;
+	uint64_t addr;
+};
+
+static thread_local WatchContext *watchContext = nullptr;
+static struct sigaction previousSegv;
+static std::mutex watchLock; // one watched write at a time, pages are opened for it
+
+static void onWatchFault(int sig, siginfo_t *info, void *ucontext) {
+	WatchContext *context = watchContext;
+	if (context) {
+		uint64_t addr = context->vm->ram.watchedAddress(info->si_addr);
+		if (addr != UINT64_MAX) {
+			context->addr = addr;
+			siglongjmp(context->jump, 1);
+		}
+	}
+	// not a watched write: chain to whoever had SIGSEGV before and stay
+	// installed, a runtime that recovers from its own faults keeps working
+	if (previousSegv.sa_flags & SA_SIGINFO) {
+		previousSegv.sa_sigaction(sig, info, ucontext);
+		return;
+	}
+	if (previousSegv.sa_handler != SIG_DFL && previousSegv.sa_handler != SIG_IGN) {
+		previousSegv.sa_handler(sig);
+		return;
+	}
+	// a real crash, the instruction faults again once this returns
+	struct sigaction fallback{};
+	fallback.sa_handler = SIG_DFL;
+	sigaction(SIGSEGV, &fallback, nullptr);
+}
+
+// compile time switches for the interpreter loop, every mode is a separate
+// instantiation so the production loop carries none of the diagnostics
+template <bool Step, bool Metered, bool Trace, bool Profile, bool Watched = false>
+struct ExecPolicy {
+	static constexpr bool step = Step;
+	static constexpr bool metered = Metered || Step;
+	static constexpr bool trace = Trace;
+	static constexpr bool profile = Profile;
+	static constexpr bool watched = Watched && metered; // keeps the budget in the VM for runWatched()
+};
+
+std::string toString(TrapCode code) {
+	switch (code) {
+	case TrapCode::None:
+		return "none";
+	case TrapCode::BadAddress:
+		return "bad address";
+	case TrapCode::BadRegister:
+		return "bad register";
+	case TrapCode::DivideByZero:
+		return "divide by zero";
+	case TrapCode::IllegalOpcode:
+		return "illegal opcode";
+	case TrapCode::HostError:
+		return "host error";
+	case TrapCode::QuotaExceeded:
+		return "memory quota exceeded";
+	default:
+		return "unknown";
+	}
+}
 
 bool VirtualMachine::getRunning() {
 	return this->regFlag & 0x1;
@@ -32,7 +109,28 @@ void VirtualMachine::setBiosMode(bool v) {
 }
 
 VirtualMachine::VirtualMachine(uint64_t ramSize)
-    : regIp(0), ram(ramSize) {
+    : VirtualMachine(std::make_shared<RAM>(ramSize)) {
+}
+
+VirtualMachine::VirtualMachine(std::shared_ptr<RAM> memory)
+    : bios(Bios::defaults()), memory(memory), regA(0), regB(0), regC(0), addRegs{}, regIp(0), regSp(0), regSbp(0), regFlag(0), ram(*memory), trap(TrapCode::None), faultIp(0), trapVector(0), traceOut(&std::cerr) {
+	this->setMode(ExecMode::Fast);
+}
+
+VirtualMachine::~VirtualMachine() {
+	// a guest that ends on an unbound call still gets it logged
+	try {
+		this->finishHostCall();
+	} catch (const std::exception &) {
+	}
+	if (this->ownCpus) {
+		this->stopCpus();
+		this->joinCpus();
+	}
+}
+
+std::shared_ptr<RAM> VirtualMachine::getMemory() {
+	return this->memory;
 }
 
 uint64_t *VirtualMachine::locateRegister(uint8_t flag, uint16_t v) {
@@ -64,153 +162,1651 @@ uint64_t *VirtualMachine::locateRegister(uint8_t flag, uint16_t v) {
 void VirtualMachine::biosTick() {
 	this->setBiosMode(false);
 	this->setRunning(true);
-	if (this->regA == 0x1001) {
-		std::cout << (char)this->regB;
+	this->callBios();
+	// only SYS can be retried or stop for a watchpoint
+	this->blocked = false;
+	this->watchStop = false;
+}
+
+// every BIOS call goes through here, so a recording sees all of them;
+// IP is past the SYS or the write to FLG
+bool VirtualMachine::callBios() {
+	bool bound = this->ram.watching() ? this->watchBios() : this->enterBios();
+	if (this->metrics && bound && !this->blocked) {
+		this->metrics->biosCalls.fetch_add(1, std::memory_order_relaxed);
+	}
+	return bound;
+}
+
+bool VirtualMachine::enterBios() {
+	if (!this->recording) {
+		return this->bios->call(this->regA, *this);
+	}
+	if (this->recording->getMode() == RecordingMode::Replay) {
+		return this->replayBios();
+	}
+	return this->recordBios();
+}
+
+bool VirtualMachine::recordBios() {
+	RecordedCall &call = this->call;
+	call.ip = this->regIp - 2;
+	call.number = this->regA;
+	call.result = CallResult::Done;
+	call.message.clear();
+	call.writes.clear();
+	call.data.clear();
+	uint64_t before[RECORDING_STATE];
+	this->saveState(before);
+	this->touched.ranges.clear();
+	this->touched.before.clear();
+	bool bound = false;
+	this->ram.track(&this->touched);
+	try {
+		bound = this->bios->call(this->regA, *this);
+	} catch (const QuotaExceeded &e) {
+		call.result = CallResult::Quota;
+		call.message = e.what();
+	} catch (const std::exception &e) {
+		call.result = CallResult::HostError;
+		call.message = e.what();
+	}
+	this->ram.track(nullptr);
+	// nothing happened yet, the call is logged when it is retried and done
+	if (this->blocked) {
+		return bound;
+	}
+	if (call.result == CallResult::Done && !bound) {
+		// the host serves it after the Trap stop, what it changes through
+		// span() and setAt() by the next run() is the result
+		call.result = CallResult::Unbound;
+		std::copy(before, before + RECORDING_STATE, this->hostBefore);
+		this->hostCall = true;
+		this->ram.track(&this->touched);
+		return false;
+	}
+	this->logCall(before);
+	if (call.result == CallResult::Quota) {
+		throw QuotaExceeded(call.message);
+	}
+	if (call.result == CallResult::HostError) {
+		throw std::runtime_error(call.message);
+	}
+	return bound;
+}
+
+void VirtualMachine::logCall(const uint64_t *before) {
+	RecordedCall &call = this->call;
+	this->saveState(call.state);
+	// only the words that are different now, in runs
+	const uint64_t *old = this->touched.before.data();
+	for (auto [addr, words] : this->touched.ranges) {
+		for (uint64_t i = 0; i < words; i++, old++) {
+			uint64_t now;
+			if (!this->ram.load(addr + i, now) || now == *old) {
+				continue;
+			}
+			if (call.writes.empty() || call.writes.back().first + call.writes.back().second != addr + i) {
+				call.writes.push_back({addr + i, 0});
+			}
+			call.writes.back().second++;
+			call.data.push_back(now);
+		}
+	}
+	this->recording->write(call, before);
+}
+
+bool VirtualMachine::replayBios() {
+	RecordedCall &call = this->call;
+	uint64_t state[RECORDING_STATE];
+	this->saveState(state);
+	if (!this->recording->read(call, state)) {
+		throw std::runtime_error(std::format("replay: the recording ends before call {:#x} at {:#x}", this->regA, this->regIp - 2));
+	}
+	if (call.ip != this->regIp - 2 || call.number != this->regA) {
+		throw std::runtime_error(std::format("replay: call {:#x} at {:#x} was recorded as call {:#x} at {:#x}", this->regA, this->regIp - 2, call.number, call.ip));
+	}
+	// vCPUs are refused while recording, a log that says otherwise cannot
+	// be followed since the replay would have to start them as well
+	if (call.number == BIOS_START_CPU && call.result != CallResult::HostError) {
+		throw std::runtime_error("replay: vCPUs started in a recording cannot be replayed");
+	}
+	// same for mapped files, the log does not hold their contents
+	if ((call.number == BIOS_MAP_FILE || call.number == BIOS_UNMAP) && call.result != CallResult::HostError) {
+		throw std::runtime_error("replay: files mapped in a recording cannot be replayed");
+	}
+	// the host serves the Trap stop again, the logged result replaces what
+	// it did when the guest goes on
+	if (call.result == CallResult::Unbound) {
+		this->hostCall = true;
+		return false;
+	}
+	this->applyCall();
+	switch (call.result) {
+	case CallResult::Quota:
+		throw QuotaExceeded(call.message);
+	case CallResult::HostError:
+		throw std::runtime_error(call.message);
+	default:
+		return true;
+	}
+}
+
+void VirtualMachine::applyCall() {
+	this->restoreState(this->call.state);
+	const uint64_t *data = this->call.data.data();
+	for (auto [addr, words] : this->call.writes) {
+		for (uint64_t i = 0; i < words; i++) {
+			if (!this->ram.store(addr + i, *data++)) {
+				throw std::runtime_error(std::format("replay: recorded write to {:#x} is out of range", addr + i));
+			}
+		}
+	}
+}
+
+void VirtualMachine::finishHostCall() {
+	if (!this->hostCall) {
+		return;
+	}
+	this->hostCall = false;
+	if (this->recording->getMode() == RecordingMode::Record) {
+		this->ram.track(nullptr);
+		this->logCall(this->hostBefore);
+	} else {
+		this->applyCall();
+	}
+}
+
+void VirtualMachine::saveState(uint64_t *state) {
+	this->saveRegisters(state);
+	state[NATIVE_REGS] = this->trapVector;
+}
+
+void VirtualMachine::restoreState(const uint64_t *state) {
+	this->restoreRegisters(state);
+	this->trapVector = state[NATIVE_REGS];
+}
+
+void VirtualMachine::setRecording(std::shared_ptr<Recording> recording) {
+	this->finishHostCall();
+	if (recording && this->cpus) {
+		throw std::runtime_error("a VM that started vCPUs cannot be recorded or replayed");
+	}
+	if (recording && !this->fileMaps.empty()) {
+		throw std::runtime_error("a VM that mapped files cannot be recorded or replayed");
+	}
+	if (recording) {
+		uint64_t state[RECORDING_STATE];
+		this->saveState(state);
+		recording->begin(state);
+		this->restoreState(state);
+	}
+	this->recording = recording;
+}
+
+// handlers write through span() without faulting, so watched pages are
+// opened during the call, and the watched words the handler got hold of
+// are compared afterwards
+bool VirtualMachine::watchBios() {
+	uint64_t ip = this->regIp - 2;
+	std::lock_guard<std::mutex> lock(watchLock);
+	this->watchTouched.clear();
+	this->ram.trackWatched(&this->watchTouched);
+	this->ram.openWatched(true);
+	bool bound;
+	try {
+		bound = this->enterBios();
+	} catch (...) {
+		this->ram.openWatched(false);
+		this->ram.trackWatched(nullptr);
+		throw;
+	}
+	this->ram.openWatched(false);
+	this->ram.trackWatched(nullptr);
+	// a word handed out twice counts once, with the value it had first
+	std::stable_sort(this->watchTouched.begin(), this->watchTouched.end(), [](auto &a, auto &b) {
+		return a.first < b.first;
+	});
+	uint64_t last = UINT64_MAX;
+	for (auto [addr, old] : this->watchTouched) {
+		if (addr == last) {
+			continue;
+		}
+		last = addr;
+		uint64_t value = this->ram.getAt(addr);
+		if (value == old) {
+			continue;
+		}
+		this->watchHits.push_back({ip, addr, old, value});
+		for (auto &w : this->ram.getWatchpoints()) {
+			if (addr >= w.addr && addr - w.addr < w.words) {
+				this->watchStop |= w.stop;
+			}
+		}
+	}
+	return bound;
+}
+
+// runs a loop and catches guest stores to watched pages; each one is
+// done again on its own with the page writable, then the loop goes on
+// with what is left of the budget
+StopReason VirtualMachine::runWatched(StopReason (VirtualMachine::*loop)(int64_t), int64_t budget) {
+	WatchContext context{this, {}, 0};
+	WatchContext *outer = watchContext;
+	watchContext = &context;
+	bool metered = loop != this->freeRunner;
+	// blocks do not keep IP up to date for the fault handler
+	StopReason (VirtualMachine::*const freeLoop)(int64_t) = this->mode == ExecMode::Blocks ? &VirtualMachine::execute<ExecPolicy<false, false, false, false>> : loop;
+	volatile int64_t left = budget; // written only between jumps
+	StopReason reason;
+	while (true) {
+		if (sigsetjmp(context.jump, 0) == 0) {
+			reason = metered ? this->executeWatched(loop == &VirtualMachine::step, left) : (this->*freeLoop)(left);
+			break;
+		}
+		// the loop left its registers in the VM, IP is past the store;
+		// charge the blocks it finished and this one up to the store
+		uint64_t ip = this->regIp - 2;
+		int64_t rest = this->budgetLeft - (int64_t)(ip - this->lastBlock) / 2 - 1;
+		reason = this->watchedWrite(context.addr);
+		if (reason != StopReason::Budget) {
+			this->budgetLeft = rest;
+			break;
+		}
+		if (metered) {
+			left = rest;
+			if (rest <= 0) {
+				this->budgetLeft = rest;
+				break;
+			}
+		}
+	}
+	watchContext = outer;
+	return reason;
+}
+
+// the metered loops of the current mode that runWatched() can account for
+StopReason VirtualMachine::executeWatched(bool step, int64_t budget) {
+	switch (this->mode) {
+	case ExecMode::Trace:
+		return step ? this->execute<ExecPolicy<true, true, true, false, true>>(budget)
+		            : this->execute<ExecPolicy<false, true, true, false, true>>(budget);
+	case ExecMode::Profile:
+		return step ? this->execute<ExecPolicy<true, true, false, true, true>>(budget)
+		            : this->execute<ExecPolicy<false, true, false, true, true>>(budget);
+	default:
+		return step ? this->execute<ExecPolicy<true, true, false, false, true>>(budget)
+		            : this->execute<ExecPolicy<false, true, false, false, true>>(budget);
+	}
+}
+
+StopReason VirtualMachine::watchedWrite(uint64_t addr) {
+	uint64_t ip = this->regIp - 2;
+	std::lock_guard<std::mutex> lock(watchLock);
+	uint64_t old = 0, value = 0;
+	this->ram.load(addr, old);
+	this->regIp = ip;
+	this->ram.openWatched(addr, true);
+	// without trace or profile, the loop already did both for this instruction
+	StopReason reason = this->execute<ExecPolicy<true, true, false, false>>(1);
+	this->ram.openWatched(addr, false);
+	this->ram.load(addr, value);
+	bool hit = false, stop = false;
+	for (auto &w : this->ram.getWatchpoints()) {
+		if (addr >= w.addr && addr - w.addr < w.words) {
+			hit = true;
+			stop |= w.stop;
+		}
+	}
+	if (hit) {
+		this->watchHits.push_back({ip, addr, old, value});
+	}
+	return reason == StopReason::Budget && stop ? StopReason::Watchpoint : reason;
+}
+
+void VirtualMachine::watch(uint64_t addr, uint64_t words, bool stop) {
+	if (this->native) {
+		throw std::runtime_error("native programs do not support watchpoints");
+	}
+	if (this->ram.hasRunners()) {
+		throw std::runtime_error("watchpoints cannot be set while started vCPUs run");
 	}
+	static std::once_flag installed;
+	std::call_once(installed, [] {
+		struct sigaction action{};
+		action.sa_sigaction = onWatchFault;
+		// the handler leaves with siglongjmp, so SIGSEGV must not stay blocked
+		action.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, &previousSegv);
+	});
+	this->ram.watch(addr, words, stop);
+}
+
+void VirtualMachine::unwatch(uint64_t addr) {
+	this->ram.unwatch(addr);
+}
+
+void VirtualMachine::setBios(std::shared_ptr<Bios> bios) {
+	this->bios = bios;
 }
 
-void VirtualMachine::tick() {
-	if (this->getBiosMode() || !this->getRunning()) {
+Bios &VirtualMachine::getBios() {
+	return *this->bios;
+}
+
+// FLG can only change through a register write, so the legacy BIOS entry
+// (writing 0x11 to FLG) is handled here instead of on every tick
+void VirtualMachine::flagWritten() {
+	if (this->regFlag != 0 && (this->getBiosMode() || !this->getRunning())) {
 		this->biosTick();
 	}
-	uint64_t info = ram.getAt(this->regIp++);
-	uint16_t op = (info >> 0) & 0xFFFF;
-	uint16_t flag = (info >> 16) & 0xFFFF;
-	uint16_t larg = (info >> 32) & 0xFFFF;
-	uint16_t rarg = (info >> 48) & 0xFFFF;
+}
 
-	uint64_t val = ram.getAt(this->regIp++);
+// writes through MOV, LDI and LEA may halt and enter the BIOS (FLG)
+bool VirtualMachine::stopAfterWrite(uint64_t *reg) {
+	if (reg == &this->regFlag) {
+		this->flagWritten();
+		return this->regFlag == 0x00;
+	}
+	return false;
+}
 
-	switch (op) {
-	case CMD_MOV: {
-		uint64_t *left = this->locateRegister(flag & 0xffff, larg);
-		uint64_t *right = this->locateRegister(flag >> 8, rarg);
-		if (!left) {
-			throw std::runtime_error("left arg in mov command does not exist");
+// metered loops charge the budget per basic block: every instruction that
+// can change control flow ends a block and pays for all of it by its length,
+// so straight line code costs nothing extra; unmetered loops never stop
+// for the budget
+// faults never throw: the trap code is recorded and either the guest trap
+// handler takes over or the run stops, so the loop needs no landing pads
+template <class Policy>
+StopReason VirtualMachine::execute(int64_t budget) {
+	StopReason reason;
+	TrapCode code;
+	uint64_t blockStart = this->regIp;
+	if constexpr (Policy::watched) {
+		this->budgetLeft = budget;
+		this->lastBlock = blockStart;
+	}
+	while (true) {
+		uint64_t ip = this->regIp;
+		uint64_t info, val;
+		uint16_t op, flag, larg, rarg;
+		if (!ram.load(ip, info) || !ram.load(ip + 1, val)) {
+			code = TrapCode::BadAddress;
+			goto fault;
 		}
-		if (!right) {
-			throw std::runtime_error("right arg in mov command does not exist");
+		this->regIp = ip + 2;
+		if constexpr (Policy::trace) {
+			this->traceInstruction(ip, info, val);
 		}
-		*left = *right;
-	} break;
-	case CMD_LOD:
-		this->regA = this->ram.getAt(this->regB);
-		break;
-	case CMD_SAV:
-		this->ram.setAt(this->regB, this->regA);
-		break;
-	case CMD_LDI: {
-		uint64_t *reg = this->locateRegister(flag & 0xffff, larg);
-		if (!reg) {
-			throw std::runtime_error("unable to locate register to load");
-		}
-		*reg = val;
-	} break;
-	case CMD_ADD:
-		this->regC = this->regA + this->regB;
-		break;
-	case CMD_MIN:
-		this->regC = this->regA - this->regB;
-		break;
-	case CMD_MUL:
-		this->regC = this->regA * this->regB;
-		break;
-	case CMD_DIV:
-		this->regC = this->regA / this->regB;
-		break;
-	case CMD_MOD:
-		this->regC = this->regA % this->regB;
-		break;
-	case CMD_GTH:
-		this->regC = this->regA > this->regB;
-		break;
-	case CMD_LTH:
-		this->regC = this->regA < this->regB;
-		break;
-	case CMD_GEQ:
-		this->regC = this->regA >= this->regB;
-		break;
-	case CMD_LEQ:
-		this->regC = this->regA <= this->regB;
-		break;
-	case CMD_EQU:
-		this->regC = this->regA == this->regB;
-		break;
-	case CMD_NEQ:
-		this->regC = this->regA != this->regB;
-		break;
-	case CMD_LAND:
-		this->regC = this->regA && this->regB;
-		break;
-	case CMD_LOR:
-		this->regC = this->regA || this->regB;
-		break;
-	case CMD_NOT:
-		this->regC = !this->regA;
-		break;
-	case CMD_BAND:
-		this->regC = this->regA & this->regB;
-		break;
-	case CMD_BOR:
-		this->regC = this->regA | this->regB;
+
+		op = (info >> 0) & 0xFFFF;
+		flag = (info >> 16) & 0xFFFF;
+		larg = (info >> 32) & 0xFFFF;
+		rarg = (info >> 48) & 0xFFFF;
+		if constexpr (Policy::profile) {
+			this->opcodeCounts[op]++;
+		}
+
+		switch (op) {
+		case CMD_MOV: {
+			uint64_t *left = this->locateRegister(flag & 0xffff, larg);
+			uint64_t *right = this->locateRegister(flag >> 8, rarg);
+			if (!left || !right) {
+				code = TrapCode::BadRegister;
+				goto fault;
+			}
+			*left = *right;
+			if (this->stopAfterWrite(left)) {
+				reason = StopReason::Halted;
+				goto stop;
+			}
+			if (left == &this->regIp || left == &this->regFlag) {
+				goto endBlock;
+			}
+		} break;
+		case CMD_LOD:
+			if (!this->ram.load(this->regB, this->regA)) {
+				code = TrapCode::BadAddress;
+				goto fault;
+			}
+			break;
+		case CMD_SAV:
+			if (!this->ram.store(this->regB, this->regA)) {
+				code = TrapCode::BadAddress;
+				goto fault;
+			}
+			break;
+		case CMD_CAS: {
+			uint64_t *p = this->ram.pointer(this->regB, true);
+			if (!p) {
+				code = TrapCode::BadAddress;
+				goto fault;
+			}
+			uint64_t expected = this->regC;
+			std::atomic_ref<uint64_t>(*p).compare_exchange_strong(expected, this->regA);
+			this->regC = expected;
+		} break;
+		case CMD_FADD: {
+			uint64_t *p = this->ram.pointer(this->regB, true);
+			if (!p) {
+				code = TrapCode::BadAddress;
+				goto fault;
+			}
+			this->regC = std::atomic_ref<uint64_t>(*p).fetch_add(this->regA);
+		} break;
+		case CMD_FENCE:
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			break;
+		case CMD_LDI: {
+			uint64_t *reg = this->locateRegister(flag & 0xffff, larg);
+			if (!reg) {
+				code = TrapCode::BadRegister;
+				goto fault;
+			}
+			*reg = val;
+			if (this->stopAfterWrite(reg)) {
+				reason = StopReason::Halted;
+				goto stop;
+			}
+			if (reg == &this->regIp || reg == &this->regFlag) {
+				goto endBlock;
+			}
+		} break;
+		case CMD_LEA: {
+			uint64_t *reg = this->locateRegister(flag & 0xffff, larg);
+			if (!reg) {
+				code = TrapCode::BadRegister;
+				goto fault;
+			}
+			*reg = this->regIp + val;
+			if (this->stopAfterWrite(reg)) {
+				reason = StopReason::Halted;
+				goto stop;
+			}
+			if (reg == &this->regIp || reg == &this->regFlag) {
+				goto endBlock;
+			}
+		} break;
+		case CMD_ADD:
+			this->regC = this->regA + this->regB;
+			break;
+		case CMD_MIN:
+			this->regC = this->regA - this->regB;
+			break;
+		case CMD_MUL:
+			this->regC = this->regA * this->regB;
+			break;
+		case CMD_DIV:
+			if (this->regB == 0) {
+				code = TrapCode::DivideByZero;
+				goto fault;
+			}
+			this->regC = this->regA / this->regB;
+			break;
+		case CMD_MOD:
+			if (this->regB == 0) {
+				code = TrapCode::DivideByZero;
+				goto fault;
+			}
+			this->regC = this->regA % this->regB;
+			break;
+		case CMD_GTH:
+			this->regC = this->regA > this->regB;
+			break;
+		case CMD_LTH:
+			this->regC = this->regA < this->regB;
+			break;
+		case CMD_GEQ:
+			this->regC = this->regA >= this->regB;
+			break;
+		case CMD_LEQ:
+			this->regC = this->regA <= this->regB;
+			break;
+		case CMD_EQU:
+			this->regC = this->regA == this->regB;
+			break;
+		case CMD_NEQ:
+			this->regC = this->regA != this->regB;
+			break;
+		case CMD_LAND:
+			this->regC = this->regA && this->regB;
+			break;
+		case CMD_LOR:
+			this->regC = this->regA || this->regB;
+			break;
+		case CMD_NOT:
+			this->regC = !this->regA;
+			break;
+		case CMD_BAND:
+			this->regC = this->regA & this->regB;
+			break;
+		case CMD_BOR:
+			this->regC = this->regA | this->regB;
+			break;
+		case CMD_BNOT:
+			this->regC = ~this->regA;
+			break;
+		case CMD_XOR:
+			this->regC = this->regA ^ this->regB;
+			break;
+		case CMD_JMP:
+			this->regIp = this->regA;
+			goto endBlock;
+		case CMD_JIZ:
+			if (this->regB == 0) {
+				this->regIp = this->regA;
+			}
+			goto endBlock;
+		case CMD_JNZ:
+			if (this->regB != 0) {
+				this->regIp = this->regA;
+			}
+			goto endBlock;
+		case CMD_SYS:
+			// unbound calls go back to the host, which may serve them and resume
+			if (!this->callBios()) {
+				reason = StopReason::Trap;
+				goto stop;
+			}
+			if (this->blocked) {
+				this->blocked = false;
+				this->regIp = ip;
+				reason = StopReason::Blocked;
+				goto stop;
+			}
+			if (this->watchStop) {
+				this->watchStop = false;
+				reason = StopReason::Watchpoint;
+				goto stop;
+			}
+			if (this->regFlag == 0x00) {
+				reason = StopReason::Halted;
+				goto stop;
+			}
+			goto endBlock;
+		case CMD_BRA:
+			this->regIp += val;
+			goto endBlock;
+		case CMD_BIZ:
+			if (this->regB == 0) {
+				this->regIp += val;
+			}
+			goto endBlock;
+		case CMD_BNZ:
+			if (this->regB != 0) {
+				this->regIp += val;
+			}
+			goto endBlock;
+		default:
+			code = TrapCode::IllegalOpcode;
+			goto fault;
+		}
+		if constexpr (!Policy::step) {
+			continue;
+		}
+
+	endBlock:
+		if constexpr (Policy::metered) {
+			budget -= (ip - blockStart) / 2 + 1;
+			blockStart = this->regIp;
+			if constexpr (Policy::watched) {
+				this->budgetLeft = budget;
+				this->lastBlock = blockStart;
+			}
+			if (budget <= 0) {
+				this->budgetLeft = budget;
+				return StopReason::Budget;
+			}
+		}
+		continue;
+
+	fault:
+		if (!this->enterTrap(code, ip)) {
+			reason = StopReason::Fault;
+			goto stop;
+		}
+		goto endBlock;
+
+	stop:
+		if constexpr (Policy::metered) {
+			// a blocked SYS is charged once, when its retry goes through
+			this->budgetLeft = budget - (ip - blockStart) / 2 - (reason != StopReason::Blocked);
+		}
+		return reason;
+	}
+}
+
+// decodes the straight line code at ip into a block, nullptr when ip is
+// outside of guest memory, which is left to the interpreter
+Block *VirtualMachine::decodeBlock(uint64_t ip) {
+	uint64_t size = this->ram.getSize();
+	if (ip >= size || size - ip < 2) {
+		return nullptr;
+	}
+	auto block = std::make_unique<Block>();
+	block->start = ip;
+	bool ends = false;
+	while (!ends && block->ops.size() < BLOCK_MAX_OPS && size - ip >= 2) {
+		uint64_t info = 0, val = 0;
+		this->ram.load(ip, info);
+		this->ram.load(ip + 1, val);
+		ip += 2;
+		uint16_t op = (info >> 0) & 0xFFFF;
+		uint16_t flag = (info >> 16) & 0xFFFF;
+		uint16_t larg = (info >> 32) & 0xFFFF;
+		uint16_t rarg = (info >> 48) & 0xFFFF;
+		DecodedOp d{op, nullptr, nullptr, val};
+		TrapCode code = TrapCode::None;
+		switch (op) {
+		case CMD_MOV:
+			d.left = this->locateRegister(flag & 0xffff, larg);
+			d.right = this->locateRegister(flag >> 8, rarg);
+			if (!d.left || !d.right) {
+				code = TrapCode::BadRegister;
+			} else if (d.right == &this->regIp) {
+				d = {CMD_LDI, d.left, nullptr, ip};
+			}
+			break;
+		case CMD_LDI:
+		case CMD_LEA:
+			d = {CMD_LDI, this->locateRegister(flag & 0xffff, larg), nullptr, op == CMD_LEA ? ip + val : val};
+			if (!d.left) {
+				code = TrapCode::BadRegister;
+			}
+			break;
+		case CMD_LOD:
+		case CMD_SAV:
+		case CMD_CAS:
+		case CMD_FADD:
+		case CMD_FENCE:
+		case CMD_ADD:
+		case CMD_MIN:
+		case CMD_MUL:
+		case CMD_DIV:
+		case CMD_MOD:
+		case CMD_GTH:
+		case CMD_LTH:
+		case CMD_GEQ:
+		case CMD_LEQ:
+		case CMD_EQU:
+		case CMD_NEQ:
+		case CMD_LAND:
+		case CMD_LOR:
+		case CMD_NOT:
+		case CMD_BAND:
+		case CMD_BOR:
+		case CMD_BNOT:
+		case CMD_XOR:
+			break;
+		case CMD_JMP:
+		case CMD_JIZ:
+		case CMD_JNZ:
+		case CMD_SYS:
+			ends = true;
+			break;
+		case CMD_BRA:
+		case CMD_BIZ:
+		case CMD_BNZ:
+			d.val = ip + val;
+			ends = true;
+			break;
+		default:
+			code = TrapCode::IllegalOpcode;
+			break;
+		}
+		if (code != TrapCode::None) {
+			d = {DECODED_FAULT, nullptr, nullptr, (uint64_t)code};
+			ends = true;
+		} else if (d.left == &this->regIp || d.left == &this->regFlag) {
+			d.op = DECODED_WRITE;
+			ends = true;
+		}
+		block->ops.push_back(d);
+	}
+	block->end = ip;
+	this->ram.markCode(block->start, block->end - block->start);
+	return this->blocks->add(std::move(block));
+}
+
+// nullptr for code that is not decoded while the cache is full, which
+// makes executeBlocks() drop the cache and go on from the current IP
+Block *VirtualMachine::findBlock(uint64_t ip) {
+	this->blocks->stats.lookups++;
+	Block *block = this->blocks->find(ip);
+	if (block || this->blocks->full()) {
+		return block;
+	}
+	return this->decodeBlock(ip);
+}
+
+// runs decoded blocks with the same results and budget accounting as
+// execute(); a block that ends goes straight on to the block it linked
+// to the last time, so only new exits and changed jump targets go
+// through the cache lookup. IP is only kept up to date at block exits,
+// SYS and faults. A write to decoded code ends the block after it and
+// drops the cache; like a block cut at BLOCK_MAX_OPS it is not charged
+// on its own, the ops it ran are carried into the next block, since
+// execute() only charges where control flow can change
+template <bool Metered>
+StopReason VirtualMachine::executeBlocks(int64_t budget) {
+	StopReason reason;
+	TrapCode code;
+	const DecodedOp *op, *end;
+	uint64_t ip, version = this->ram.getCodeVersion();
+	int64_t carried = 0; // ops run since the last charge
+	this->blocks->sync(version);
+	Block *block = this->findBlock(this->regIp);
+	while (true) {
+		if (!block && this->blocks->full()) {
+			// the cache is full, drop it and go on from the current IP, the
+			// exit of the block that just ran was left unlinked
+			this->blocks->sync(version);
+			block = this->findBlock(this->regIp);
+			continue;
+		}
+		if (!block) {
+			// outside of guest memory, one instruction at a time
+			reason = this->execute<ExecPolicy<true, true, false, false>>(1);
+			budget -= carried + 1;
+			carried = 0;
+			if (reason != StopReason::Budget) {
+				this->budgetLeft = budget;
+				return reason;
+			}
+			if (Metered && budget <= 0) {
+				this->budgetLeft = budget;
+				return StopReason::Budget;
+			}
+			version = this->ram.getCodeVersion();
+			this->blocks->sync(version);
+			block = this->findBlock(this->regIp);
+			continue;
+		}
+
+		end = block->ops.data() + block->ops.size();
+		for (op = block->ops.data(); op != end; op++) {
+			switch (op->op) {
+			case CMD_MOV:
+				*op->left = *op->right;
+				break;
+			case CMD_LDI:
+				*op->left = op->val;
+				break;
+			case CMD_LOD:
+				if (!this->ram.load(this->regB, this->regA)) {
+					code = TrapCode::BadAddress;
+					goto fault;
+				}
+				break;
+			case CMD_SAV:
+				if (!this->ram.store(this->regB, this->regA)) {
+					code = TrapCode::BadAddress;
+					goto fault;
+				}
+				if (this->ram.getCodeVersion() != version) {
+					goto codeWritten;
+				}
+				break;
+			case CMD_CAS: {
+				uint64_t *p = this->ram.pointer(this->regB, true);
+				if (!p) {
+					code = TrapCode::BadAddress;
+					goto fault;
+				}
+				uint64_t expected = this->regC;
+				std::atomic_ref<uint64_t>(*p).compare_exchange_strong(expected, this->regA);
+				this->regC = expected;
+				if (this->ram.getCodeVersion() != version) {
+					goto codeWritten;
+				}
+			} break;
+			case CMD_FADD: {
+				uint64_t *p = this->ram.pointer(this->regB, true);
+				if (!p) {
+					code = TrapCode::BadAddress;
+					goto fault;
+				}
+				this->regC = std::atomic_ref<uint64_t>(*p).fetch_add(this->regA);
+				if (this->ram.getCodeVersion() != version) {
+					goto codeWritten;
+				}
+			} break;
+			case CMD_FENCE:
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				break;
+			case CMD_ADD:
+				this->regC = this->regA + this->regB;
+				break;
+			case CMD_MIN:
+				this->regC = this->regA - this->regB;
+				break;
+			case CMD_MUL:
+				this->regC = this->regA * this->regB;
+				break;
+			case CMD_DIV:
+				if (this->regB == 0) {
+					code = TrapCode::DivideByZero;
+					goto fault;
+				}
+				this->regC = this->regA / this->regB;
+				break;
+			case CMD_MOD:
+				if (this->regB == 0) {
+					code = TrapCode::DivideByZero;
+					goto fault;
+				}
+				this->regC = this->regA % this->regB;
+				break;
+			case CMD_GTH:
+				this->regC = this->regA > this->regB;
+				break;
+			case CMD_LTH:
+				this->regC = this->regA < this->regB;
+				break;
+			case CMD_GEQ:
+				this->regC = this->regA >= this->regB;
+				break;
+			case CMD_LEQ:
+				this->regC = this->regA <= this->regB;
+				break;
+			case CMD_EQU:
+				this->regC = this->regA == this->regB;
+				break;
+			case CMD_NEQ:
+				this->regC = this->regA != this->regB;
+				break;
+			case CMD_LAND:
+				this->regC = this->regA && this->regB;
+				break;
+			case CMD_LOR:
+				this->regC = this->regA || this->regB;
+				break;
+			case CMD_NOT:
+				this->regC = !this->regA;
+				break;
+			case CMD_BAND:
+				this->regC = this->regA & this->regB;
+				break;
+			case CMD_BOR:
+				this->regC = this->regA | this->regB;
+				break;
+			case CMD_BNOT:
+				this->regC = ~this->regA;
+				break;
+			case CMD_XOR:
+				this->regC = this->regA ^ this->regB;
+				break;
+			case CMD_JMP:
+				this->regIp = this->regA;
+				goto exit;
+			case CMD_JIZ:
+				this->regIp = this->regB == 0 ? this->regA : block->end;
+				goto exit;
+			case CMD_JNZ:
+				this->regIp = this->regB != 0 ? this->regA : block->end;
+				goto exit;
+			case CMD_BRA:
+				this->regIp = op->val;
+				goto exit;
+			case CMD_BIZ:
+				this->regIp = this->regB == 0 ? op->val : block->end;
+				goto exit;
+			case CMD_BNZ:
+				this->regIp = this->regB != 0 ? op->val : block->end;
+				goto exit;
+			case CMD_SYS:
+				this->regIp = block->end;
+				if (!this->callBios()) {
+					reason = StopReason::Trap;
+					goto stop;
+				}
+				if (this->blocked) {
+					this->blocked = false;
+					this->regIp = block->end - 2;
+					reason = StopReason::Blocked;
+					goto stop;
+				}
+				if (this->watchStop) {
+					this->watchStop = false;
+					reason = StopReason::Watchpoint;
+					goto stop;
+				}
+				if (this->regFlag == 0x00) {
+					reason = StopReason::Halted;
+					goto stop;
+				}
+				goto exit;
+			case DECODED_WRITE:
+				this->regIp = block->end;
+				*op->left = op->right ? *op->right : op->val;
+				if (this->stopAfterWrite(op->left)) {
+					reason = StopReason::Halted;
+					goto stop;
+				}
+				goto exit;
+			default:
+				code = (TrapCode)op->val;
+				goto fault;
+			}
+		}
+		// cut at BLOCK_MAX_OPS or at the end of memory, the last op ran
+		op--;
+		this->regIp = block->end;
+		goto carry;
+
+	codeWritten:
+		this->regIp = block->start + 2 * (op - block->ops.data()) + 2;
+
+	carry:
+		if constexpr (Metered) {
+			carried += op - block->ops.data() + 1;
+		}
+		goto link;
+
+	fault:
+		ip = block->start + 2 * (op - block->ops.data());
+		if (!this->enterTrap(code, ip)) {
+			reason = StopReason::Fault;
+			goto stop;
+		}
+
+	exit:
+		if constexpr (Metered) {
+			budget -= carried + (op - block->ops.data() + 1);
+			carried = 0;
+			if (budget <= 0) {
+				this->budgetLeft = budget;
+				return StopReason::Budget;
+			}
+		}
+
+	link:
+		if (this->ram.getCodeVersion() != version) {
+			version = this->ram.getCodeVersion();
+			this->blocks->sync(version);
+			block = this->findBlock(this->regIp);
+			continue;
+		}
+		if (this->regIp == block->end) {
+			if (!block->next) {
+				block->next = this->findBlock(this->regIp);
+			}
+			block = block->next;
+		} else {
+			if (block->target != this->regIp || !block->taken) {
+				block->target = this->regIp;
+				block->taken = this->findBlock(this->regIp);
+			}
+			block = block->taken;
+		}
+		continue;
+
+	stop:
+		if constexpr (Metered) {
+			this->budgetLeft = budget - carried - (op - block->ops.data()) - (reason != StopReason::Blocked);
+		}
+		return reason;
+	}
+}
+
+// records the fault and hands it to the guest trap handler if one is armed
+bool VirtualMachine::enterTrap(TrapCode code, uint64_t ip) {
+	if (this->metrics) {
+		this->metrics->faults.fetch_add(1, std::memory_order_relaxed);
+	}
+	// a message left by an earlier host error must not describe this trap
+	this->faultMessage.clear();
+	this->trap = code;
+	this->faultIp = ip;
+	this->regIp = ip;
+	if (this->trapVector == 0) {
+		return false;
+	}
+	this->regA = (uint64_t)code;
+	this->regB = ip;
+	this->regIp = this->trapVector;
+	this->trapVector = 0;
+	return true;
+}
+
+StopReason VirtualMachine::tick() {
+	if (this->regFlag == 0x00) {
+		return StopReason::Halted;
+	}
+	if (this->fuel == 0) {
+		return StopReason::OutOfFuel;
+	}
+	StopReason reason = this->ram.watching() ? this->runWatched(&VirtualMachine::step, 1) : this->step(1);
+	if (this->fuel != UINT64_MAX && reason != StopReason::Blocked) {
+		this->fuel--;
+	}
+	return reason;
+}
+
+StopReason VirtualMachine::step(int64_t budget) {
+	switch (this->mode) {
+	case ExecMode::Trace:
+		return this->execute<ExecPolicy<true, true, true, false>>(budget);
+	case ExecMode::Profile:
+		return this->execute<ExecPolicy<true, true, false, true>>(budget);
+	default:
+		return this->execute<ExecPolicy<true, true, false, false>>(budget);
+	}
+}
+
+void VirtualMachine::setMode(ExecMode mode) {
+	this->mode = mode;
+	if (this->native) {
+		return;
+	}
+	switch (mode) {
+	case ExecMode::Trace:
+		this->runner = &VirtualMachine::execute<ExecPolicy<false, true, true, false>>;
+		this->freeRunner = &VirtualMachine::execute<ExecPolicy<false, false, true, false>>;
 		break;
-	case CMD_BNOT:
-		this->regC = ~this->regA;
+	case ExecMode::Profile:
+		this->opcodeCounts.resize(0x10000);
+		this->runner = &VirtualMachine::execute<ExecPolicy<false, true, false, true>>;
+		this->freeRunner = &VirtualMachine::execute<ExecPolicy<false, false, false, true>>;
 		break;
-	case CMD_XOR:
-		this->regC = this->regA ^ this->regB;
+	case ExecMode::Blocks:
+		if (!this->blocks) {
+			this->blocks = std::make_unique<BlockCache>();
+		}
+		this->runner = &VirtualMachine::executeBlocks<true>;
+		this->freeRunner = &VirtualMachine::executeBlocks<false>;
 		break;
-	case CMD_JMP:
-		this->regIp = this->regA;
+	default:
+		this->runner = &VirtualMachine::execute<ExecPolicy<false, true, false, false>>;
+		this->freeRunner = &VirtualMachine::execute<ExecPolicy<false, false, false, false>>;
 		break;
-	case CMD_JIZ:
-		if (this->regB == 0) {
-			this->regIp = this->regA;
+	}
+}
+
+void VirtualMachine::enableMetrics(std::string name) {
+	this->metrics = Metrics::process().add(name, this->cpuId);
+}
+
+std::shared_ptr<VmMetrics> VirtualMachine::getMetrics() {
+	return this->metrics;
+}
+
+BlockStats VirtualMachine::getBlockStats() {
+	return this->blocks ? this->blocks->stats : BlockStats{};
+}
+
+void VirtualMachine::setNative(std::shared_ptr<NativeProgram> program) {
+	if (program && this->ram.watching()) {
+		throw std::runtime_error("native programs do not support watchpoints");
+	}
+	this->native = program;
+	if (program) {
+		this->runner = &VirtualMachine::executeNative;
+		this->freeRunner = &VirtualMachine::executeNative;
+	} else {
+		this->setMode(this->mode);
+	}
+}
+
+void VirtualMachine::saveRegisters(uint64_t *regs) {
+	uint64_t base[] = {this->regA, this->regB, this->regC, this->regIp, this->regSp, this->regSbp, this->regFlag};
+	std::copy(std::begin(base), std::end(base), regs);
+	std::copy(this->addRegs.begin(), this->addRegs.end(), regs + 7);
+}
+
+void VirtualMachine::restoreRegisters(const uint64_t *regs) {
+	this->regA = regs[REG_A];
+	this->regB = regs[REG_B];
+	this->regC = regs[REG_C];
+	this->regIp = regs[REG_IP];
+	this->regSp = regs[REG_SP];
+	this->regSbp = regs[REG_SBP];
+	this->regFlag = regs[REG_FLG];
+	std::copy(regs + 7, regs + NATIVE_REGS, this->addRegs.begin());
+}
+
+static_assert(NATIVE_REGS == 7 + ADD_REGS_COUNT);
+
+int VirtualMachine::nativeSys(NativeFrame *frame) {
+	VirtualMachine &vm = *(VirtualMachine *)frame->vm;
+	vm.restoreRegisters(frame->regs);
+	bool bound = vm.callBios();
+	bool blocked = vm.blocked;
+	if (blocked) {
+		vm.blocked = false;
+		vm.regIp -= 2;
+	}
+	vm.saveRegisters(frame->regs);
+	if (!bound) {
+		return (int)StopReason::Trap;
+	}
+	if (blocked) {
+		return (int)StopReason::Blocked;
+	}
+	if (vm.regFlag == 0x00) {
+		return (int)StopReason::Halted;
+	}
+	return NATIVE_CONTINUE;
+}
+
+int VirtualMachine::nativeFlag(NativeFrame *frame) {
+	VirtualMachine &vm = *(VirtualMachine *)frame->vm;
+	vm.restoreRegisters(frame->regs);
+	vm.flagWritten();
+	vm.saveRegisters(frame->regs);
+	return vm.regFlag == 0x00 ? (int)StopReason::Halted : NATIVE_CONTINUE;
+}
+
+// runs the translated program, and the interpreter for single instructions
+// whenever IP is outside of the translated code
+StopReason VirtualMachine::executeNative(int64_t budget) {
+	NativeFrame frame{};
+	frame.vm = this;
+	frame.memoryWords = this->ram.getSize();
+	frame.memory = frame.memoryWords ? this->ram.pointer(0, true) : nullptr;
+	frame.budget = budget;
+	frame.load = [](void *vm, uint64_t addr, uint64_t *value) {
+		return ((VirtualMachine *)vm)->ram.load(addr, *value);
+	};
+	frame.store = [](void *vm, uint64_t addr, uint64_t value) {
+		return ((VirtualMachine *)vm)->ram.store(addr, value);
+	};
+	frame.pointer = [](void *vm, uint64_t addr) {
+		return ((VirtualMachine *)vm)->ram.pointer(addr, true);
+	};
+	frame.sys = &VirtualMachine::nativeSys;
+	frame.flag = &VirtualMachine::nativeFlag;
+
+	StopReason reason;
+	while (true) {
+		this->saveRegisters(frame.regs);
+		int result = this->native->entry(&frame);
+		this->restoreRegisters(frame.regs);
+		if (result == NATIVE_FAULT) {
+			if (!this->enterTrap((TrapCode)frame.trap, this->regIp)) {
+				reason = StopReason::Fault;
+				break;
+			}
+		} else if (result == NATIVE_FALLBACK) {
+			reason = this->step(1);
+			frame.budget--;
+			if (reason != StopReason::Budget) {
+				break;
+			}
+		} else {
+			reason = (StopReason)result;
+			break;
 		}
-		break;
-	case CMD_JNZ:
-		if (this->regB != 0) {
-			this->regIp = this->regA;
+		if (frame.budget <= 0) {
+			reason = StopReason::Budget;
+			break;
 		}
-		break;
 	}
+	// translated code charges the whole block, a blocked SYS is charged
+	// when its retry goes through
+	this->budgetLeft = frame.budget + (reason == StopReason::Blocked);
+	return reason;
+}
+
+ExecMode VirtualMachine::getMode() {
+	return this->mode;
+}
+
+void VirtualMachine::traceInstruction(uint64_t ip, uint64_t info, uint64_t val) {
+	std::ios_base::fmtflags f(this->traceOut->flags());
+	*this->traceOut << std::hex << std::setfill('0')
+	                << std::setw(16) << ip << ": "
+	                << std::setw(16) << info << " " << std::setw(16) << val
+	                << " A=" << this->regA << " B=" << this->regB << " C=" << this->regC
+	                << " SP=" << this->regSp << " FLG=" << this->regFlag << "\n";
+	this->traceOut->flags(f);
 }
 
 void VirtualMachine::launch() {
 	this->regFlag = 1;
-	while (this->regFlag != 0x00) {
-#ifdef DEBUG_VM
-		this->dumpVm();
-		std::this_thread::sleep_for(std::chrono::seconds(1));
-#endif // DEBUG_VM
-		this->tick();
-	}
-}
-
-#ifdef DEBUG_VM
-void VirtualMachine::dumpVm() {
-	std::ios_base::fmtflags f(std::cout.flags()); // сохранить текущие флаги форматирования
-
-	std::cout << "=== VM Register Dump ===\n";
-	std::cout << "regA   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regA << "\n";
-	std::cout << "regB   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regB << "\n";
-	std::cout << "regC   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regC << "\n";
-	std::cout << "regIP  = 0x" << std::hex << std::setw(16) << std::setfill('0') << regIp << "\n";
-	std::cout << "regSP  = 0x" << std::hex << std::setw(16) << std::setfill('0') << regSp << "\n";
-	std::cout << "regSBP = 0x" << std::hex << std::setw(16) << std::setfill('0') << regSbp << "\n";
-	std::cout << "regF   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regFlag << "\n";
-#ifdef LOG_ADD_REGS
-	std::cout << "--- Additional Registers ---\n";
+	StopReason reason;
+	do {
+		reason = this->run(UINT64_MAX);
+		if (reason == StopReason::Blocked) {
+			this->waitBlocked();
+		}
+	} while (reason == StopReason::Budget || reason == StopReason::Trap || reason == StopReason::Blocked);
+	this->joinCpus();
+	if (reason == StopReason::Fault) {
+		throw std::runtime_error(std::format("guest fault at {:#x}: {}", this->faultIp, toString(this->trap)));
+	}
+}
+
+uint64_t VirtualMachine::loadImage(Image &image, uint64_t base) {
+	this->regIp = image.place(this->ram, base);
+	this->regFlag = 1;
+	return this->regIp;
+}
+
+uint64_t VirtualMachine::loadImage(std::string path, uint64_t base) {
+	this->regIp = Image::load(path, this->ram, base);
+	this->regFlag = 1;
+	return this->regIp;
+}
+
+uint64_t VirtualMachine::loadImage(SharedImage &image) {
+	this->regIp = image.map(this->ram);
+	this->regFlag = 1;
+	return this->regIp;
+}
+
+void VirtualMachine::checkpoint(std::string path) {
+	CheckpointHeader header{};
+	this->saveRegisters(header.regs);
+	header.trapVector = this->trapVector;
+	Checkpoint::write(path, header, this->ram, this->heap ? this->heap->save() : std::vector<uint64_t>{});
+}
+
+void VirtualMachine::restore(std::string path) {
+	std::vector<uint64_t> heap;
+	CheckpointHeader header = Checkpoint::load(path, this->ram, heap);
+	this->restoreRegisters(header.regs);
+	this->trapVector = header.trapVector;
+	this->heap = heap.empty() ? nullptr : GuestHeap::load(heap);
+}
+
+StopReason VirtualMachine::run(uint64_t maxInstructions) {
+	this->finishHostCall();
+	if (this->regFlag == 0x00) {
+		return StopReason::Halted;
+	}
+	// set again if the call blocks once more
+	this->waitingOn.channel = nullptr;
+	uint64_t limit = std::min(maxInstructions, this->fuel);
+	if (limit == 0) {
+		return this->fuel == 0 ? StopReason::OutOfFuel : StopReason::Budget;
+	}
+	if (this->metrics) {
+		return this->countedRun(limit);
+	}
+	// without a budget or fuel limit the loop does not have to count at all
+	if (limit == UINT64_MAX) {
+		return this->guard(this->freeRunner, INT64_MAX);
+	}
+	return this->metered(this->runner, limit);
+}
+
+// run() with metrics: a run without a limit goes on in slices, the
+// counters are updated after each
+StopReason VirtualMachine::countedRun(uint64_t limit) {
+	VmMetrics &m = *this->metrics;
+	m.running.store(true, std::memory_order_relaxed);
+	StopReason reason;
+	uint64_t total = 0;
+	do {
+		reason = this->metered(this->runner, std::min<uint64_t>(limit, METRICS_SLICE));
+		total += this->executed;
+	} while (limit == UINT64_MAX && reason == StopReason::Budget);
+	this->executed = total;
+	if (reason == StopReason::Blocked) {
+		m.blocked.fetch_add(1, std::memory_order_relaxed);
+	} else if (reason == StopReason::OutOfMemory || (reason == StopReason::Fault && (this->trap == TrapCode::HostError || this->trap == TrapCode::QuotaExceeded))) {
+		// errors of BIOS handlers, the interpreter counts the others
+		m.faults.fetch_add(1, std::memory_order_relaxed);
+	}
+	m.running.store(false, std::memory_order_relaxed);
+	return reason;
+}
+
+StopReason VirtualMachine::runExact(uint64_t n) {
+	this->finishHostCall();
+	if (this->regFlag == 0x00) {
+		return StopReason::Halted;
+	}
+	uint64_t limit = std::min(n, this->fuel);
+	if (limit == 0) {
+		return this->fuel == 0 ? StopReason::OutOfFuel : StopReason::Budget;
+	}
+	return this->metered(&VirtualMachine::step, limit);
+}
+
+// runs a counting loop and charges what it used to the fuel
+StopReason VirtualMachine::metered(StopReason (VirtualMachine::*loop)(int64_t), uint64_t limit) {
+	int64_t budget = limit > INT64_MAX ? INT64_MAX : limit;
+	this->budgetLeft = budget;
+	StopReason reason = this->guard(loop, budget);
+	uint64_t used = budget - this->budgetLeft;
+	this->executed = used;
+	if (this->metrics) {
+		this->metrics->instructions.fetch_add(used, std::memory_order_relaxed);
+		this->metrics->memoryWords.store(this->ram.used(), std::memory_order_relaxed);
+	}
+	if (this->fuel != UINT64_MAX) {
+		this->fuel = used < this->fuel ? this->fuel - used : 0;
+		if (reason == StopReason::Budget && this->fuel == 0) {
+			reason = StopReason::OutOfFuel;
+		}
+	}
+	return reason;
+}
+
+StopReason VirtualMachine::guard(StopReason (VirtualMachine::*loop)(int64_t), int64_t budget) {
+	StopReason reason;
+	try {
+		reason = this->ram.watching() ? this->runWatched(loop, budget) : (this->*loop)(budget);
+	} catch (const QuotaExceeded &e) {
+		this->faultMessage = e.what();
+		this->trap = TrapCode::QuotaExceeded;
+		this->faultIp = this->regIp - 2;
+		reason = StopReason::OutOfMemory;
+	} catch (const std::exception &e) {
+		// only BIOS handlers can throw, the interpreter itself reports traps
+		this->faultMessage = e.what();
+		this->trap = TrapCode::HostError;
+		this->faultIp = this->regIp - 2;
+		reason = StopReason::Fault;
+	}
+	// the log has to be complete when the host looks into a failure
+	if (this->recording && reason != StopReason::Budget && reason != StopReason::Blocked) {
+		this->recording->flush();
+	}
+	return reason;
+}
+
+void VirtualMachine::setFuel(uint64_t fuel) {
+	this->fuel = fuel;
+}
+
+uint64_t VirtualMachine::getFuel() {
+	return this->fuel;
+}
+
+bool VirtualMachine::halted() {
+	return this->regFlag == 0x00;
+}
+
+uint64_t VirtualMachine::getRegister(Reg r) {
+	uint64_t *reg = this->locateRegister(0, r);
+	if (!reg) {
+		throw std::runtime_error("unknown register");
+	}
+	return *reg;
+}
+
+void VirtualMachine::setRegister(Reg r, uint64_t v) {
+	uint64_t *reg = this->locateRegister(0, r);
+	if (!reg) {
+		throw std::runtime_error("unknown register");
+	}
+	*reg = v;
+}
+
+void VirtualMachine::dumpVm(std::ostream &out) {
+	std::ios_base::fmtflags f(out.flags()); // сохранить текущие флаги форматирования
+
+	out << "=== VM Register Dump ===\n";
+	out << "regA   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regA << "\n";
+	out << "regB   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regB << "\n";
+	out << "regC   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regC << "\n";
+	out << "regIP  = 0x" << std::hex << std::setw(16) << std::setfill('0') << regIp << "\n";
+	out << "regSP  = 0x" << std::hex << std::setw(16) << std::setfill('0') << regSp << "\n";
+	out << "regSBP = 0x" << std::hex << std::setw(16) << std::setfill('0') << regSbp << "\n";
+	out << "regF   = 0x" << std::hex << std::setw(16) << std::setfill('0') << regFlag << "\n";
+	out << "--- Additional Registers ---\n";
 	for (size_t i = 0; i < addRegs.size(); ++i) {
-		std::cout << "addReg[" << i << "] = 0x"
-		          << std::hex << std::setw(16) << std::setfill('0') << addRegs[i] << "\n";
+		out << "addReg[" << i << "] = 0x"
+		    << std::hex << std::setw(16) << std::setfill('0') << addRegs[i] << "\n";
 	}
-#endif // LOG_ADD_REGS
 
-	std::cout.flags(f); // восстановить флаги форматирования
+	out.flags(f); // восстановить флаги форматирования
 }
-#endif // DEBUG_VM
 
 VirtualMachine::VirtualMachine()
-    : ram(0) {
+    : VirtualMachine(uint64_t(0)) {
+}
+
+uint64_t VirtualMachine::startCpu(uint64_t ip, uint64_t arg) {
+	// the log only holds BIOS calls, not how vCPUs interleave on shared memory
+	if (this->recording) {
+		throw std::runtime_error("vCPUs cannot be started while recording or replaying");
+	}
+	// a watched write opens its page for every thread
+	if (this->ram.watching()) {
+		throw std::runtime_error("vCPUs cannot be started on memory with watchpoints");
+	}
+	if (!this->cpus) {
+		this->ownCpus = std::make_unique<CpuSet>();
+		this->cpus = this->ownCpus.get();
+	}
+	std::lock_guard<std::mutex> lock(this->cpus->lock);
+	if (this->cpus->cpus.size() >= CPU_MAX) {
+		throw std::runtime_error(std::format("a guest can start at most {} vCPUs", CPU_MAX));
+	}
+	auto cpu = std::make_unique<VirtualMachine>(this->memory);
+	cpu->cpus = this->cpus;
+	cpu->channels = std::move(this->passing);
+	this->passing.clear();
+	cpu->heap = this->heap;
+	cpu->files = this->files;
+	cpu->io = this->io;
+	cpu->bios = this->bios;
+	cpu->traceOut = this->traceOut;
+	cpu->setMode(this->mode);
+	if (this->fuel != UINT64_MAX) {
+		cpu->fuel = this->fuel / 2;
+		this->fuel -= cpu->fuel;
+	}
+	cpu->regIp = ip;
+	cpu->regA = arg;
+	cpu->regFlag = 1;
+
+	VirtualMachine *p = cpu.get();
+	p->cpuId = this->cpus->cpus.size() + 1;
+	if (this->metrics) {
+		p->metrics = Metrics::process().add(this->metrics->name, p->cpuId);
+	}
+	this->cpus->cpus.push_back(std::move(cpu));
+	this->ram.addRunner();
+	this->cpus->threads.emplace_back([p] {
+		p->runCpu();
+	});
+	return p->cpuId;
+}
+
+uint64_t VirtualMachine::attachChannel(std::shared_ptr<Channel> channel, ChannelEnd end) {
+	channel->claim(end);
+	this->channels.push_back(Endpoint{channel, end});
+	return this->channels.size() - 1;
+}
+
+VirtualMachine::Endpoint &VirtualMachine::endpoint(uint64_t handle) {
+	if (handle >= this->channels.size() || !this->channels[handle].channel) {
+		throw std::runtime_error(std::format("channel handle {} is not attached", handle));
+	}
+	return this->channels[handle];
+}
+
+Channel &VirtualMachine::getChannel(uint64_t handle, ChannelEnd end) {
+	Endpoint &e = this->endpoint(handle);
+	if (e.end != end) {
+		throw std::runtime_error(std::format("channel handle {} is the {} end", handle, e.end == ChannelEnd::Send ? "sending" : "receiving"));
+	}
+	return *e.channel;
+}
+
+Channel &VirtualMachine::getChannel(uint64_t handle) {
+	return *this->endpoint(handle).channel;
+}
+
+void VirtualMachine::passChannel(uint64_t handle) {
+	Endpoint &e = this->endpoint(handle);
+	this->passing.push_back(e);
+	e.channel = nullptr;
+}
+
+void VirtualMachine::blockOnChannel(uint64_t handle) {
+	this->waitingOn = this->endpoint(handle);
+	this->block();
+}
+
+uint64_t VirtualMachine::offerFile(std::string path, bool writable) {
+	this->files.push_back(std::make_shared<HostFile>(path, writable));
+	return this->files.size() - 1;
+}
+
+std::shared_ptr<HostFile> VirtualMachine::getFile(uint64_t handle) {
+	if (handle >= this->files.size()) {
+		throw std::runtime_error(std::format("file handle {} is not offered", handle));
+	}
+	return this->files[handle];
+}
+
+uint64_t VirtualMachine::mapFile(uint64_t handle, uint64_t addr) {
+	if (this->recording) {
+		throw std::runtime_error("files cannot be mapped while recording or replaying");
+	}
+	std::shared_ptr<HostFile> file = this->getFile(handle);
+	uint64_t words = this->ram.mapHostFile(addr, file->path, file->writable);
+	this->fileMaps.push_back(addr);
+	return words;
+}
+
+void VirtualMachine::unmapFile(uint64_t addr) {
+	if (this->recording) {
+		throw std::runtime_error("files cannot be unmapped while recording or replaying");
+	}
+	auto it = std::find(this->fileMaps.begin(), this->fileMaps.end(), addr);
+	if (it == this->fileMaps.end()) {
+		throw std::runtime_error(std::format("no file is mapped at {} by this guest", addr));
+	}
+	this->ram.unmapBuffer(addr);
+	this->fileMaps.erase(it);
+}
+
+void VirtualMachine::setIoPool(std::shared_ptr<IoPool> pool) {
+	this->io = pool;
+}
+
+void VirtualMachine::startIo(std::shared_ptr<IoRequest> request) {
+	if (!this->io) {
+		this->io = IoPool::defaults();
+	}
+	this->pendingIo = request;
+	this->io->submit(request);
+	this->block();
+}
+
+bool VirtualMachine::ioPending() {
+	return this->pendingIo != nullptr;
+}
+
+std::shared_ptr<IoRequest> VirtualMachine::finishIo() {
+	if (!this->pendingIo->isDone()) {
+		this->block();
+		return nullptr;
+	}
+	return std::move(this->pendingIo);
+}
+
+bool VirtualMachine::parkIo(std::function<void()> wake) {
+	return this->pendingIo && this->pendingIo->park(wake);
+}
+
+void VirtualMachine::waitIo() {
+	if (this->pendingIo) {
+		this->pendingIo->wait();
+	}
+}
+
+bool VirtualMachine::parkBlocked(std::function<void()> wake) {
+	if (this->pendingIo) {
+		return this->pendingIo->park(wake);
+	}
+	return this->waitingOn.channel && this->waitingOn.channel->park(this->waitingOn.end, wake);
+}
+
+void VirtualMachine::unparkBlocked() {
+	if (this->waitingOn.channel) {
+		this->waitingOn.channel->unpark(this->waitingOn.end);
+	}
+}
+
+void VirtualMachine::waitBlocked() {
+	if (this->pendingIo) {
+		this->pendingIo->wait();
+	} else if (this->waitingOn.channel) {
+		this->waitingOn.channel->wait(this->waitingOn.end, std::chrono::milliseconds(BLOCKED_WAIT_MS));
+		this->waitingOn.channel = nullptr;
+	}
+}
+
+void VirtualMachine::setHeap(std::shared_ptr<GuestHeap> heap) {
+	this->heap = heap;
+}
+
+void VirtualMachine::initHeap(uint64_t base, uint64_t words) {
+	// vCPUs started so far share the heap, a second one would hand out
+	// the blocks of the first again
+	if (this->heap) {
+		throw std::runtime_error("the heap is already set up");
+	}
+	this->ram.span(base, words);
+	this->heap = std::make_shared<GuestHeap>(base, words);
+}
+
+GuestHeap &VirtualMachine::getHeap() {
+	if (!this->heap) {
+		throw std::runtime_error("no heap, set one up with BIOS_HEAP_INIT first");
+	}
+	return *this->heap;
+}
+
+void VirtualMachine::block() {
+	this->blocked = true;
+}
+
+void VirtualMachine::runCpu() {
+	StopReason reason;
+	do {
+		reason = this->run(CPU_SLICE);
+		if (reason == StopReason::Blocked) {
+			this->waitBlocked();
+		}
+	} while ((reason == StopReason::Budget || reason == StopReason::Blocked) && !this->cpus->stopping.load(std::memory_order_relaxed));
+	this->ram.removeRunner();
+}
+
+void VirtualMachine::stopCpus() {
+	if (this->cpus) {
+		this->cpus->stopping = true;
+	}
+}
+
+void VirtualMachine::joinCpus() {
+	if (!this->cpus) {
+		return;
+	}
+	for (size_t i = 0;; i++) {
+		std::thread *t;
+		{
+			std::lock_guard<std::mutex> lock(this->cpus->lock);
+			if (i >= this->cpus->threads.size()) {
+				return;
+			}
+			t = &this->cpus->threads[i];
+		}
+		if (t->joinable()) {
+			t->join();
+		}
+	}
+}
+
+VirtualMachine *VirtualMachine::getCpu(uint64_t id) {
+	if (id == this->cpuId) {
+		return this;
+	}
+	if (!this->cpus || id == 0) {
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> lock(this->cpus->lock);
+	if (id > this->cpus->cpus.size()) {
+		return nullptr;
+	}
+	return this->cpus->cpus[id - 1].get();
 }
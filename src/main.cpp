@@ -1,34 +1,263 @@
+#include <cstring>
 #include <exception>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <print>
-#include <sasm/CodeGenerator.hpp>
-#include <sasm/Lexer.hpp>
-#include <sasm/Parser.hpp>
+#include <sasm/Assembler.hpp>
+#include <sasm/ModuleLinker.hpp>
+#include <sasm/Translator.hpp>
+#include <sigma-vm/Image.hpp>
 #include <sigma-vm/VirtualMachine.hpp>
+#include <sstream>
+#include <tuple>
 
-int main() {
-	std::string input;
-	int c;
-	while ((c = fgetc(stdin)) != EOF) {
-		input += (char)c;
+static void usage() {
+	std::println(stderr, "usage: sigma-vm [-d] [-t|-P|-b] [-f fuel] [-w log|-R log] [-s steps] [-k checkpoint] [-W addr[:words]] [-m|-M addr:file] [-x metrics|-X socket] [-p] [-C cachedir] [-o image] [source|object...]");
+	std::println(stderr, "       sigma-vm [-C cachedir] -c -o object source");
+	std::println(stderr, "       sigma-vm [-C cachedir] -n translated.cpp [source|object...]");
+	std::println(stderr, "       sigma-vm [-d] [-t|-P|-b] [-f fuel] [-w log|-R log] [-s steps] [-k checkpoint] [-W addr[:words]] [-m|-M addr:file] [-x metrics|-X socket] [-N native.so] -r image");
+	std::println(stderr, "       sigma-vm [-t|-P|-b] [-f fuel] [-s steps] [-k checkpoint] -K checkpoint");
+}
+
+static std::string readSource(std::string path) {
+	if (path.empty()) {
+		std::string input;
+		int c;
+		while ((c = fgetc(stdin)) != EOF) {
+			input += (char)c;
+		}
+		return input;
 	}
-	Lexer lexer(input);
-	Parser parser(lexer);
-	Linker linker(parser);
-	CodeGenerator codeGen(linker);
+	std::ifstream in(path);
+	if (!in) {
+		throw std::runtime_error(std::format("unable to open {}", path));
+	}
+	std::stringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
 
-	auto code = codeGen.genAll();
+static bool isImage(const std::string &content) {
+	uint32_t magic = IMAGE_MAGIC;
+	return content.size() >= sizeof(magic) && !std::memcmp(content.data(), &magic, sizeof(magic));
+}
+
+// single sources are assembled straight into an image, several inputs are
+// assembled as modules in parallel and linked together with any objects
+static Image buildImage(std::vector<std::string> inputs, bool object, BuildCache *cache) {
+	if (inputs.empty()) {
+		inputs.push_back("");
+	}
+	std::vector<std::string> sources;
+	std::vector<Image> objects;
+	for (auto &path : inputs) {
+		std::string content = readSource(path);
+		if (isImage(content)) {
+			objects.push_back(Image::read(path));
+		} else {
+			sources.push_back(content);
+		}
+	}
+	if (object) {
+		if (sources.size() != 1 || !objects.empty()) {
+			throw std::runtime_error("-c takes exactly one source file");
+		}
+		return Assembler::assemble(sources[0], true, cache);
+	}
+	if (sources.size() == 1 && objects.empty()) {
+		return Assembler::assemble(sources[0], false, cache);
+	}
+	std::vector<Image> modules = Assembler::assembleModules(sources, cache);
+	modules.insert(modules.end(), objects.begin(), objects.end());
+	ModuleLinker linker(modules);
+	return linker.link();
+}
+
+int main(int argc, char **argv) {
+	std::vector<std::string> inputs;
+	std::string output, imagePath, cacheDir, translation, nativePath, recordPath, replayPath, savePath, restorePath, metricsPath;
+	bool dump = false, object = false, pic = false;
+	MetricsTarget metricsTarget = MetricsTarget::File;
+	std::vector<std::pair<uint64_t, uint64_t>> watches;
+	std::vector<std::tuple<uint64_t, std::string, bool>> files;
+	ExecMode mode = ExecMode::Fast;
+	uint64_t fuel = UINT64_MAX, steps = UINT64_MAX;
+	for (int i = 1; i < argc; i++) {
+		if (!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+			output = argv[++i];
+		} else if (!std::strcmp(argv[i], "-r") && i + 1 < argc) {
+			imagePath = argv[++i];
+		} else if (!std::strcmp(argv[i], "-d")) {
+			dump = true;
+		} else if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+			translation = argv[++i];
+		} else if (!std::strcmp(argv[i], "-N") && i + 1 < argc) {
+			nativePath = argv[++i];
+		} else if (!std::strcmp(argv[i], "-f") && i + 1 < argc) {
+			fuel = std::stoull(argv[++i]);
+		} else if (!std::strcmp(argv[i], "-w") && i + 1 < argc) {
+			recordPath = argv[++i];
+		} else if (!std::strcmp(argv[i], "-R") && i + 1 < argc) {
+			replayPath = argv[++i];
+		} else if (!std::strcmp(argv[i], "-s") && i + 1 < argc) {
+			steps = std::stoull(argv[++i]);
+		} else if (!std::strcmp(argv[i], "-k") && i + 1 < argc) {
+			savePath = argv[++i];
+		} else if (!std::strcmp(argv[i], "-K") && i + 1 < argc) {
+			restorePath = argv[++i];
+		} else if (!std::strcmp(argv[i], "-W") && i + 1 < argc) {
+			std::string arg = argv[++i];
+			size_t colon = arg.find(':');
+			watches.push_back({std::stoull(arg.substr(0, colon), nullptr, 0), colon == std::string::npos ? 1 : std::stoull(arg.substr(colon + 1), nullptr, 0)});
+		} else if ((!std::strcmp(argv[i], "-m") || !std::strcmp(argv[i], "-M")) && i + 1 < argc) {
+			bool writable = argv[i][1] == 'M';
+			std::string arg = argv[++i];
+			size_t colon = arg.find(':');
+			if (colon == std::string::npos) {
+				usage();
+				return 1;
+			}
+			files.push_back({std::stoull(arg.substr(0, colon), nullptr, 0), arg.substr(colon + 1), writable});
+		} else if ((!std::strcmp(argv[i], "-x") || !std::strcmp(argv[i], "-X")) && i + 1 < argc) {
+			metricsTarget = argv[i][1] == 'X' ? MetricsTarget::Socket : MetricsTarget::File;
+			metricsPath = argv[++i];
+		} else if (!std::strcmp(argv[i], "-t")) {
+			mode = ExecMode::Trace;
+		} else if (!std::strcmp(argv[i], "-P")) {
+			mode = ExecMode::Profile;
+		} else if (!std::strcmp(argv[i], "-b")) {
+			mode = ExecMode::Blocks;
+		} else if (!std::strcmp(argv[i], "-C") && i + 1 < argc) {
+			cacheDir = argv[++i];
+		} else if (!std::strcmp(argv[i], "-p")) {
+			pic = true;
+		} else if (!std::strcmp(argv[i], "-c")) {
+			object = true;
+		} else if (argv[i][0] != '-') {
+			inputs.push_back(argv[i]);
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (object && output.empty()) {
+		usage();
+		return 1;
+	}
 
 	VirtualMachine vm(4096);
+	vm.setMode(mode);
+	std::unique_ptr<MetricsExporter> exporter;
+	if (!metricsPath.empty()) {
+		vm.enableMetrics("sigma-vm");
+		exporter = std::make_unique<MetricsExporter>(Metrics::process(), metricsTarget, metricsPath);
+	}
+	vm.setFuel(fuel);
+	if (!nativePath.empty()) {
+		vm.setNative(std::make_shared<NativeProgram>(nativePath));
+	}
+	if (!savePath.empty()) {
+		auto bios = std::make_shared<Bios>();
+		bios->bind(BIOS_CHECKPOINT, [&savePath](VirtualMachine &vm) {
+			vm.regA = 1;
+			vm.checkpoint(savePath);
+			vm.regA = 0;
+		});
+		vm.setBios(bios);
+	}
+	uint64_t imageSize = 0;
 
-	for (size_t i = 0; i < code.size(); i++) {
-		vm.ram.setAt(i * 2, code[i][0]);
-		vm.ram.setAt(i * 2 + 1, code[i][1]);
+	if (!restorePath.empty()) {
+		vm.restore(restorePath);
+	} else if (imagePath.empty()) {
+		std::unique_ptr<BuildCache> cache;
+		if (!cacheDir.empty()) {
+			cache = std::make_unique<BuildCache>(cacheDir);
+		}
+		Image image = buildImage(inputs, object, cache.get());
+		if (pic && !object && !(image.flags & IMAGE_FLAG_PIC)) {
+			throw std::runtime_error("-p: image holds absolute addresses, use LEA and BRA/BIZ/BNZ instead of LDI with labels");
+		}
+		if (!output.empty()) {
+			image.write(output);
+			return 0;
+		}
+		if (!translation.empty()) {
+			std::ofstream out(translation);
+			out << Translator(image).translate();
+			if (!out) {
+				throw std::runtime_error(std::format("unable to write {}", translation));
+			}
+			return 0;
+		}
+		vm.loadImage(image);
+		imageSize = image.code.size();
+	} else {
+		vm.loadImage(imagePath);
+		if (dump) {
+			imageSize = Image::read(imagePath).code.size();
+		}
 	}
 
-	for (size_t i = 0; i < code.size() * 2; i++) {
-		std::cout << std::hex << std::setw(16) << std::setfill('0') << vm.ram.getAt(i) << "\n";
+	if (dump) {
+		for (size_t i = 0; i < imageSize; i++) {
+			std::cout << std::hex << std::setw(16) << std::setfill('0') << vm.ram.getAt(i) << "\n";
+		}
+		std::cout << std::dec;
+	}
+	for (auto &[addr, path, writable] : files) {
+		vm.ram.mapHostFile(addr, path, writable);
+	}
+	for (auto [addr, words] : watches) {
+		vm.watch(addr, words);
+	}
+	if (!recordPath.empty()) {
+		vm.setRecording(std::make_shared<Recording>(recordPath, RecordingMode::Record));
+	} else if (!replayPath.empty()) {
+		vm.setRecording(std::make_shared<Recording>(replayPath, RecordingMode::Replay));
+	}
+	StopReason reason;
+	if (steps != UINT64_MAX) {
+		// -s stops after exactly that many instructions and shows where
+		do {
+			reason = vm.runExact(steps);
+			steps -= vm.executed;
+		} while (steps && reason == StopReason::Trap);
+		if (reason == StopReason::Budget) {
+			if (!savePath.empty()) {
+				vm.checkpoint(savePath);
+			}
+			vm.dumpVm(std::cerr);
+			return 0;
+		}
+	} else {
+		do {
+			reason = vm.run(UINT64_MAX);
+			if (reason == StopReason::Blocked) {
+				vm.waitBlocked();
+			}
+		} while (reason == StopReason::Budget || reason == StopReason::Trap || reason == StopReason::Blocked);
+	}
+	vm.joinCpus();
+	std::cout.flush();
+	if (mode == ExecMode::Profile) {
+		for (size_t op = 0; op < vm.opcodeCounts.size(); op++) {
+			if (vm.opcodeCounts[op]) {
+				std::println(stderr, "{:#06x} {}", op, vm.opcodeCounts[op]);
+			}
+		}
+	}
+	for (auto &hit : vm.watchHits) {
+		std::println(stderr, "watch {:#x}: {:#x} -> {:#x} at {:#x}", hit.addr, hit.old, hit.value, hit.ip);
+	}
+	if (reason == StopReason::OutOfFuel) {
+		std::println(stderr, "out of fuel at {:#x}", vm.regIp);
+		return 3;
+	}
+	if (reason == StopReason::Fault) {
+		std::println(stderr, "guest fault at {:#x}: {}", vm.faultIp, vm.faultMessage.empty() ? toString(vm.trap) : vm.faultMessage);
+		return 2;
 	}
-	vm.launch();
 }
@@ -0,0 +1,45 @@
+#include <future>
+#include <sasm/Assembler.hpp>
+#include <sasm/CodeGenerator.hpp>
+#include <sasm/Lexer.hpp>
+#include <sasm/ModuleLinker.hpp>
+#include <sasm/Parser.hpp>
+
+Image Assembler::assemble(std::string source, bool object, BuildCache *cache) {
+	std::string key;
+	Image image;
+	if (cache) {
+		key = cache->key(source, object);
+		if (cache->lookup(key, image)) {
+			return image;
+		}
+	}
+	Lexer lexer(source);
+	Parser parser(lexer);
+	Linker linker(parser);
+	CodeGenerator codeGen(linker);
+	image = codeGen.genImage(object);
+	if (cache) {
+		cache->store(key, image);
+	}
+	return image;
+}
+
+std::vector<Image> Assembler::assembleModules(std::vector<std::string> sources, BuildCache *cache) {
+	std::vector<std::future<Image>> jobs;
+	for (auto &source : sources) {
+		jobs.push_back(std::async(std::launch::async, [&source, cache]() {
+			return Assembler::assemble(source, true, cache);
+		}));
+	}
+	std::vector<Image> modules;
+	for (auto &job : jobs) {
+		modules.push_back(job.get());
+	}
+	return modules;
+}
+
+Image Assembler::assembleAndLink(std::vector<std::string> sources, BuildCache *cache) {
+	ModuleLinker linker(Assembler::assembleModules(sources, cache));
+	return linker.link();
+}
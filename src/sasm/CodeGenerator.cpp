@@ -1,3 +1,5 @@
+#include <format>
+#include <map>
 #include <sasm/CodeGenerator.hpp>
 #include <sasm/Parser.hpp>
 #include <sigma-vm/VirtualMachine.hpp>
@@ -43,7 +45,10 @@ CodeGenerator::RegBin CodeGenerator::convReg(Register r) {
 }
 
 std::array<uint64_t, 2> CodeGenerator::genInstruction() {
-	Instruction instr = this->linker.next();
+	return this->encode(this->linker.next());
+}
+
+std::array<uint64_t, 2> CodeGenerator::encode(Instruction instr) {
 	uint16_t opCode, flag = 0, larg = 0, rarg = 0;
 	uint64_t arg = 0;
 	switch (instr.type) {
@@ -126,12 +131,43 @@ std::array<uint64_t, 2> CodeGenerator::genInstruction() {
 	case InstructionType::Jnz:
 		opCode = CMD_JNZ;
 		break;
+	case InstructionType::Lea: {
+		opCode = CMD_LEA;
+		RegBin dest = this->convReg(instr.left);
+		flag = dest.flag;
+		larg = dest.arg;
+		arg = instr.arg;
+	} break;
+	case InstructionType::Bra:
+		opCode = CMD_BRA;
+		arg = instr.arg;
+		break;
+	case InstructionType::Biz:
+		opCode = CMD_BIZ;
+		arg = instr.arg;
+		break;
+	case InstructionType::Bnz:
+		opCode = CMD_BNZ;
+		arg = instr.arg;
+		break;
+	case InstructionType::Sys:
+		opCode = CMD_SYS;
+		break;
 	case InstructionType::Lod:
 		opCode = CMD_LOD;
 		break;
 	case InstructionType::Sav:
 		opCode = CMD_SAV;
 		break;
+	case InstructionType::Cas:
+		opCode = CMD_CAS;
+		break;
+	case InstructionType::Fadd:
+		opCode = CMD_FADD;
+		break;
+	case InstructionType::Fence:
+		opCode = CMD_FENCE;
+		break;
 	default:
 		throw std::runtime_error("unknown instruction");
 	}
@@ -150,3 +186,51 @@ std::vector<std::array<uint64_t, 2>> CodeGenerator::genAll() {
 	}
 	return code;
 }
+
+// object modules keep references to imported symbols as symbol
+// relocations, executable images must not have any left
+Image CodeGenerator::genImage(bool object) {
+	Image image;
+	image.symbols = this->linker.symbols();
+	std::map<std::string, uint32_t> symbolIndex;
+	for (size_t i = 0; i < image.symbols.size(); i++) {
+		symbolIndex.insert({image.symbols[i].name, i});
+	}
+	while (!linker.atEof()) {
+		Instruction instr = this->linker.next();
+		if (instr.pcRelative) {
+			// ip-relative references only need fixing up when modules are linked
+			if (!instr.external.empty()) {
+				image.relocs.push_back(ImageRelocEntry{image.code.size() + 1, RELOC_PCREL_SYMBOL, symbolIndex.at(instr.external)});
+			} else if (object) {
+				image.relocs.push_back(ImageRelocEntry{image.code.size() + 1, RELOC_PCREL, 0});
+			}
+		} else if (instr.relocatable) {
+			image.relocs.push_back(ImageRelocEntry{image.code.size() + 1, RELOC_BASE, 0});
+		} else if (!instr.external.empty()) {
+			image.relocs.push_back(ImageRelocEntry{image.code.size() + 1, RELOC_SYMBOL, symbolIndex.at(instr.external)});
+		}
+		auto words = this->encode(instr);
+		image.code.push_back(words[0]);
+		image.code.push_back(words[1]);
+	}
+	image.dataAddr = this->linker.dataAddr();
+	image.data = this->linker.linkData(image.relocs, symbolIndex);
+	image.entry = this->linker.entry();
+	if (this->linker.hasEntry()) {
+		image.flags |= IMAGE_FLAG_ENTRY;
+	}
+	if (object) {
+		image.flags |= IMAGE_FLAG_OBJECT;
+		return image;
+	}
+	for (auto &r : image.relocs) {
+		if (r.type == RELOC_SYMBOL || r.type == RELOC_PCREL_SYMBOL) {
+			throw std::runtime_error(std::format("symbol {} is external, assemble the module separately and link it", image.symbols[r.symbol].name));
+		}
+	}
+	if (image.relocs.empty()) {
+		image.flags |= IMAGE_FLAG_PIC;
+	}
+	return image;
+}
@@ -0,0 +1,172 @@
+#include <format>
+#include <sasm/Expression.hpp>
+#include <stdexcept>
+
+std::string toString(Operator op) {
+	switch (op) {
+	case Operator::Add:
+		return "+";
+	case Operator::Sub:
+	case Operator::Neg:
+		return "-";
+	case Operator::Mul:
+		return "*";
+	case Operator::Div:
+		return "/";
+	case Operator::Mod:
+		return "%";
+	case Operator::Shl:
+		return "<<";
+	case Operator::Shr:
+		return ">>";
+	case Operator::Band:
+		return "&";
+	case Operator::Bor:
+		return "|";
+	case Operator::Xor:
+		return "^";
+	case Operator::Bnot:
+		return "~";
+	default:
+		return "?";
+	}
+}
+
+std::shared_ptr<Expression> Expression::makeNum(uint64_t v) {
+	auto e = std::make_shared<Expression>();
+	e->type = ExpressionType::Num;
+	e->numVal = v;
+	return e;
+}
+
+std::shared_ptr<Expression> Expression::makeSymbol(std::string name) {
+	auto e = std::make_shared<Expression>();
+	e->type = ExpressionType::Symbol;
+	e->symbol = name;
+	return e;
+}
+
+std::shared_ptr<Expression> Expression::makeUnary(Operator op, std::shared_ptr<Expression> operand) {
+	auto e = std::make_shared<Expression>();
+	e->type = ExpressionType::Unary;
+	e->op = op;
+	e->left = operand;
+	return e;
+}
+
+std::shared_ptr<Expression> Expression::makeBinary(Operator op, std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) {
+	auto e = std::make_shared<Expression>();
+	e->type = ExpressionType::Binary;
+	e->op = op;
+	e->left = l;
+	e->right = r;
+	return e;
+}
+
+bool Expression::isConstant() {
+	switch (this->type) {
+	case ExpressionType::Num:
+		return true;
+	case ExpressionType::Symbol:
+		return false;
+	case ExpressionType::Unary:
+		return this->left->isConstant();
+	case ExpressionType::Binary:
+		return this->left->isConstant() && this->right->isConstant();
+	}
+	return false;
+}
+
+ExprValue Expression::evaluate(const std::function<ExprValue(const std::string &)> &resolve) {
+	switch (this->type) {
+	case ExpressionType::Num:
+		return ExprValue{this->numVal, 0};
+	case ExpressionType::Symbol:
+		return resolve(this->symbol);
+	case ExpressionType::Unary: {
+		ExprValue v = this->left->evaluate(resolve);
+		if (!v.external.empty()) {
+			throw std::runtime_error(std::format("operator {} cannot be applied to external symbol {}", ::toString(this->op), v.external));
+		}
+		if (this->op == Operator::Neg) {
+			return ExprValue{-v.value, -v.base};
+		}
+		if (v.base != 0) {
+			throw std::runtime_error(std::format("operator ~ cannot be applied to address {}", this->left->toString()));
+		}
+		return ExprValue{~v.value, 0};
+	}
+	case ExpressionType::Binary:
+		break;
+	}
+	ExprValue l = this->left->evaluate(resolve);
+	ExprValue r = this->right->evaluate(resolve);
+	bool external = !l.external.empty() || !r.external.empty();
+	switch (this->op) {
+	case Operator::Add:
+		if (!l.external.empty() && !r.external.empty()) {
+			break;
+		}
+		return ExprValue{l.value + r.value, l.base + r.base, l.external + r.external};
+	case Operator::Sub:
+		if (!r.external.empty()) {
+			break;
+		}
+		return ExprValue{l.value - r.value, l.base - r.base, l.external};
+	case Operator::Mul:
+		if (external) {
+			break;
+		}
+		if (l.base != 0 && r.base != 0) {
+			break;
+		}
+		return ExprValue{l.value * r.value, l.base * (int64_t)r.value + r.base * (int64_t)l.value};
+	default:
+		if (l.base != 0 || r.base != 0 || external) {
+			break;
+		}
+		return ExprValue{this->evaluateConstant(l.value, r.value), 0};
+	}
+	throw std::runtime_error(std::format("operator {} cannot be applied to addresses in {}", ::toString(this->op), this->toString()));
+}
+
+uint64_t Expression::evaluateConstant(uint64_t l, uint64_t r) {
+	switch (this->op) {
+	case Operator::Div:
+		if (r == 0) {
+			throw std::runtime_error("division by zero in constant expression");
+		}
+		return l / r;
+	case Operator::Mod:
+		if (r == 0) {
+			throw std::runtime_error("division by zero in constant expression");
+		}
+		return l % r;
+	case Operator::Shl:
+		return r >= 64 ? 0 : l << r;
+	case Operator::Shr:
+		return r >= 64 ? 0 : l >> r;
+	case Operator::Band:
+		return l & r;
+	case Operator::Bor:
+		return l | r;
+	case Operator::Xor:
+		return l ^ r;
+	default:
+		throw std::runtime_error("unknown operator in expression");
+	}
+}
+
+std::string Expression::toString() {
+	switch (this->type) {
+	case ExpressionType::Num:
+		return std::to_string(this->numVal);
+	case ExpressionType::Symbol:
+		return this->symbol;
+	case ExpressionType::Unary:
+		return ::toString(this->op) + this->left->toString();
+	case ExpressionType::Binary:
+		return "(" + this->left->toString() + " " + ::toString(this->op) + " " + this->right->toString() + ")";
+	}
+	return "?";
+}
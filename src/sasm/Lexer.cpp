@@ -1,5 +1,7 @@
 #include <cstdint>
+#include <format>
 #include <sasm/Lexer.hpp>
+#include <stdexcept>
 
 #include "sigma-vm/VirtualMachine.hpp"
 
@@ -55,12 +57,56 @@ std::string toString(TokenType type) {
 		return "Jiz";
 	case TokenType::Jnz:
 		return "Jnz";
+	case TokenType::Lea:
+		return "Lea";
+	case TokenType::Bra:
+		return "Bra";
+	case TokenType::Biz:
+		return "Biz";
+	case TokenType::Bnz:
+		return "Bnz";
+	case TokenType::Sys:
+		return "Sys";
+	case TokenType::Cas:
+		return "Cas";
+	case TokenType::Fadd:
+		return "Fadd";
+	case TokenType::Fence:
+		return "Fence";
 	case TokenType::Comma:
 		return "Comma";
 	case TokenType::Semicolon:
 		return "Semicolon";
 	case TokenType::Colon:
 		return "Colon";
+	case TokenType::Plus:
+		return "Plus";
+	case TokenType::Minus:
+		return "Minus";
+	case TokenType::Star:
+		return "Star";
+	case TokenType::Slash:
+		return "Slash";
+	case TokenType::Percent:
+		return "Percent";
+	case TokenType::Shl:
+		return "Shl";
+	case TokenType::Shr:
+		return "Shr";
+	case TokenType::Amp:
+		return "Amp";
+	case TokenType::Pipe:
+		return "Pipe";
+	case TokenType::Caret:
+		return "Caret";
+	case TokenType::Tilde:
+		return "Tilde";
+	case TokenType::LParen:
+		return "LParen";
+	case TokenType::RParen:
+		return "RParen";
+	case TokenType::Directive:
+		return "Directive";
 	case TokenType::A:
 		return "A";
 	case TokenType::B:
@@ -113,6 +159,12 @@ Token Token::makeWord(std::string wordVal) {
 	return token;
 }
 
+Token Token::makeDirective(std::string name) {
+	Token token(TokenType::Directive);
+	token.wordVal = name;
+	return token;
+}
+
 Token Token::T_EOF() {
 	return Token(TokenType::EndOfFile);
 }
@@ -124,6 +176,9 @@ std::string Token::toString() {
 	if (this->type == TokenType::Num) {
 		return "num:" + std::to_string(this->numVal);
 	}
+	if (this->type == TokenType::Directive) {
+		return "." + this->wordVal;
+	}
 	if (this->type == TokenType::SecReg) {
 		return "reg" + std::to_string(this->numVal);
 	}
@@ -156,6 +211,21 @@ Token Lexer::tokenizeWord() {
 	return Token::makeWord(buffer);
 }
 
+Token Lexer::tokenizeDirective() {
+	std::string buffer;
+
+	char c = std::tolower(this->next());
+	while (std::isalnum(c) || c == '_') {
+		buffer += c;
+		c = std::tolower(this->next());
+	}
+
+	if (buffer.empty()) {
+		throw std::runtime_error("expected directive name after '.'");
+	}
+	return Token::makeDirective(buffer);
+}
+
 Token Lexer::tokenizeNum() {
 	uint64_t v = 0;
 
@@ -210,6 +280,17 @@ Token Lexer::nextToken() {
 		} else if (c == ',') {
 			this->next();
 			return Token(TokenType::Comma);
+		} else if (c == '.') {
+			return this->tokenizeDirective();
+		} else if (c == '<' || c == '>') {
+			if (this->next() != c) {
+				throw std::runtime_error(std::format("expected '{}{}' operator", c, c));
+			}
+			this->next();
+			return Token(c == '<' ? TokenType::Shl : TokenType::Shr);
+		} else if (this->operators.find(c) != this->operators.end()) {
+			this->next();
+			return Token(this->operators.at(c));
 		} else if (c == '\0') {
 			return Token::T_EOF();
 		}
@@ -259,6 +340,14 @@ Lexer::Lexer() {
 	    {"jmp", Token(TokenType::Jmp)},
 	    {"jiz", Token(TokenType::Jiz)},
 	    {"jnz", Token(TokenType::Jnz)},
+	    {"lea", Token(TokenType::Lea)},
+	    {"bra", Token(TokenType::Bra)},
+	    {"biz", Token(TokenType::Biz)},
+	    {"bnz", Token(TokenType::Bnz)},
+	    {"sys", Token(TokenType::Sys)},
+	    {"cas", Token(TokenType::Cas)},
+	    {"fadd", Token(TokenType::Fadd)},
+	    {"fence", Token(TokenType::Fence)},
 	    {"a", Token(TokenType::A)},
 	    {"b", Token(TokenType::B)},
 	    {"c", Token(TokenType::C)},
@@ -267,6 +356,19 @@ Lexer::Lexer() {
 	    {"ip", Token(TokenType::Ip)},
 	    {"flg", Token(TokenType::Flg)},
 	};
+	this->operators = std::map<char, TokenType>{
+	    {'+', TokenType::Plus},
+	    {'-', TokenType::Minus},
+	    {'*', TokenType::Star},
+	    {'/', TokenType::Slash},
+	    {'%', TokenType::Percent},
+	    {'&', TokenType::Amp},
+	    {'|', TokenType::Pipe},
+	    {'^', TokenType::Caret},
+	    {'~', TokenType::Tilde},
+	    {'(', TokenType::LParen},
+	    {')', TokenType::RParen},
+	};
 	for (size_t i = 0; i < ADD_REGS_COUNT; i++) {
 		this->kwrds.insert({"r" + std::to_string(i), Token::makeAddReg(i)});
 	}
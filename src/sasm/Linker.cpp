@@ -1,19 +1,66 @@
 #include <print>
+#include <stdexcept>
 #include <sasm/Linker.hpp>
 
 Linker::Linker(Parser parser)
-    : parser(parser), linkingForward(false) {
+    : entryPosition(0), position(0), currentAddr(0), dataSize(0), section(SECTION_CODE), parser(parser), collected(false) {
+}
+
+// first pass: assign addresses to labels and record constants, so that
+// every expression can be resolved regardless of where its symbols are defined
+void Linker::collect() {
+	this->collected = true;
+	while (!this->parser.atEof()) {
+		Instruction instr = this->parser.next();
+		instr.position = this->position++;
+		switch (instr.type) {
+		case InstructionType::Label:
+			this->addLabel(instr.strVal);
+			break;
+		case InstructionType::Constant:
+			this->addConstant(instr);
+			break;
+		case InstructionType::Section:
+			this->section = instr.strVal == "data" ? SECTION_DATA : SECTION_CODE;
+			break;
+		case InstructionType::Entry:
+			this->entryExpr = instr.expr;
+			this->entryPosition = instr.position;
+			break;
+		case InstructionType::Global:
+			this->globals.insert(instr.names.begin(), instr.names.end());
+			break;
+		case InstructionType::Extern:
+			this->externs.insert(instr.names.begin(), instr.names.end());
+			break;
+		case InstructionType::Data:
+			if (this->section != SECTION_DATA) {
+				throw std::runtime_error(".word is only allowed in the .data section");
+			}
+			this->dataWords.push_back(instr);
+			this->dataSize += instr.words.size();
+			break;
+		default:
+			if (this->section != SECTION_CODE) {
+				throw std::runtime_error(std::format("instruction {} is not allowed in the .data section", instr.toString()));
+			}
+			instr.addr = this->currentAddr;
+			this->instructions.push_back(instr);
+			this->currentAddr += 2;
+			break;
+		}
+	}
 }
 
 Instruction Linker::next() {
-	std::println("[DEBUG]: LINKER::NEXT{}; size: {}", this->linkingForward ? " FRWRD" : "", this->linkedForward.size());
-	this->currentAddr += 2;
-	if (this->linkedForward.size() && !this->linkingForward) {
-		Instruction v = this->linkedForward[0];
-		this->linkedForward.pop_front();
-		return v;
+	if (!this->collected) {
+		this->collect();
 	}
-	Instruction instr = parser.next();
+	if (this->instructions.empty()) {
+		throw std::runtime_error("no instructions left to link");
+	}
+	Instruction instr = this->instructions[0];
+	this->instructions.pop_front();
 
 	if (!instr.expandable)
 		return instr;
@@ -21,54 +68,210 @@ Instruction Linker::next() {
 	switch (instr.type) {
 	case InstructionType::Ldi: {
 		instr.expandable = false;
-		instr.arg = this->resolveLabel(instr.strVal);
+		instr.arg = this->resolveAddress(instr.expr, instr.position, instr.relocatable, instr.external);
 		return instr;
 	} break;
-	case InstructionType::Label: {
-		this->currentAddr -= 2;
-		this->addLabel(instr.strVal);
-		return this->next();
+	case InstructionType::Lea:
+	case InstructionType::Bra:
+	case InstructionType::Biz:
+	case InstructionType::Bnz: {
+		// stored as the distance from the end of the instruction, so the
+		// code does not depend on where it is loaded
+		instr.expandable = false;
+		uint64_t target = this->resolveAddress(instr.expr, instr.position, instr.relocatable, instr.external);
+		if (!instr.relocatable && instr.external.empty()) {
+			throw std::runtime_error(std::format("{} needs an address, not the constant {}", ::toString(instr.type), instr.expr->toString()));
+		}
+		instr.relocatable = false;
+		instr.pcRelative = true;
+		instr.arg = target - (instr.addr + 2);
+		return instr;
 	} break;
-    default:
-        break;
+	default:
+		break;
 	}
-	std::cout << "WARNING: instruction marked as expandable, but type is unknown" << std::endl;
-	return instr;
+	throw std::logic_error(std::format("{} is marked as expandable but cannot be expanded", ::toString(instr.type)));
 }
 
 void Linker::addLabel(std::string label) {
-	this->labels.insert_or_assign(label, this->currentAddr);
+	if (this->constants.find(label) != this->constants.end()) {
+		throw std::runtime_error(std::format("label {} is already defined as a constant", label));
+	}
+	Label l = this->section == SECTION_DATA ? Label{SECTION_DATA, this->dataSize} : Label{SECTION_CODE, this->currentAddr};
+	if (!this->labels.emplace(label, l).second) {
+		throw std::runtime_error(std::format("label {} is already defined", label));
+	}
 }
 
-uint64_t Linker::resolveLabel(std::string label) {
-	std::println("[DEBUG]: LINKER::RESOLVE_LBL; size: {}", this->linkedForward.size());
-	if (this->labels.find(label) != this->labels.end()) {
-		return this->labels.at(label);
+void Linker::addConstant(Instruction instr) {
+	if (this->labels.find(instr.strVal) != this->labels.end()) {
+		throw std::runtime_error(std::format("constant {} is already defined as a label", instr.strVal));
+	}
+	if (!instr.redefinable && this->constants.find(instr.strVal) != this->constants.end()) {
+		throw std::runtime_error(std::format("constant {} is already defined", instr.strVal));
 	}
-	int addr = this->currentAddr;
+	this->constants[instr.strVal].push_back(Constant{instr.position, instr.expr});
+}
 
-	this->linkingForward = true;
-	while (this->labels.find(label) == this->labels.end()) {
-		if (this->atEof()) {
-			throw std::runtime_error(std::format("label {} is unknown", label));
+const Linker::Constant &Linker::constantAt(const std::string &name, uint64_t position) {
+	const std::vector<Constant> &defs = this->constants.at(name);
+	const Constant *found = &defs.front();
+	for (const Constant &c : defs) {
+		if (c.position > position) {
+			break;
 		}
-		this->linkedForward.push_back(this->next());
+		found = &c;
 	}
-	this->linkingForward = false;
+	return *found;
+}
 
-	this->currentAddr = addr;
+ExprValue Linker::resolveLabel(std::string label, uint64_t position) {
+	if (this->labels.find(label) != this->labels.end()) {
+		Label l = this->labels.at(label);
+		return ExprValue{l.section == SECTION_DATA ? this->dataAddr() + l.offset : l.offset, 1};
+	}
+	if (this->constants.find(label) == this->constants.end()) {
+		if (this->externs.find(label) != this->externs.end()) {
+			return ExprValue{0, 0, label};
+		}
+		throw std::runtime_error(std::format("label {} is unknown", label));
+	}
+	// names inside a definition are resolved where that definition stands,
+	// so .define X X + 1; builds on the previous value of X
+	const Constant &c = this->constantAt(label, position);
+	std::pair<std::string, uint64_t> key{label, c.position};
+	if (this->resolving.find(key) != this->resolving.end()) {
+		throw std::runtime_error(std::format("constant {} is defined in terms of itself", label));
+	}
+	this->resolving.insert(key);
+	uint64_t at = c.position == 0 ? 0 : c.position - 1;
+	ExprValue v = c.expr->evaluate([this, at](const std::string &name) {
+		return this->resolveLabel(name, at);
+	});
+	this->resolving.erase(key);
+	return v;
+}
 
-	return this->resolveLabel(label);
+// evaluates an expression that ends up in the image, addresses are
+// reported as relocatable so the image can be loaded at another base,
+// references to imported symbols are left for the module linker
+uint64_t Linker::resolveAddress(std::shared_ptr<Expression> expr, uint64_t position, bool &relocatable, std::string &external) {
+	ExprValue v = expr->evaluate([this, position](const std::string &name) {
+		return this->resolveLabel(name, position);
+	});
+	if (v.base != 0 && v.base != 1) {
+		throw std::runtime_error(std::format("{} is neither a constant nor an address", expr->toString()));
+	}
+	if (!v.external.empty() && v.base != 0) {
+		throw std::runtime_error(std::format("{} mixes a local address with external symbol {}", expr->toString(), v.external));
+	}
+	relocatable = v.base == 1;
+	external = v.external;
+	return v.value;
 }
 
 std::deque<Instruction> Linker::linkAll() {
-	std::deque<Instruction> instuctions;
+	std::deque<Instruction> linked;
 	while (!this->atEof()) {
-		instructions.push_back(this->next());
+		linked.push_back(this->next());
 	}
-	return instuctions;
+	return linked;
 }
 
 bool Linker::atEof() {
-	return parser.atEof() && (this->linkedForward.size() == 0);
+	if (!this->collected) {
+		this->collect();
+	}
+	return this->instructions.empty();
+}
+
+uint64_t Linker::codeSize() {
+	if (!this->collected) {
+		this->collect();
+	}
+	return this->currentAddr;
+}
+
+// the data section starts on the first page after the code, so both
+// sections can be mapped from an image file independently
+uint64_t Linker::dataAddr() {
+	uint64_t size = this->codeSize();
+	return (size + IMAGE_ALIGN_WORDS - 1) / IMAGE_ALIGN_WORDS * IMAGE_ALIGN_WORDS;
+}
+
+uint64_t Linker::entry() {
+	if (!this->collected) {
+		this->collect();
+	}
+	if (!this->entryExpr) {
+		return 0;
+	}
+	bool relocatable;
+	std::string external;
+	uint64_t addr = this->resolveAddress(this->entryExpr, this->entryPosition, relocatable, external);
+	if (!external.empty()) {
+		throw std::runtime_error(std::format("entry point cannot be external symbol {}", external));
+	}
+	return addr;
+}
+
+bool Linker::hasEntry() {
+	if (!this->collected) {
+		this->collect();
+	}
+	return this->entryExpr != nullptr;
+}
+
+std::vector<uint64_t> Linker::linkData(std::vector<ImageRelocEntry> &relocs, const std::map<std::string, uint32_t> &symbolIndex) {
+	if (!this->collected) {
+		this->collect();
+	}
+	std::vector<uint64_t> data;
+	for (auto &instr : this->dataWords) {
+		for (auto &expr : instr.words) {
+			bool relocatable;
+			std::string external;
+			data.push_back(this->resolveAddress(expr, instr.position, relocatable, external));
+			if (relocatable) {
+				relocs.push_back(ImageRelocEntry{this->dataAddr() + data.size() - 1, RELOC_BASE, 0});
+			} else if (!external.empty()) {
+				relocs.push_back(ImageRelocEntry{this->dataAddr() + data.size() - 1, RELOC_SYMBOL, symbolIndex.at(external)});
+			}
+		}
+	}
+	return data;
+}
+
+std::vector<ImageSymbol> Linker::symbols() {
+	if (!this->collected) {
+		this->collect();
+	}
+	std::vector<ImageSymbol> result;
+	for (auto &name : this->globals) {
+		if (this->labels.find(name) == this->labels.end() && this->constants.find(name) == this->constants.end()) {
+			throw std::runtime_error(std::format("exported symbol {} is not defined", name));
+		}
+	}
+	for (auto &[name, label] : this->labels) {
+		ExprValue v = this->resolveLabel(name, this->position);
+		result.push_back(ImageSymbol{name, v.value, (uint32_t)label.section, this->globals.count(name) ? (uint32_t)SYM_GLOBAL : 0});
+	}
+	// a redefined constant is exported with its final value
+	for (auto &[name, defs] : this->constants) {
+		ExprValue v = this->resolveLabel(name, this->position);
+		uint32_t section = SECTION_ABS;
+		if (v.base) {
+			section = v.value >= this->dataAddr() ? SECTION_DATA : SECTION_CODE;
+		}
+		if (!v.external.empty()) {
+			continue;
+		}
+		result.push_back(ImageSymbol{name, v.value, section, this->globals.count(name) ? (uint32_t)SYM_GLOBAL : 0});
+	}
+	for (auto &name : this->externs) {
+		if (this->labels.find(name) == this->labels.end() && this->constants.find(name) == this->constants.end()) {
+			result.push_back(ImageSymbol{name, 0, SECTION_UNDEF, 0});
+		}
+	}
+	return result;
 }
@@ -0,0 +1,120 @@
+#include <format>
+#include <sasm/ModuleLinker.hpp>
+#include <stdexcept>
+
+ModuleLinker::ModuleLinker(std::vector<Image> modules)
+    : modules(modules), dataAddr(0) {
+}
+
+void ModuleLinker::layout() {
+	uint64_t code = 0, data = 0;
+	for (auto &m : this->modules) {
+		this->layouts.push_back(Layout{code, data});
+		code += m.code.size();
+		data += m.data.size();
+	}
+	this->dataAddr = (code + IMAGE_ALIGN_WORDS - 1) / IMAGE_ALIGN_WORDS * IMAGE_ALIGN_WORDS;
+	for (auto &l : this->layouts) {
+		l.dataBase += this->dataAddr;
+	}
+}
+
+// maps an address local to a module into the linked image
+uint64_t ModuleLinker::translate(size_t module, uint64_t addr) {
+	Image &m = this->modules[module];
+	if (addr < m.dataAddr) {
+		return this->layouts[module].codeBase + addr;
+	}
+	return this->layouts[module].dataBase + (addr - m.dataAddr);
+}
+
+uint64_t &ModuleLinker::wordAt(Image &image, uint64_t addr) {
+	if (addr < image.code.size()) {
+		return image.code[addr];
+	}
+	if (addr >= image.dataAddr && addr - image.dataAddr < image.data.size()) {
+		return image.data[addr - image.dataAddr];
+	}
+	throw std::runtime_error(std::format("relocation at {} is outside of the image", addr));
+}
+
+void ModuleLinker::collectGlobals() {
+	for (size_t i = 0; i < this->modules.size(); i++) {
+		for (auto &sym : this->modules[i].symbols) {
+			if (!(sym.flags & SYM_GLOBAL) || sym.section == SECTION_UNDEF) {
+				continue;
+			}
+			if (this->globals.find(sym.name) != this->globals.end()) {
+				throw std::runtime_error(std::format("symbol {} is exported by more than one module", sym.name));
+			}
+			uint64_t value = sym.section == SECTION_ABS ? sym.value : this->translate(i, sym.value);
+			this->globals.insert({sym.name, Global{value, sym.section}});
+		}
+	}
+}
+
+Image ModuleLinker::link() {
+	this->layout();
+	this->collectGlobals();
+
+	Image out;
+	out.dataAddr = this->dataAddr;
+	bool hasEntry = false;
+	for (size_t i = 0; i < this->modules.size(); i++) {
+		Image &m = this->modules[i];
+		if (!(m.flags & IMAGE_FLAG_OBJECT)) {
+			throw std::runtime_error("only object modules can be linked");
+		}
+		for (auto &r : m.relocs) {
+			uint64_t &word = this->wordAt(m, r.addr);
+			uint64_t addr = this->translate(i, r.addr);
+			if (r.type == RELOC_BASE) {
+				word = this->translate(i, word);
+				out.relocs.push_back(ImageRelocEntry{addr, RELOC_BASE, 0});
+				continue;
+			}
+			if (r.type == RELOC_PCREL) {
+				// the word sits right before the end of its instruction
+				uint64_t target = word + r.addr + 1;
+				word = this->translate(i, target) - (addr + 1);
+				continue;
+			}
+			if (r.symbol >= m.symbols.size()) {
+				throw std::runtime_error("relocation refers to an unknown symbol");
+			}
+			std::string name = m.symbols[r.symbol].name;
+			if (this->globals.find(name) == this->globals.end()) {
+				throw std::runtime_error(std::format("undefined reference to {}", name));
+			}
+			Global g = this->globals.at(name);
+			if (r.type == RELOC_PCREL_SYMBOL) {
+				if (g.section == SECTION_ABS) {
+					throw std::runtime_error(std::format("ip-relative reference to constant {}", name));
+				}
+				word += g.value - (addr - r.addr);
+				continue;
+			}
+			word += g.value;
+			if (g.section != SECTION_ABS) {
+				out.relocs.push_back(ImageRelocEntry{addr, RELOC_BASE, 0});
+			}
+		}
+		out.code.insert(out.code.end(), m.code.begin(), m.code.end());
+		out.data.insert(out.data.end(), m.data.begin(), m.data.end());
+		if (m.flags & IMAGE_FLAG_ENTRY) {
+			if (hasEntry) {
+				throw std::runtime_error("more than one module sets the entry point");
+			}
+			hasEntry = true;
+			out.entry = this->translate(i, m.entry);
+			out.flags |= IMAGE_FLAG_ENTRY;
+		}
+	}
+	if (out.relocs.empty()) {
+		out.flags |= IMAGE_FLAG_PIC;
+	}
+	for (auto &[name, g] : this->globals) {
+		out.symbols.push_back(ImageSymbol{name, g.value, g.section, SYM_GLOBAL});
+	}
+	return out;
+}
@@ -5,6 +5,16 @@
 
 #include "sasm/Lexer.hpp"
 
+// binary operators from the loosest to the tightest binding level
+static const std::deque<std::deque<std::pair<TokenType, Operator>>> binaryLevels{
+    {{TokenType::Pipe, Operator::Bor}},
+    {{TokenType::Caret, Operator::Xor}},
+    {{TokenType::Amp, Operator::Band}},
+    {{TokenType::Shl, Operator::Shl}, {TokenType::Shr, Operator::Shr}},
+    {{TokenType::Plus, Operator::Add}, {TokenType::Minus, Operator::Sub}},
+    {{TokenType::Star, Operator::Mul}, {TokenType::Slash, Operator::Div}, {TokenType::Percent, Operator::Mod}},
+};
+
 Parser::Parser(Lexer lexer)
     : lexer(lexer) {
 	this->tokensTrace.push_back(this->lexer.nextToken());
@@ -18,7 +28,7 @@ Parser::Parser(Lexer lexer)
 	    {TokenType::Mul, InstructionType::Mul},
 	    {TokenType::Div, InstructionType::Div},
 	    {TokenType::Mod, InstructionType::Mod},
-	    {TokenType::Gth, InstructionType::Lth},
+	    {TokenType::Gth, InstructionType::Gth},
 	    {TokenType::Lth, InstructionType::Lth},
 	    {TokenType::Geq, InstructionType::Geq},
 	    {TokenType::Leq, InstructionType::Leq},
@@ -34,7 +44,16 @@ Parser::Parser(Lexer lexer)
 	    {TokenType::Jmp, InstructionType::Jmp},
 	    {TokenType::Jiz, InstructionType::Jiz},
 	    {TokenType::Jnz, InstructionType::Jnz},
-	    {TokenType::Word, InstructionType::Label}};
+	    {TokenType::Lea, InstructionType::Lea},
+	    {TokenType::Bra, InstructionType::Bra},
+	    {TokenType::Biz, InstructionType::Biz},
+	    {TokenType::Bnz, InstructionType::Bnz},
+	    {TokenType::Sys, InstructionType::Sys},
+	    {TokenType::Cas, InstructionType::Cas},
+	    {TokenType::Fadd, InstructionType::Fadd},
+	    {TokenType::Fence, InstructionType::Fence},
+	    {TokenType::Word, InstructionType::Label},
+	    {TokenType::Directive, InstructionType::Constant}};
 }
 std::string toString(InstructionType instr) {
 	switch (instr) {
@@ -88,6 +107,34 @@ std::string toString(InstructionType instr) {
 		return "JIZ";
 	case InstructionType::Jnz:
 		return "JNZ";
+	case InstructionType::Lea:
+		return "LEA";
+	case InstructionType::Bra:
+		return "BRA";
+	case InstructionType::Biz:
+		return "BIZ";
+	case InstructionType::Bnz:
+		return "BNZ";
+	case InstructionType::Sys:
+		return "SYS";
+	case InstructionType::Cas:
+		return "CAS";
+	case InstructionType::Fadd:
+		return "FADD";
+	case InstructionType::Fence:
+		return "FENCE";
+	case InstructionType::Constant:
+		return "CONST";
+	case InstructionType::Section:
+		return "SECTION";
+	case InstructionType::Data:
+		return "WORD";
+	case InstructionType::Entry:
+		return "ENTRY";
+	case InstructionType::Global:
+		return "GLOBAL";
+	case InstructionType::Extern:
+		return "EXTERN";
 	default:
 		return "UNKNOWN";
 	}
@@ -121,8 +168,28 @@ std::string Instruction::toString() {
 	if (this->expandable) {
 		if (this->type == InstructionType::Label) {
 			result = std::format("{}:", this->strVal);
-		} else if (this->type == InstructionType::Ldi) {
-			result += std::format(" {} {};", this->left.toString(), this->strVal);
+		} else if (this->type == InstructionType::Ldi || this->type == InstructionType::Lea) {
+			result += std::format(" {} {};", this->left.toString(), this->expr->toString());
+		} else if (this->type == InstructionType::Bra || this->type == InstructionType::Biz || this->type == InstructionType::Bnz) {
+			result += std::format(" {};", this->expr->toString());
+		} else if (this->type == InstructionType::Constant) {
+			result = std::format(".{} {} {};", this->redefinable ? "define" : "equ", this->strVal, this->expr->toString());
+		} else if (this->type == InstructionType::Section) {
+			result = std::format(".{};", this->strVal);
+		} else if (this->type == InstructionType::Entry) {
+			result = std::format(".entry {};", this->expr->toString());
+		} else if (this->type == InstructionType::Global || this->type == InstructionType::Extern) {
+			result = this->type == InstructionType::Global ? ".global" : ".extern";
+			for (size_t n = 0; n < this->names.size(); n++) {
+				result += (n ? ", " : " ") + this->names[n];
+			}
+			result += ';';
+		} else if (this->type == InstructionType::Data) {
+			result = ".word";
+			for (size_t w = 0; w < this->words.size(); w++) {
+				result += (w ? ", " : " ") + this->words[w]->toString();
+			}
+			result += ';';
 		}
 	} else {
 		switch (this->type) {
@@ -141,7 +208,7 @@ std::string Instruction::toString() {
 }
 
 bool Parser::atEof() {
-	return this->lexer.atEof();
+	return this->current().type == TokenType::EndOfFile;
 }
 
 void Parser::reset() {
@@ -207,19 +274,39 @@ Instruction Parser::next() {
 		Register dest = Parser::parseReg(t);
 		this->advance();
 		t = this->current();
-		if (t.type == TokenType::Num) {
+		auto expr = this->parseExpression();
+		if (expr->isConstant()) {
 			i.expandable = false;
-			i.arg = t.numVal;
-		} else if (t.type == TokenType::Word) {
-			i.expandable = true;
-			i.strVal = t.wordVal;
+			i.arg = expr->evaluate([](const std::string &) -> ExprValue {
+				throw std::runtime_error("unexpected symbol in constant expression");
+			}).value;
 		} else {
-			throw std::runtime_error("unexpected argument in LDI instruction");
+			i.expandable = true;
+			i.expr = expr;
 		}
 		i.type = InstructionType::Ldi;
 		i.left = dest;
+		if (!match(TokenType::Semicolon, t)) {
+			throw std::runtime_error("Expected ';' token after instruction");
+		}
+	} break;
+	case TokenType::Lea: {
 		this->advance();
 		t = this->current();
+		i.left = Parser::parseReg(t);
+		this->advance();
+		i.expandable = true;
+		i.expr = this->parseExpression();
+		if (!match(TokenType::Semicolon, t)) {
+			throw std::runtime_error("Expected ';' token after instruction");
+		}
+	} break;
+	case TokenType::Bra:
+	case TokenType::Biz:
+	case TokenType::Bnz: {
+		this->advance();
+		i.expandable = true;
+		i.expr = this->parseExpression();
 		if (!match(TokenType::Semicolon, t)) {
 			throw std::runtime_error("Expected ';' token after instruction");
 		}
@@ -252,15 +339,22 @@ Instruction Parser::next() {
 
 	case TokenType::Jmp:
 	case TokenType::Jiz:
-	case TokenType::Jnz: {
+	case TokenType::Jnz:
+
+	case TokenType::Sys:
+
+	case TokenType::Cas:
+	case TokenType::Fadd:
+	case TokenType::Fence: {
 		this->advance();
 		t = this->current();
 		if (!match(TokenType::Semicolon, t)) {
 			throw std::runtime_error("Expected ';' token after instruction");
 		}
 	} break;
+	case TokenType::Directive:
+		return this->parseDirective(t);
 	case TokenType::Word: {
-		std::println("WORD: {}", t.wordVal);
 		i.strVal = t.wordVal;
 		i.expandable = true;
 		this->advance();
@@ -274,6 +368,106 @@ Instruction Parser::next() {
 	return i;
 }
 
+Instruction Parser::parseDirective(Token t) {
+	Instruction i;
+	i.expandable = true;
+	std::string name = t.wordVal;
+	this->advance();
+	if (name == "equ" || name == "define") {
+		i.type = InstructionType::Constant;
+		i.redefinable = name == "define";
+		t = this->current();
+		if (t.type != TokenType::Word) {
+			throw std::runtime_error(std::format("expected constant name after .{}", name));
+		}
+		i.strVal = t.wordVal;
+		this->advance();
+		i.expr = this->parseExpression();
+	} else if (name == "code" || name == "data") {
+		i.type = InstructionType::Section;
+		i.strVal = name;
+	} else if (name == "word") {
+		i.type = InstructionType::Data;
+		i.words.push_back(this->parseExpression());
+		while (match(TokenType::Comma, t)) {
+			i.words.push_back(this->parseExpression());
+		}
+	} else if (name == "entry") {
+		i.type = InstructionType::Entry;
+		i.expr = this->parseExpression();
+	} else if (name == "global" || name == "extern") {
+		i.type = name == "global" ? InstructionType::Global : InstructionType::Extern;
+		do {
+			t = this->current();
+			if (t.type != TokenType::Word) {
+				throw std::runtime_error(std::format("expected symbol name after .{}", name));
+			}
+			i.names.push_back(t.wordVal);
+			this->advance();
+		} while (match(TokenType::Comma, t));
+	} else {
+		throw std::runtime_error(std::format("unknown directive .{}", name));
+	}
+	if (!match(TokenType::Semicolon, t)) {
+		throw std::runtime_error("Expected ';' token after directive");
+	}
+	return i;
+}
+
+std::shared_ptr<Expression> Parser::parseExpression() {
+	return this->parseBinary(0);
+}
+
+std::shared_ptr<Expression> Parser::parseBinary(size_t level) {
+	if (level >= binaryLevels.size()) {
+		return this->parseUnary();
+	}
+	auto left = this->parseBinary(level + 1);
+	while (true) {
+		Token t = this->current();
+		auto it = binaryLevels[level].begin();
+		while (it != binaryLevels[level].end() && it->first != t.type) {
+			it++;
+		}
+		if (it == binaryLevels[level].end()) {
+			return left;
+		}
+		this->advance();
+		left = Expression::makeBinary(it->second, left, this->parseBinary(level + 1));
+	}
+}
+
+std::shared_ptr<Expression> Parser::parseUnary() {
+	Token t = this->current();
+	switch (t.type) {
+	case TokenType::Minus:
+		this->advance();
+		return Expression::makeUnary(Operator::Neg, this->parseUnary());
+	case TokenType::Tilde:
+		this->advance();
+		return Expression::makeUnary(Operator::Bnot, this->parseUnary());
+	case TokenType::Plus:
+		this->advance();
+		return this->parseUnary();
+	case TokenType::Num:
+		this->advance();
+		return Expression::makeNum(t.numVal);
+	case TokenType::Word:
+		this->advance();
+		return Expression::makeSymbol(t.wordVal);
+	case TokenType::LParen: {
+		this->advance();
+		auto e = this->parseExpression();
+		if (!match(TokenType::RParen, t)) {
+			throw std::runtime_error("Expected ')' in expression");
+		}
+		return e;
+	}
+	default:
+		throw std::runtime_error(std::format("unexpected {} in expression", t.toString()));
+	}
+}
+
 bool Parser::match(TokenType type, Token &t) {
 	t = this->current();
 	if (t.type == type) {
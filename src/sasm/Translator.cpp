@@ -0,0 +1,328 @@
+#include <format>
+#include <sasm/Translator.hpp>
+#include <sigma-vm/VirtualMachine.hpp>
+#include <stdexcept>
+
+static std::string num(uint64_t v) {
+	return std::to_string(v) + "ull";
+}
+
+// after a host callback: charge the block and pass on anything but NATIVE_CONTINUE
+static std::string afterCall(uint64_t length) {
+	return std::format("\tbudget -= {};\n", length) + "\tif (r != NATIVE_CONTINUE) {\n\t\tf->budget = budget;\n\t\treturn r;\n\t}\n";
+}
+
+Translator::Translator(const Image &image, uint64_t base)
+    : code(image.code), base(base) {
+	if (image.flags & IMAGE_FLAG_OBJECT) {
+		throw std::runtime_error("object modules have to be linked before they are translated");
+	}
+	if (base != 0) {
+		for (auto &r : image.relocs) {
+			if (r.addr < this->code.size()) {
+				this->code[r.addr] += base;
+			}
+		}
+	}
+	// blocks start at every known jump target and end where the
+	// interpreter ends them; code that falls through into a target pays
+	// for what ran before it on the way in, so budgets and fuel are charged
+	// alike as long as computed jumps land on known targets
+	std::vector<bool> target(this->code.size());
+	for (uint64_t i = 0; i + 1 < this->code.size(); i += 2) {
+		uint64_t info = this->code[i], val = this->code[i + 1];
+		uint16_t op = info & 0xFFFF;
+		uint64_t dest = val - base;
+		if (op == CMD_BRA || op == CMD_BIZ || op == CMD_BNZ) {
+			dest = i + 2 + val;
+		} else if (op != CMD_LDI) {
+			continue;
+		}
+		if (dest < this->code.size()) {
+			target[dest] = true;
+		}
+	}
+	uint64_t length = 0;
+	for (uint64_t i = 0; i + 1 < this->code.size(); i += 2) {
+		uint64_t info = this->code[i];
+		uint16_t op = info & 0xFFFF;
+		uint16_t flag = (info >> 16) & 0xFFFF;
+		uint16_t larg = (info >> 32) & 0xFFFF;
+		this->fallLength.push_back(target[i] ? length : 0);
+		if (target[i]) {
+			length = 0;
+		}
+		length++;
+		this->blockLength.push_back(length);
+		bool writesControl = (op == CMD_MOV || op == CMD_LDI || op == CMD_LEA) && (flag & 0xFF) == 0 && (larg == REG_IP || larg == REG_FLG);
+		if (writesControl || op == CMD_JMP || op == CMD_JIZ || op == CMD_JNZ || op == CMD_BRA || op == CMD_BIZ || op == CMD_BNZ || op == CMD_SYS) {
+			length = 0;
+		}
+	}
+}
+
+bool Translator::isInstruction(uint64_t addr) {
+	return addr >= this->base && addr - this->base < this->blockLength.size() * 2 && (addr - this->base) % 2 == 0;
+}
+
+// local variable holding a register, empty for registers that do not exist
+std::string Translator::reg(uint8_t flag, uint16_t v) {
+	if (flag != 0) {
+		return v < ADD_REGS_COUNT ? std::format("r{}", v) : "";
+	}
+	switch (v) {
+	case REG_A:
+		return "rA";
+	case REG_B:
+		return "rB";
+	case REG_C:
+		return "rC";
+	case REG_IP:
+		return "ip";
+	case REG_SP:
+		return "rSP";
+	case REG_SBP:
+		return "rSBP";
+	case REG_FLG:
+		return "rFLG";
+	default:
+		return "";
+	}
+}
+
+std::string Translator::jumpTo(uint64_t target) {
+	if (this->isInstruction(target)) {
+		return std::format("\tgoto L{};\n", target);
+	}
+	return std::format("\tip = {};\n\tgoto dispatch;\n", num(target));
+}
+
+// charges the block that ends at addr and stops if the budget is used up,
+// target is the IP to resume at
+std::string Translator::endBlock(uint64_t addr, std::string target) {
+	uint64_t length = this->blockLength[(addr - this->base) / 2];
+	return std::format("\tbudget -= {};\n\tif (budget <= 0) STOP({}, {});\n", length, (int)StopReason::Budget, target);
+}
+
+std::string Translator::translate(uint64_t addr) {
+	uint64_t i = addr - this->base;
+	uint64_t info = this->code[i], val = this->code[i + 1];
+	uint16_t op = (info >> 0) & 0xFFFF;
+	uint16_t flag = (info >> 16) & 0xFFFF;
+	uint16_t larg = (info >> 32) & 0xFFFF;
+	uint16_t rarg = (info >> 48) & 0xFFFF;
+	uint64_t next = addr + 2;
+	uint64_t length = this->blockLength[i / 2];
+	std::string out;
+	// charged without a budget check, the interpreter only checks at the
+	// end of the block, and jumps to the label skip it
+	if (this->fallLength[i / 2]) {
+		out += std::format("\tbudget -= {};\n", this->fallLength[i / 2]);
+	}
+	out += std::format("L{}:\n", addr);
+	auto fault = [&](TrapCode code) {
+		return std::format("FAULT({}, {}, {})", (int)code, num(addr), length);
+	};
+
+	// value written to a register by MOV, LDI and LEA
+	auto write = [&](std::string dst, std::string value) {
+		if (dst.empty()) {
+			return std::format("\t{};\n", fault(TrapCode::BadRegister));
+		}
+		if (dst == "ip") {
+			return std::format("\tip = {};\n", value) + this->endBlock(addr, "ip") + "\tgoto dispatch;\n";
+		}
+		std::string s = std::format("\t{} = {};\n", dst, value);
+		if (dst == "rFLG") {
+			// FLG writes can enter the BIOS the legacy way or halt
+			s += std::format("\tSYNC_OUT;\n\tf->regs[{}] = {};\n\tr = f->flag(f);\n\tSYNC_IN;\n", (int)REG_IP, num(next));
+			s += afterCall(length);
+			s += std::format("\tif (budget <= 0) STOP({}, {});\n", (int)StopReason::Budget, num(next));
+			s += this->jumpTo(next);
+		}
+		return s;
+	};
+	auto binary = [&](std::string expr) {
+		return std::format("\trC = {};\n", expr);
+	};
+
+	switch (op) {
+	case CMD_MOV: {
+		std::string src = this->reg(flag >> 8, rarg);
+		if (src == "ip") {
+			src = num(next);
+		}
+		if (src.empty()) {
+			out += std::format("\t{};\n", fault(TrapCode::BadRegister));
+		} else {
+			out += write(this->reg(flag & 0xFF, larg), src);
+		}
+	} break;
+	case CMD_LOD:
+		out += std::format("\tif (rB < memWords) rA = __atomic_load_n(mem + rB, __ATOMIC_RELAXED);\n\telse if (!f->load(f->vm, rB, &rA)) {};\n", fault(TrapCode::BadAddress));
+		break;
+	case CMD_SAV:
+		out += std::format("\tif (rB < memWords) __atomic_store_n(mem + rB, rA, __ATOMIC_RELAXED);\n\telse if (!f->store(f->vm, rB, rA)) {};\n", fault(TrapCode::BadAddress));
+		break;
+	case CMD_CAS:
+	case CMD_FADD:
+		out += std::format("\tp = rB < memWords ? mem + rB : f->pointer(f->vm, rB);\n\tif (!p) {};\n", fault(TrapCode::BadAddress));
+		if (op == CMD_CAS) {
+			out += "\t__atomic_compare_exchange_n(p, &rC, rA, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);\n";
+		} else {
+			out += "\trC = __atomic_fetch_add(p, rA, __ATOMIC_SEQ_CST);\n";
+		}
+		break;
+	case CMD_FENCE:
+		out += "\t__atomic_thread_fence(__ATOMIC_SEQ_CST);\n";
+		break;
+	case CMD_LDI:
+		out += write(this->reg(flag & 0xFF, larg), num(val));
+		break;
+	case CMD_LEA:
+		out += write(this->reg(flag & 0xFF, larg), num(next + val));
+		break;
+	case CMD_ADD:
+		out += binary("rA + rB");
+		break;
+	case CMD_MIN:
+		out += binary("rA - rB");
+		break;
+	case CMD_MUL:
+		out += binary("rA * rB");
+		break;
+	case CMD_DIV:
+	case CMD_MOD:
+		out += std::format("\tif (rB == 0) {};\n", fault(TrapCode::DivideByZero));
+		out += binary(op == CMD_DIV ? "rA / rB" : "rA % rB");
+		break;
+	case CMD_GTH:
+		out += binary("rA > rB");
+		break;
+	case CMD_LTH:
+		out += binary("rA < rB");
+		break;
+	case CMD_GEQ:
+		out += binary("rA >= rB");
+		break;
+	case CMD_LEQ:
+		out += binary("rA <= rB");
+		break;
+	case CMD_EQU:
+		out += binary("rA == rB");
+		break;
+	case CMD_NEQ:
+		out += binary("rA != rB");
+		break;
+	case CMD_LAND:
+		out += binary("rA && rB");
+		break;
+	case CMD_LOR:
+		out += binary("rA || rB");
+		break;
+	case CMD_NOT:
+		out += binary("!rA");
+		break;
+	case CMD_BAND:
+		out += binary("rA & rB");
+		break;
+	case CMD_BOR:
+		out += binary("rA | rB");
+		break;
+	case CMD_BNOT:
+		out += binary("~rA");
+		break;
+	case CMD_XOR:
+		out += binary("rA ^ rB");
+		break;
+	case CMD_JMP:
+	case CMD_JIZ:
+	case CMD_JNZ: {
+		if (op == CMD_JMP) {
+			out += "\tip = rA;\n";
+		} else {
+			out += std::format("\tip = rB {} 0 ? rA : {};\n", op == CMD_JIZ ? "==" : "!=", num(next));
+		}
+		out += this->endBlock(addr, "ip");
+		// LDI A label; JMP is the usual way to jump, the target is known
+		// but A is still checked since the jump may be reached from elsewhere
+		if (i >= 2) {
+			uint64_t prev = this->code[i - 2];
+			if ((prev & 0xFFFF) == CMD_LDI && ((prev >> 16) & 0xFF) == 0 && ((prev >> 32) & 0xFFFF) == REG_A && this->isInstruction(this->code[i - 1])) {
+				out += std::format("\tif (ip == {}) goto L{};\n", num(this->code[i - 1]), this->code[i - 1]);
+			}
+		}
+		if (op != CMD_JMP && this->isInstruction(next)) {
+			out += std::format("\tif (ip == {}) goto L{};\n", num(next), next);
+		}
+		out += "\tgoto dispatch;\n";
+	} break;
+	case CMD_BRA:
+		out += this->endBlock(addr, num(next + val));
+		out += this->jumpTo(next + val);
+		break;
+	case CMD_BIZ:
+	case CMD_BNZ:
+		out += std::format("\tif (rB {} 0) ", op == CMD_BIZ ? "==" : "!=") + "{\n";
+		out += this->endBlock(addr, num(next + val));
+		out += this->jumpTo(next + val);
+		out += "\t}\n";
+		out += this->endBlock(addr, num(next));
+		break;
+	case CMD_SYS:
+		out += std::format("\tSYNC_OUT;\n\tf->regs[{}] = {};\n\tr = f->sys(f);\n\tSYNC_IN;\n", (int)REG_IP, num(next));
+		out += afterCall(length);
+		out += std::format("\tip = f->regs[{}];\n\tif (budget <= 0) STOP({}, ip);\n", (int)REG_IP, (int)StopReason::Budget);
+		out += std::format("\tif (ip != {}) goto dispatch;\n", num(next));
+		break;
+	default:
+		out += std::format("\t{};\n", fault(TrapCode::IllegalOpcode));
+		break;
+	}
+	return out;
+}
+
+std::string Translator::translate() {
+	std::string regs[NATIVE_REGS] = {"rA", "rB", "rC", "", "rSP", "rSBP", "rFLG"};
+	for (int i = 0; i < ADD_REGS_COUNT; i++) {
+		regs[7 + i] = std::format("r{}", i);
+	}
+	std::string out = "// translated from a sigma image, do not edit\n";
+	out += "#include <sigma-vm/Native.hpp>\n\n";
+	out += "#pragma GCC diagnostic ignored \"-Wunused-label\"\n\n";
+	std::string syncOut = "#define SYNC_OUT", syncIn = "#define SYNC_IN";
+	for (int i = 0; i < NATIVE_REGS; i++) {
+		if (!regs[i].empty()) {
+			syncOut += std::format(" f->regs[{}] = {};", i, regs[i]);
+			syncIn += std::format(" {} = f->regs[{}];", regs[i], i);
+		}
+	}
+	out += syncOut + "\n" + syncIn + "\n";
+	out += "#define STOP(reason, at) do { SYNC_OUT; f->regs[3] = at; f->budget = budget; return reason; } while (0)\n";
+	out += "#define FAULT(code, at, length) do { budget -= length; f->trap = code; STOP(NATIVE_FAULT, at); } while (0)\n\n";
+	out += "extern \"C\" const int sigma_native_abi = NATIVE_ABI;\n\n";
+	out += "extern \"C\" int sigma_native_run(NativeFrame *f) {\n";
+	for (int i = 0; i < NATIVE_REGS; i++) {
+		if (!regs[i].empty()) {
+			out += std::format("\tuint64_t {} = f->regs[{}];\n", regs[i], i);
+		}
+	}
+	out += "\tuint64_t ip = f->regs[3];\n";
+	out += "\tuint64_t *mem = f->memory;\n";
+	out += "\tuint64_t memWords = f->memoryWords;\n";
+	out += "\tint64_t budget = f->budget;\n";
+	out += "\tuint64_t *p;\n";
+	out += "\tint r;\n";
+	out += "dispatch:\n\tswitch (ip) {\n";
+	for (uint64_t i = 0; i < this->blockLength.size(); i++) {
+		uint64_t addr = this->base + i * 2;
+		out += std::format("\tcase {}:\n\t\tgoto L{};\n", num(addr), addr);
+	}
+	out += "\tdefault:\n\t\tSTOP(NATIVE_FALLBACK, ip);\n\t}\n";
+	for (uint64_t i = 0; i < this->blockLength.size(); i++) {
+		out += this->translate(this->base + i * 2);
+	}
+	// running off the end of the code
+	out += std::format("\tip = {};\n\tSTOP(NATIVE_FALLBACK, ip);\n", num(this->base + this->blockLength.size() * 2)) + "}\n";
+	return out;
+}
@@ -0,0 +1,83 @@
+// runs programs as the lanes of a Batch and as separate VMs stepped with
+// tick(), lane i with fuel i + 1 so every fuel limit up to a bound is
+// covered; every lane has to stop at the same place with the same
+// registers and fuel left as its VM
+#include <format>
+#include <print>
+#include <sasm/Assembler.hpp>
+#include <sigma-vm/Batch.hpp>
+
+struct Program {
+	const char *name;
+	const char *source;
+	uint64_t maxFuel;
+};
+
+static const Program programs[] = {
+    // lanes diverge on odd and even values and meet again at NEXT
+    {"collatz", "LDI R1 0;\n"
+                "LOOP: MOV A R0; LDI B 1; GTH; MOV B C; LDI A BODY; JNZ; LDI FLG 0;\n"
+                "BODY: MOV A R0; LDI B 2; MOD; MOV B C; LDI A ODD; JNZ;\n"
+                "MOV A R0; LDI B 2; DIV; MOV R0 C; LDI A NEXT; JMP;\n"
+                "ODD: MOV A R0; LDI B 3; MUL; MOV A C; LDI B 1; ADD; MOV R0 C;\n"
+                "NEXT: MOV A R1; LDI B 1; ADD; MOV R1 C; LDI A LOOP; JMP;\n",
+     400},
+    // every fourth lane divides by zero on its way down
+    {"divide", "LDI R1 0;\n"
+               "LOOP: MOV A R0; LDI B 5; MOD; MOV B C; LDI A 1000; DIV; MOV A R1; MOV B C; ADD; MOV R1 C;\n"
+               "MOV A R0; LDI B 1; MIN; MOV R0 C; MOV B C; BNZ LOOP;\n"
+               "LDI FLG 0;\n",
+     300},
+    // memory through LOD and SAV, with a BIOS call on the slow path
+    {"memory", "LDI R1 0;\n"
+               "LOOP: LDI B CELL; LOD; MOV B R0; ADD; MOV A C; LDI B CELL; SAV;\n"
+               "LDI A 0x1002; LDI B 0; SYS;\n"
+               "MOV A R0; LDI B 1; MIN; MOV R0 C; MOV B C; BNZ LOOP;\n"
+               "LDI FLG 0;\n"
+               ".data;\n"
+               "CELL: .word 7;\n",
+     300},
+};
+
+// lanes past maxFuel run without a limit
+static void prepare(VirtualMachine &vm, uint64_t lane, uint64_t maxFuel) {
+	vm.addRegs[0] = lane % 23 + 1;
+	if (lane < maxFuel) {
+		vm.setFuel(lane + 1);
+	}
+}
+
+static std::string describe(VirtualMachine &vm, StopReason reason) {
+	return std::format("reason {} ip {} A {} B {} C {} R0 {} R1 {} fuel {}", (int)reason, vm.regIp, vm.regA, vm.regB, vm.regC, vm.addRegs[0], vm.addRegs[1], vm.getFuel());
+}
+
+int main() {
+	int failures = 0;
+	for (const Program &program : programs) {
+		Image image = Assembler::assemble(program.source);
+		uint64_t lanes = program.maxFuel + 16;
+		Batch batch(image, lanes, 8192);
+		for (uint64_t i = 0; i < lanes; i++) {
+			prepare(batch.lane(i), i, program.maxFuel);
+		}
+		// in slices, so lanes are saved and picked up again in between
+		while (batch.run(97)) {
+		}
+		for (uint64_t i = 0; i < lanes; i++) {
+			VirtualMachine vm(8192);
+			vm.loadImage(image);
+			prepare(vm, i, program.maxFuel);
+			StopReason reason;
+			do {
+				reason = vm.tick();
+			} while (reason == StopReason::Budget);
+			std::string separate = describe(vm, reason);
+			std::string lane = describe(batch.lane(i), batch.reason(i));
+			if (separate != lane) {
+				std::println(stderr, "{} lane {}:\n  vm:    {}\n  batch: {}", program.name, i, separate, lane);
+				failures++;
+			}
+		}
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+// runs programs in the interpreter and from the block cache with every
+// fuel limit up to a bound, both have to stop at the same place with the
+// same registers and fuel left, also when a block is cut short
+#include <format>
+#include <print>
+#include <sasm/Assembler.hpp>
+#include <sigma-vm/VirtualMachine.hpp>
+
+struct Program {
+	const char *name;
+	std::string source;
+	uint64_t maxFuel;
+};
+
+static std::string straight(int times) {
+	std::string source;
+	for (int i = 0; i < times; i++) {
+		source += "MOV A R2; LDI B 1; ADD; MOV R2 C; ";
+	}
+	return source;
+}
+
+static const Program programs[] = {
+    // stores into the LDI at PATCH, which ends the block that is running
+    {"self-patching", "LDI R0 0; LDI R1 5;\n"
+                      "TOP: MOV A R0; LDI B 1; ADD; MOV R0 C; LDI A 0; LDI B PATCH; LDI C 1; ADD; MOV B C; MOV A R0; SAV;\n"
+                      "PATCH: LDI R2 0; MOV A R1; LDI B 1; MIN; MOV R1 C; MOV B C; BNZ TOP;\n"
+                      "LDI FLG 0;\n",
+     150},
+    // straight line code longer than BLOCK_MAX_OPS
+    {"long-block", "LDI R2 0; LDI R1 2;\n"
+                   "TOP: " + straight(150) + "MOV A R1; LDI B 1; MIN; MOV R1 C; MOV B C; BNZ TOP;\n"
+                   "LDI FLG 0;\n",
+     1300},
+};
+
+static std::string run(Image &image, ExecMode mode, uint64_t fuel) {
+	VirtualMachine vm(8192);
+	vm.loadImage(image);
+	vm.setMode(mode);
+	vm.setFuel(fuel);
+	StopReason reason = vm.run(UINT64_MAX);
+	return std::format("reason {} ip {} R0 {} R1 {} R2 {} fuel {}", (int)reason, vm.regIp, vm.addRegs[0], vm.addRegs[1], vm.addRegs[2], vm.getFuel());
+}
+
+int main() {
+	int failures = 0;
+	for (const Program &program : programs) {
+		Image image = Assembler::assemble(program.source);
+		for (uint64_t fuel = 1; fuel <= program.maxFuel; fuel++) {
+			std::string interpreted = run(image, ExecMode::Fast, fuel);
+			std::string blocks = run(image, ExecMode::Blocks, fuel);
+			if (interpreted != blocks) {
+				std::println(stderr, "{} with fuel {}:\n  interpreter: {}\n  blocks:      {}", program.name, fuel, interpreted, blocks);
+				failures++;
+			}
+		}
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,76 @@
+// producer and consumer pairs talk over small channels under a Scheduler
+// with two threads: every word has to arrive, and a consumer left without
+// a producer has to be reported as a deadlock instead of hanging
+#include <format>
+#include <print>
+#include <sasm/Assembler.hpp>
+#include <sigma-vm/Scheduler.hpp>
+
+#define WORDS 20000
+#define PAIRS 3
+
+// sends 1..WORDS one word at a time, then closes
+static const char *producer = "LDI R1 0;\n"
+                              "LOOP: MOV A R1; LDI B 1; ADD; MOV R1 C; MOV A R1; LDI B BUF; SAV;\n"
+                              "LDI A 0x1004; LDI B 0; LDI C BUF; LDI R0 1; SYS;\n"
+                              "MOV A R1; LDI B WORDS; LTH; MOV B C; BNZ LOOP;\n"
+                              "LDI A 0x1006; LDI B 0; SYS;\n"
+                              "LDI FLG 0;\n"
+                              ".data;\n"
+                              "BUF: .word 0;\n";
+
+// receives up to 8 words at a time and sums them in R2 until the channel
+// is closed and drained
+static const char *consumer = "LDI R2 0;\n"
+                              "LOOP: LDI A 0x1005; LDI B 0; LDI C BUF; LDI R0 8; SYS;\n"
+                              "MOV B A; BIZ DONE; MOV R3 B; LDI R4 0;\n"
+                              "SUM: LDI A BUF; MOV B R4; ADD; MOV B C; LOD; MOV B R2; ADD; MOV R2 C;\n"
+                              "MOV A R4; LDI B 1; ADD; MOV R4 C; MOV A R4; MOV B R3; LTH; MOV B C; BNZ SUM;\n"
+                              "BRA LOOP;\n"
+                              "DONE: LDI FLG 0;\n"
+                              ".data;\n"
+                              "BUF: .word 0, 0, 0, 0, 0, 0, 0, 0;\n";
+
+int main() {
+	int failures = 0;
+	Image producerImage = Assembler::assemble(std::format(".equ WORDS {};\n", WORDS) + producer);
+	Image consumerImage = Assembler::assemble(consumer);
+
+	std::vector<std::unique_ptr<VirtualMachine>> producers, consumers;
+	Scheduler scheduler(2);
+	for (int i = 0; i < PAIRS; i++) {
+		auto channel = std::make_shared<Channel>(4);
+		producers.push_back(std::make_unique<VirtualMachine>(8192));
+		consumers.push_back(std::make_unique<VirtualMachine>(8192));
+		producers.back()->loadImage(producerImage);
+		consumers.back()->loadImage(consumerImage);
+		producers.back()->attachChannel(channel, ChannelEnd::Send);
+		consumers.back()->attachChannel(channel, ChannelEnd::Receive);
+		// consumers first, so they block before anything was sent
+		scheduler.add(*consumers.back());
+	}
+	for (auto &vm : producers) {
+		scheduler.add(*vm);
+	}
+	scheduler.run();
+	uint64_t expected = (uint64_t)WORDS * (WORDS + 1) / 2;
+	for (int i = 0; i < PAIRS; i++) {
+		if (consumers[i]->addRegs[2] != expected || consumers[i]->regFlag != 0) {
+			std::println(stderr, "consumer {} summed {}, expected {}", i, consumers[i]->addRegs[2], expected);
+			failures++;
+		}
+	}
+
+	VirtualMachine lonely(8192);
+	lonely.loadImage(consumerImage);
+	lonely.attachChannel(std::make_shared<Channel>(4), ChannelEnd::Receive);
+	Scheduler stuck(2);
+	stuck.add(lonely);
+	try {
+		stuck.run();
+		std::println(stderr, "a consumer without a producer was not reported");
+		failures++;
+	} catch (const std::runtime_error &) {
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,77 @@
+// runs programs in the interpreter and as translated native code with
+// every fuel limit up to a bound, both have to stop at the same place
+// with the same registers and fuel left
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <print>
+#include <sasm/Assembler.hpp>
+#include <sasm/Translator.hpp>
+#include <sigma-vm/VirtualMachine.hpp>
+
+struct Program {
+	const char *name;
+	const char *source;
+	uint64_t maxFuel;
+};
+
+static const Program programs[] = {
+    // straight line code falling through into a loop
+    {"fall-through", "LDI A 0; LDI B 1; LDI C 0; LDI R0 0; LDI R1 0; LDI R2 0; LDI R3 0; LDI R4 0;\n"
+                     "LOOP: MOV A C; ADD; BRA LOOP;\n",
+     80},
+    // nested loops with a fall-through into the inner one and a BIOS call
+    {"nested", "LDI R0 0;\n"
+               "OUTER: LDI R1 0; LDI A 1;\n"
+               "INNER: MOV A R1; LDI B 1; ADD; MOV R1 C; MOV A R1; LDI B 4; LTH; MOV B C; BNZ INNER;\n"
+               "LDI A 0x1002; LDI B 0; SYS;\n"
+               "MOV A R0; LDI B 1; ADD; MOV R0 C; MOV A R0; LDI B 5; LTH; MOV B C; BNZ OUTER;\n"
+               "LDI FLG 0;\n",
+     300},
+    // computed jumps to labels, one of them reached by falling through
+    {"computed", "LDI R0 3;\n"
+                 "TOP: LDI A 7; LDI B 2;\n"
+                 "MID: MUL; MOV A R0; LDI B 1; MIN; MOV R0 C; MOV B C; LDI A TOP; JNZ;\n"
+                 "LDI FLG 0;\n",
+     120},
+};
+
+static std::string describe(VirtualMachine &vm, StopReason reason) {
+	return std::format("reason {} ip {} A {} B {} C {} R0 {} R1 {} fuel {}", (int)reason, vm.regIp, vm.regA, vm.regB, vm.regC, vm.addRegs[0], vm.addRegs[1], vm.getFuel());
+}
+
+static std::string run(Image &image, std::shared_ptr<NativeProgram> native, uint64_t fuel) {
+	VirtualMachine vm(8192);
+	vm.loadImage(image);
+	vm.setFuel(fuel);
+	if (native) {
+		vm.setNative(native);
+	}
+	StopReason reason = vm.run(UINT64_MAX);
+	return describe(vm, reason);
+}
+
+int main() {
+	int failures = 0;
+	for (const Program &program : programs) {
+		Image image = Assembler::assemble(program.source);
+		std::string source = std::format("{}/{}.cpp", SIGMA_WORKDIR, program.name);
+		std::string library = std::format("{}/{}.so", SIGMA_WORKDIR, program.name);
+		std::ofstream(source) << Translator(image).translate();
+		std::string command = std::format("\"{}\" -O1 -shared -fPIC -I\"{}\" \"{}\" -o \"{}\"", SIGMA_CXX, SIGMA_INCLUDE, source, library);
+		if (std::system(command.c_str()) != 0) {
+			std::println(stderr, "{}: unable to build the native program", program.name);
+			return 1;
+		}
+		auto native = std::make_shared<NativeProgram>(library);
+		for (uint64_t fuel = 1; fuel <= program.maxFuel; fuel++) {
+			std::string interpreted = run(image, nullptr, fuel);
+			std::string translated = run(image, native, fuel);
+			if (interpreted != translated) {
+				std::println(stderr, "{} with fuel {}:\n  interpreter: {}\n  native:      {}", program.name, fuel, interpreted, translated);
+				failures++;
+			}
+		}
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,34 @@
+// the build cache keys have to be plain SHA-256 digests: the FIPS 180-2
+// examples, plus messages around the 55, 56 and 64 byte edges where the
+// padding needs a second block
+#include <print>
+#include <sasm/BuildCache.hpp>
+#include <string>
+
+struct Vector {
+	std::string message;
+	const char *digest;
+};
+
+static const Vector vectors[] = {
+    {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+    {std::string(55, 'a'), "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318"},
+    {std::string(63, 'a'), "7d3e74a05d7db15bce4ad9ec0658ea98e3f06eeecf16b4c6fff2da457ddc2f34"},
+    {std::string(64, 'a'), "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb"},
+    {std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+};
+
+int main() {
+	int failures = 0;
+	for (const Vector &v : vectors) {
+		std::string digest = BuildCache::sha256(v.message);
+		if (digest != v.digest) {
+			std::println(stderr, "{} bytes: got {}, expected {}", v.message.size(), digest, v.digest);
+			failures++;
+		}
+	}
+	return failures ? 1 : 0;
+}
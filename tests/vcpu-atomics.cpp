@@ -0,0 +1,39 @@
+// four vCPUs count into shared words, one with FADD and one with a CAS
+// loop; no increment may get lost, in every mode that runs vCPUs
+#include <format>
+#include <print>
+#include <sasm/Assembler.hpp>
+#include <sigma-vm/VirtualMachine.hpp>
+
+#define ROUNDS 20000
+#define CPUS 4
+
+static const char *source = "LDI R2 3;\n"
+                            "START: LDI A 0x1003; LDI B WORKER; LDI C 0; SYS;\n"
+                            "MOV A R2; LDI B 1; MIN; MOV R2 C; MOV B C; BNZ START;\n"
+                            "WORKER: LDI R0 ROUNDS;\n"
+                            "LOOP: LDI A 1; LDI B ADDED; FADD;\n"
+                            "RETRY: LDI B SWAPPED; LOD; MOV R1 A; LDI B 1; ADD; MOV A C; MOV C R1;\n"
+                            "LDI B SWAPPED; CAS; MOV A C; MOV B R1; EQU; MOV B C; BIZ RETRY;\n"
+                            "MOV A R0; LDI B 1; MIN; MOV R0 C; MOV B C; BNZ LOOP;\n"
+                            "LDI FLG 0;\n"
+                            ".data;\n"
+                            "ADDED: .word 0;\n"
+                            "SWAPPED: .word 0;\n";
+
+int main() {
+	int failures = 0;
+	Image image = Assembler::assemble(std::format(".equ ROUNDS {};\n", ROUNDS) + source);
+	for (ExecMode mode : {ExecMode::Fast, ExecMode::Blocks}) {
+		VirtualMachine vm(8192);
+		vm.loadImage(image);
+		vm.setMode(mode);
+		vm.launch();
+		uint64_t added = vm.ram.getAt(image.dataAddr), swapped = vm.ram.getAt(image.dataAddr + 1);
+		if (added != ROUNDS * CPUS || swapped != ROUNDS * CPUS) {
+			std::println(stderr, "mode {}: FADD counted {}, CAS counted {}, expected {}", (int)mode, added, swapped, ROUNDS * CPUS);
+			failures++;
+		}
+	}
+	return failures ? 1 : 0;
+}